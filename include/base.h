@@ -84,18 +84,38 @@
     } while (0)
 
 // HASH TABLE
-#define HT_ITER(ht, body)                              \
-    do {                                               \
-        for (size_t i = 0; i < (ht).cap; i++) {        \
-            ht_bucket* bucket = (ht).buckets[i];       \
-            if (!bucket) {                             \
-                continue;                              \
-            }                                          \
-            for (size_t j = 0; j < bucket->len; j++) { \
-                ht_kv_pair kv = bucket->items[j];      \
-                body                                   \
-            }                                          \
-        }                                              \
+// An open addressing table in the style of swiss tables: every slot has a control byte that is
+// either HT_CTRL_EMPTY or the top 7 bits of the hash of its key, so a probe compares the control
+// bytes of a whole group of slots at once and only calls the equality function on slots whose
+// full cached hash matches. The low bits already pick where the probe starts, so the keys it meets
+// mostly share them and they would tell little apart. Probing is linear, which lets deletion shift
+// the following entries back instead of leaving tombstones.
+
+#define HT_GROUP_WIDTH 16
+#define HT_CTRL_EMPTY ((int8_t)-128)
+
+#define HT_ITER(ht, body)                                      \
+    do {                                                       \
+        for (size_t __ht_i = 0; __ht_i < (ht).cap; __ht_i++) { \
+            if ((ht).ctrl[__ht_i] == HT_CTRL_EMPTY) {          \
+                continue;                                      \
+            }                                                  \
+            ht_kv_pair kv = (ht).slots[__ht_i];                \
+            body                                               \
+        }                                                      \
+    } while (0)
+
+// same as HT_ITER, but `kv` points into the table, so the values (and the keys, as long as their
+// hashes stay the same) can be updated in place
+#define HT_ITER_PTR(ht, body)                                  \
+    do {                                                       \
+        for (size_t __ht_i = 0; __ht_i < (ht).cap; __ht_i++) { \
+            if ((ht).ctrl[__ht_i] == HT_CTRL_EMPTY) {          \
+                continue;                                      \
+            }                                                  \
+            ht_kv_pair* kv = &(ht).slots[__ht_i];              \
+            body                                               \
+        }                                                      \
     } while (0)
 
 typedef struct {
@@ -103,18 +123,17 @@ typedef struct {
     void* value;
 } ht_kv_pair;
 
-typedef struct {
-    ht_kv_pair* items;
-    size_t len;
-    size_t cap;
-} ht_bucket;
-
 typedef uint64_t (*ht_hash_func)(const void*);
 typedef bool (*ht_eq_func)(const void*, const void*);
 
 typedef struct {
-    ht_bucket** buckets;
+    // `cap` control bytes followed by a copy of the first HT_GROUP_WIDTH ones, so a group can
+    // be loaded starting at any slot
+    int8_t* ctrl;
+    ht_kv_pair* slots;
+    uint64_t* hashes;
     size_t len;
+    // always a power of two
     size_t cap;
 
     /// the hash function
@@ -365,107 +384,178 @@ BASEDEF void sb_clear(string_builder* sb) {
 
 // HASH TABLE
 
-BASEDEF int ht_load(const hash_table* ht) {
-    return (ht->len / ht->cap) * 100;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif  // __SSE2__
+
+// a bit mask with bit `i` set if the `i`th control byte of the group starting at `ctrl` is `c`
+static inline uint32_t __ht_group_match(const int8_t* ctrl, int8_t c) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < HT_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(ctrl[i] == c) << i;
+    }
+    return mask;
+#endif  // __SSE2__
+}
+
+// hash functions like the identity of a pointer leave the low bits mostly constant, mix them so
+// every bit of the hash depends on every bit of the key's hash
+static inline uint64_t __ht_hash(const hash_table* ht, const void* key) {
+    uint64_t hash = ht->hash_function(key) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 32);
+}
+
+static inline int8_t __ht_h2(uint64_t hash) {
+    // the top bits, since the low ones pick the slot
+    return (int8_t)(hash >> 57);
+}
+
+static inline void __ht_set_ctrl(hash_table* ht, size_t idx, int8_t c) {
+    ht->ctrl[idx] = c;
+    if (idx < HT_GROUP_WIDTH) {
+        ht->ctrl[ht->cap + idx] = c;
+    }
+}
+
+static inline void __ht_alloc(hash_table* ht, size_t cap) {
+    ht->cap = cap;
+    ht->len = 0;
+    ht->slots = (ht_kv_pair*)BASE_ALLOC(cap * sizeof(ht_kv_pair));
+    ht->hashes = (uint64_t*)BASE_ALLOC(cap * sizeof(uint64_t));
+    ht->ctrl = (int8_t*)BASE_ALLOC(cap + HT_GROUP_WIDTH);
+    memset(ht->ctrl, HT_CTRL_EMPTY, cap + HT_GROUP_WIDTH);
 }
 
 BASEDEF hash_table ht_make(ht_hash_func hash_func, ht_eq_func eq_func, size_t cap) {
-    ht_bucket** buckets = (ht_bucket**)calloc(cap, sizeof(ht_bucket*));
+    size_t real_cap = HT_GROUP_WIDTH;
+    while (real_cap < cap) {
+        real_cap *= 2;
+    }
 
-    return (hash_table){
-        .buckets = buckets,
-        .len = 0,
-        .cap = cap,
+    hash_table ht = {
         .hash_function = hash_func,
         .equality_function = eq_func,
     };
-}
+    __ht_alloc(&ht, real_cap);
 
-static inline uint64_t __ht_idx_for(const hash_table* ht, const void* key) {
-    uint64_t hash = ht->hash_function(key);
-    return hash % ht->cap;
+    return ht;
 }
 
-static inline void __ht_grow(hash_table* ht, size_t size) {
-    hash_table new_ht = ht_make(ht->hash_function, ht->equality_function, size);
-
-    HT_ITER(*ht, {
-        ht_add(&new_ht, kv.key, kv.value);
-    });
+/// Returns the slot of `key`, or -1 if it's not in the table
+static inline ssize_t __ht_find_slot(const hash_table* ht, const void* key, uint64_t hash) {
+    size_t mask = ht->cap - 1;
+    int8_t h2 = __ht_h2(hash);
 
-    ht_destroy(ht);
+    for (size_t pos = hash & mask;; pos = (pos + HT_GROUP_WIDTH) & mask) {
+        uint32_t match = __ht_group_match(ht->ctrl + pos, h2);
+        while (match) {
+            size_t idx = (pos + __builtin_ctz(match)) & mask;
+            if (ht->hashes[idx] == hash && ht->equality_function(ht->slots[idx].key, key)) {
+                return idx;
+            }
+            match &= match - 1;
+        }
 
-    *ht = new_ht;
+        if (__ht_group_match(ht->ctrl + pos, HT_CTRL_EMPTY)) {
+            return -1;
+        }
+    }
 }
 
-BASEDEF bool ht_add(hash_table* ht, void* key, void* value) {
-    if (ht_load(ht) >= 70) {
-        __ht_grow(ht, ht->cap * 2);
-    }
+/// Puts an entry whose key is not in the table into the first empty slot of its probe sequence
+static inline void __ht_insert_new(hash_table* ht, void* key, void* value, uint64_t hash) {
+    size_t mask = ht->cap - 1;
 
-    size_t idx = __ht_idx_for(ht, key);
-    ht_bucket* bucket = ht->buckets[idx];
-    ht_kv_pair pair = {.key = key, .value = value};
+    for (size_t pos = hash & mask;; pos = (pos + HT_GROUP_WIDTH) & mask) {
+        uint32_t empty = __ht_group_match(ht->ctrl + pos, HT_CTRL_EMPTY);
+        if (!empty) {
+            continue;
+        }
 
-    if (!bucket) {
-        bucket = (ht_bucket*)BASE_ALLOC(sizeof(ht_bucket));
-        DA_INIT(bucket, 0, 2);
-        DA_ADD(bucket, pair);
-        ht->buckets[idx] = bucket;
+        size_t idx = (pos + __builtin_ctz(empty)) & mask;
+        __ht_set_ctrl(ht, idx, __ht_h2(hash));
+        ht->slots[idx] = (ht_kv_pair){.key = key, .value = value};
+        ht->hashes[idx] = hash;
         ht->len++;
-        return true;
+        return;
     }
+}
 
-    for (size_t i = 0; i < bucket->len; i++) {
-        if (ht->equality_function(key, bucket->items[i].key)) {
-            bucket->items[i].value = value;
-            return false;
+static inline void __ht_grow(hash_table* ht) {
+    hash_table old = *ht;
+    __ht_alloc(ht, old.cap * 2);
+
+    // the hashes are cached, so growing never calls the hash function
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.ctrl[i] != HT_CTRL_EMPTY) {
+            __ht_insert_new(ht, old.slots[i].key, old.slots[i].value, old.hashes[i]);
         }
     }
 
-    DA_ADD(bucket, pair);
-    return true;
+    ht_destroy(&old);
 }
 
-BASEDEF void* ht_find(hash_table* ht, const void* key) {
-    size_t idx = __ht_idx_for(ht, key);
-    ht_bucket* bucket = ht->buckets[idx];
-    if (!bucket) return NULL;
+BASEDEF bool ht_add(hash_table* ht, void* key, void* value) {
+    uint64_t hash = __ht_hash(ht, key);
 
-    for (size_t i = 0; i < bucket->len; i++) {
-        if (ht->equality_function(bucket->items[i].key, key)) return bucket->items[i].value;
+    ssize_t idx = __ht_find_slot(ht, key, hash);
+    if (idx >= 0) {
+        ht->slots[idx].value = value;
+        return false;
     }
 
-    return NULL;
+    // keep the load factor under 7/8
+    if ((ht->len + 1) * 8 > ht->cap * 7) {
+        __ht_grow(ht);
+    }
+
+    __ht_insert_new(ht, key, value, hash);
+    return true;
+}
+
+BASEDEF void* ht_find(hash_table* ht, const void* key) {
+    ssize_t idx = __ht_find_slot(ht, key, __ht_hash(ht, key));
+    return idx >= 0 ? ht->slots[idx].value : NULL;
 }
 
 BASEDEF void* ht_delete(hash_table* ht, const void* key) {
-    size_t idx = __ht_idx_for(ht, key);
-    ht_bucket* bucket = ht->buckets[idx];
-    if (!bucket) {
+    ssize_t found = __ht_find_slot(ht, key, __ht_hash(ht, key));
+    if (found < 0) {
         return NULL;
     }
 
-    for (size_t i = 0; i < bucket->len; i++) {
-        if (ht->equality_function(bucket->items[i].key, key)) {
-            DA_REMOVE(bucket, i);
-            ht->len--;
-            return bucket->items[i].value;
+    void* value = ht->slots[found].value;
+    size_t mask = ht->cap - 1;
+    size_t hole = found;
+
+    // shift back every following entry of the run that can take the hole's place, so no entry
+    // ends up behind an empty slot in its probe sequence
+    for (size_t idx = (hole + 1) & mask; ht->ctrl[idx] != HT_CTRL_EMPTY; idx = (idx + 1) & mask) {
+        size_t home = ht->hashes[idx] & mask;
+        if (((idx - home) & mask) < ((idx - hole) & mask)) {
+            continue;
         }
+
+        __ht_set_ctrl(ht, hole, ht->ctrl[idx]);
+        ht->slots[hole] = ht->slots[idx];
+        ht->hashes[hole] = ht->hashes[idx];
+        hole = idx;
     }
 
-    return NULL;
+    __ht_set_ctrl(ht, hole, HT_CTRL_EMPTY);
+    ht->len--;
+
+    return value;
 }
 
 BASEDEF void ht_destroy(hash_table* ht) {
-    for (size_t i = 0; i < ht->cap; i++) {
-        if (ht->buckets[i]) {
-            DA_FREE(ht->buckets[i]);
-            free(ht->buckets[i]);
-        }
-    }
-
-    free(ht->buckets);
+    free(ht->ctrl);
+    free(ht->slots);
+    free(ht->hashes);
 }
 
 // MISC
@@ -33,16 +33,10 @@ int64_t hash(const kokos_obj_t* obj)
         int64_t result = 0;
         kokos_obj_map_t map = obj->map;
 
-        for (size_t i = 0; i < map.cap; i++) {
-            ht_bucket* bucket = map.buckets[i];
-            if (!bucket)
-                continue;
-
-            for (size_t j = 0; j < bucket->len; j++) {
-                result += hash(bucket->items[i].key);
-                result += hash(bucket->items[i].value);
-            }
-        }
+        HT_ITER(map, {
+            result += hash(kv.key);
+            result += hash(kv.value);
+        });
 
         return result;
     }
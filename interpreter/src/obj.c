@@ -35,16 +35,10 @@ void kokos_obj_mark(kokos_obj_t* obj)
             kokos_obj_mark(obj->macro.body.objs[i]);
         break;
     case OBJ_MAP:
-        for (size_t i = 0; i < obj->map.cap; i++) {
-            ht_bucket* bucket = obj->map.buckets[i];
-            if (!bucket)
-                continue;
-
-            for (size_t j = 0; j < bucket->len; j++) {
-                kokos_obj_mark((kokos_obj_t*)bucket->items[j].key);
-                kokos_obj_mark((kokos_obj_t*)bucket->items[j].value);
-            }
-        }
+        HT_ITER(obj->map, {
+            kokos_obj_mark((kokos_obj_t*)kv.key);
+            kokos_obj_mark((kokos_obj_t*)kv.value);
+        });
         break;
     }
 }
@@ -86,20 +80,13 @@ void kokos_obj_print(kokos_obj_t* obj)
         printf("{");
 
         size_t iter_count = 0;
-        for (size_t i = 0; i < obj->map.cap; i++) {
-            ht_bucket* bucket = obj->map.buckets[i];
-            if (!bucket)
-                continue;
-
-            iter_count++;
-            for (size_t j = 0; j < bucket->len; j++) {
-                kokos_obj_print((kokos_obj_t*)bucket->items[j].key);
+        HT_ITER(obj->map, {
+            kokos_obj_print((kokos_obj_t*)kv.key);
+            printf(" ");
+            kokos_obj_print((kokos_obj_t*)kv.value);
+            if (++iter_count != obj->map.len)
                 printf(" ");
-                kokos_obj_print((kokos_obj_t*)bucket->items[j].value);
-            }
-            if (iter_count != obj->map.len)
-                printf(" ");
-        }
+        });
         printf("}");
         break;
     case OBJ_BUILTIN_PROC: printf("<builtin function>"); break;
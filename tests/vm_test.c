@@ -0,0 +1,641 @@
+#include "aot.h"
+#include "bytecode-cache.h"
+#include "cfg.h"
+#include "compile.h"
+#include "lexer.h"
+#include "parser.h"
+#include "runtime.h"
+#include "scope.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print_value(FILE* out, kokos_value_t value)
+{
+    if (IS_TRUE(value) || IS_FALSE(value) || IS_NIL(value)) {
+        fprintf(out, IS_TRUE(value) ? "true" : IS_FALSE(value) ? "false" : "nil");
+        return;
+    }
+
+    if (IS_DOUBLE(value)) {
+        fprintf(out, "%g", value.as_double);
+        return;
+    }
+
+    switch (VALUE_TAG(value)) {
+    case INT_TAG: fprintf(out, "%d", GET_INT(value)); break;
+    case STRING_TAG: {
+        kokos_runtime_string_t* string = GET_STRING(value);
+        fprintf(out, "\"%.*s\"", (int)string->len, string->ptr);
+        break;
+    }
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vector = GET_VECTOR(value);
+        fprintf(out, "[");
+        for (size_t i = 0; i < vector->len; i++) {
+            fprintf(out, i == 0 ? "" : " ");
+            print_value(out, vector->items[i]);
+        }
+        fprintf(out, "]");
+        break;
+    }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = GET_MAP(value);
+        size_t printed_count = 0;
+        fprintf(out, "{");
+        HT_ITER(map->table, {
+            fprintf(out, printed_count++ == 0 ? "" : " ");
+            print_value(out, FROM_PTR(kv.key));
+            fprintf(out, " ");
+            print_value(out, FROM_PTR(kv.value));
+        });
+        fprintf(out, "}");
+        break;
+    }
+    case PROC_TAG: fprintf(out, "<proc>"); break;
+    default:       assert(false && "unexpected value tag");
+    }
+}
+
+typedef struct {
+    kokos_opt_level_e opt_level;
+    bool jit;
+    // the gc of the vm is configured with the fields below, instead of the defaults
+    bool gc_config;
+    size_t min_heap_size;
+    size_t max_heap_size;
+    uint64_t max_pause_us;
+} run_config_t;
+
+/// A module compiled and run by `program_run`, with the vm it ran in
+typedef struct {
+    kokos_module_t module;
+    kokos_scope_t* scope;
+    kokos_compiled_module_t compiled;
+    kokos_vm_t* vm;
+} program_t;
+
+static program_t program_run(const char* source, const run_config_t* config)
+{
+    program_t program = { 0 };
+
+    kokos_lexer_t lexer = kokos_lex_buf(source, strlen(source));
+    kokos_parser_t parser = kokos_parser_init(&lexer);
+    program.module = kokos_parser_parse_module(&parser);
+    assert(kokos_parser_ok(&parser));
+
+    kokos_compile_set_opt_level(config->opt_level);
+    program.scope = kokos_scope_root();
+    assert(kokos_compile_module(program.module, program.scope, &program.compiled));
+
+    program.vm = kokos_vm_create(program.scope);
+    program.vm->jit_enabled = config->jit;
+    if (config->gc_config) {
+        program.vm->gc.min_heap_size = config->min_heap_size;
+        program.vm->gc.max_heap_size = config->max_heap_size;
+        program.vm->gc.max_pause_us = config->max_pause_us;
+    }
+
+    kokos_vm_load_module(program.vm, &program.compiled);
+    return program;
+}
+
+/// Prints the values `program` left on the stack, separated by spaces. The caller frees the result
+static char* program_results(const program_t* program)
+{
+    char* buf;
+    size_t len;
+    FILE* out = open_memstream(&buf, &len);
+    size_t count;
+    kokos_value_t* results = kokos_vm_results(program->vm, &count);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, i == 0 ? "" : " ");
+        print_value(out, results[i]);
+    }
+    fclose(out);
+
+    return buf;
+}
+
+static void program_destroy(program_t* program)
+{
+    kokos_vm_destroy(program->vm);
+    kokos_module_destroy(program->module);
+    kokos_scope_destroy(program->scope);
+}
+
+static const run_config_t configs[] = {
+    { .opt_level = KOKOS_OPT_NONE, .jit = false },
+    { .opt_level = KOKOS_OPT_NONE, .jit = true },
+    { .opt_level = KOKOS_OPT_BASIC, .jit = false },
+    { .opt_level = KOKOS_OPT_BASIC, .jit = true },
+    { .opt_level = KOKOS_OPT_FULL, .jit = false },
+    { .opt_level = KOKOS_OPT_FULL, .jit = true },
+};
+
+#define CONFIGS_COUNT (sizeof(configs) / sizeof(configs[0]))
+
+/// Runs `source` at every optimization level, with the jit on and off, and checks that it always
+/// leaves `expected` on the stack
+static void check_program(const char* source, const char* expected)
+{
+    for (size_t i = 0; i < CONFIGS_COUNT; i++) {
+        program_t program = program_run(source, &configs[i]);
+        char* results = program_results(&program);
+        if (strcmp(results, expected) != 0) {
+            fprintf(stderr, "%s\n  -O%d%s: expected %s, got %s\n", source, configs[i].opt_level,
+                configs[i].jit ? "" : " --no-jit", expected, results);
+            assert(false);
+        }
+
+        free(results);
+        program_destroy(&program);
+    }
+}
+
+void test_tail_calls(void)
+{
+    // deeper than the frames could ever go without reusing them
+    check_program("(proc count (n acc) (if (= n 0) acc (count (- n 1) (+ acc 1)))) "
+                  "(count 2000000 0)",
+        "2000000");
+    check_program("(proc loop (i n acc) (if (< i n) (loop (+ i 1) n (+ acc i)) acc)) "
+                  "(loop 0 1000 0)",
+        "499500");
+}
+
+void test_hot_procs(void)
+{
+    // called often enough to be compiled by the jit, from the interpreter and from compiled code
+    check_program("(proc fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20)", "6765");
+    check_program("(proc half (x) (/ x 2)) (proc sum (n acc) (if (= n 0) acc (sum (- n 1) (+ acc "
+                  "(half 10.0))))) (sum 500 0)",
+        "2500");
+}
+
+void test_closures(void)
+{
+    check_program("(proc adder (n) (lambda (x) (+ x n))) (var add5 (adder 5)) (add5 10)", "15");
+    // a new closure every time, each one called once
+    check_program("(proc adder (n) (lambda (x) (+ x n))) "
+                  "(proc sum (i acc) (if (= i 0) acc (sum (- i 1) (+ acc ((adder i) i))))) "
+                  "(sum 100 0)",
+        "10100");
+    // the captured value is the one at the time the lambda is evaluated
+    check_program("(proc f () (var x 1) (var g (lambda () x)) (var x 2) [(g) x ]) (f)", "[1 2]");
+    check_program(
+        "(proc outer (a) (lambda (b) (lambda (c) (+ a (+ b c))))) (((outer 1) 2) 3)", "6");
+}
+
+void test_call_caches(void)
+{
+    const char* source = "(proc inc (x) (+ x 1)) (proc twice (x) (inc (inc x))) "
+                         "(proc rep (n acc) (if (= n 0) acc (rep (- n 1) (twice acc)))) "
+                         "(rep 1000 0)";
+
+    for (size_t i = 0; i < CONFIGS_COUNT; i++) {
+        program_t program = program_run(source, &configs[i]);
+
+        // a second vm runs the same code, whose calls already got their caches in the first one
+        program_t again = program;
+        again.vm = kokos_vm_create(program.scope);
+        again.vm->jit_enabled = configs[i].jit;
+        kokos_vm_load_module(again.vm, &program.compiled);
+
+        char* results = program_results(&again);
+        assert(strcmp(results, "2000") == 0);
+        free(results);
+        kokos_vm_destroy(again.vm);
+
+        results = program_results(&program);
+        assert(strcmp(results, "2000") == 0);
+        free(results);
+        program_destroy(&program);
+    }
+}
+
+void test_rest_args(void)
+{
+    check_program("(proc rest-of (a & rest) rest) (rest-of 1 2 3) (rest-of 1)", "[2 3] []");
+    check_program("(proc second (a & rest) a) (second 1 2 3)", "1");
+}
+
+void test_inlining(void)
+{
+    // `sq` is inlined in `use-sq`, which has to notice when it is bound to another procedure, also
+    // once it is compiled by the jit
+    check_program("(proc sq (x) (* x x)) (proc use-sq (y) (sq y)) "
+                  "(proc rep (n acc) (if (= n 0) acc (rep (- n 1) (use-sq 3)))) (rep 100 0) "
+                  "(proc sq (x) (+ x 1)) (rep 100 0) (use-sq 3)",
+        "9 4 4");
+}
+
+void test_constants(void)
+{
+    check_program("(+ 1 2 3) (* 2 (- 10 4)) (/ 10 4) (* 4 1.5)", "6 12 2 6");
+    // divisions by -1 are left to the vm, which still gets them right
+    check_program("(var m (- 0 1)) (/ 10 (- 0 1) (- 0 1)) (/ 7 2 (- 1 2)) (/ 8 m 2 m)", "10 -3 4");
+    check_program("(if (< 1 2) \"yes\" \"no\") (if (>= 1 2) 1 2) (let (a 1 b 2) (+ a b))",
+        "\"yes\" 2 3");
+    check_program("(var x 3) (proc get-x () x) (get-x)", "3");
+}
+
+void test_collections(void)
+{
+    check_program("[1 \"a\" [2 3 ] ] {\"k\" [1 2 ] } (make-vec 1 2)",
+        "[1 \"a\" [2 3]] {\"k\" [1 2]} [1 2]");
+    // a literal is shared by every evaluation, the vectors built from variables are not
+    check_program("(proc lit () [1 2 ]) (proc build (x) [x x ]) [(lit) (lit) (build 1) (build 2) ]",
+        "[[1 2] [1 2] [1 1] [2 2]]");
+}
+
+static const run_config_t gc_configs[] = {
+    // only minor collections, the old space never grows enough for a full one
+    { .opt_level = KOKOS_OPT_BASIC, .jit = true, .gc_config = true,
+        .min_heap_size = GC_MAX_HEAP_SIZE, .max_heap_size = GC_MAX_HEAP_SIZE,
+        .max_pause_us = GC_MAX_PAUSE_US },
+    // a full collection after every minor one, marking everything at once
+    { .opt_level = KOKOS_OPT_BASIC, .jit = true, .gc_config = true, .min_heap_size = 1,
+        .max_heap_size = 1, .max_pause_us = 0 },
+    // the same, marking and sweeping in slices between the minor collections
+    { .opt_level = KOKOS_OPT_BASIC, .jit = false, .gc_config = true, .min_heap_size = 1,
+        .max_heap_size = 1, .max_pause_us = GC_MAX_PAUSE_US },
+};
+
+#define GC_CONFIGS_COUNT (sizeof(gc_configs) / sizeof(gc_configs[0]))
+
+// `nest` builds `[[[nil n "s"] ... 2 "s"] 1 "s"]`, `churn` goes through short-lived vectors and
+// maps
+#define GC_PROGRAM_PRELUDE                                                                         \
+    "(proc third (a b c) c) "                                                                      \
+    "(proc nest (n acc) (if (= n 0) acc (nest (- n 1) [acc n \"s\" ]))) "                          \
+    "(proc churn (n keep) (if (= n 0) keep (churn (- n 1) (third [n n ] {\"k\" n } keep)))) "
+
+/// Checks that `value` is the chain `nest` builds from `n`
+static void check_chain(kokos_value_t value, size_t n)
+{
+    for (size_t i = 1; i <= n; i++) {
+        assert(IS_VECTOR(value));
+        kokos_runtime_vector_t* vec = GET_VECTOR(value);
+        assert(vec->len == 3);
+        assert(IS_DOUBLE(vec->items[1]) ? vec->items[1].as_double == (double)i
+                                        : GET_INT(vec->items[1]) == (int32_t)i);
+        assert(IS_STRING(vec->items[2]) && GET_STRING(vec->items[2])->len == 1);
+        value = vec->items[0];
+    }
+
+    assert(IS_NIL(value));
+}
+
+void test_gc_nested(void)
+{
+    // far deeper than the marking could recurse, and kept alive over many collections
+    const char* source = GC_PROGRAM_PRELUDE "(churn 200000 (nest 100000 nil))";
+
+    for (size_t i = 0; i < GC_CONFIGS_COUNT; i++) {
+        program_t program = program_run(source, &gc_configs[i]);
+
+        size_t count;
+        kokos_value_t* results = kokos_vm_results(program.vm, &count);
+        assert(count == 1);
+        check_chain(results[0], 100000);
+
+        // whether a full collection ever finished
+        assert((program.vm->gc.live_size > 0) == (gc_configs[i].min_heap_size == 1));
+
+        program_destroy(&program);
+    }
+}
+
+void test_gc_closures(void)
+{
+    // every closure captures the previous one, unwrapping them calls each of them
+    const char* source = GC_PROGRAM_PRELUDE
+        "(proc wrap (n acc) (if (= n 0) acc (wrap (- n 1) (lambda () acc)))) "
+        "(proc unwrap (f n) (if (= f nil) n (unwrap (f) (+ n 1)))) "
+        "(unwrap (churn 100000 (wrap 50000 nil)) 0)";
+
+    for (size_t i = 0; i < GC_CONFIGS_COUNT; i++) {
+        program_t program = program_run(source, &gc_configs[i]);
+        char* results = program_results(&program);
+        assert(strcmp(results, "50000") == 0);
+        free(results);
+        program_destroy(&program);
+    }
+}
+
+void test_gc_reclaims(void)
+{
+    // every chain lives through a few minor collections before it is dropped
+    const char* source = GC_PROGRAM_PRELUDE
+        "(proc waves (i) (if (= i 0) 0 (waves (third (nest 20000 nil) 0 (- i 1))))) "
+        "(waves 40) (nest 10 nil)";
+
+    for (size_t i = 0; i < GC_CONFIGS_COUNT; i++) {
+        program_t program = program_run(source, &gc_configs[i]);
+
+        size_t count;
+        kokos_value_t* results = kokos_vm_results(program.vm, &count);
+        assert(count == 2);
+        check_chain(results[1], 10);
+
+        kokos_gc_t* gc = &program.vm->gc;
+        if (gc_configs[i].min_heap_size == 1) {
+            // far less than the 40 chains together
+            assert(gc->heap_size < 8 * 1024 * 1024);
+        }
+
+        // the pages the last collection left unswept can still be swept
+        kokos_gc_finish_sweep(gc);
+        assert(!gc->sweeping);
+
+        program_destroy(&program);
+    }
+}
+
+#define CODE(instrs)                                                                               \
+    ((kokos_code_t) { .items = (instrs), .len = sizeof(instrs) / sizeof((instrs)[0]) })
+
+void test_cfg_branches(void)
+{
+    size_t else_label = 5;
+    size_t end_label = 7;
+    kokos_instruction_t instrs[] = {
+        // block 0
+        INSTR_LOAD_SLOT(0),
+        INSTR_JZ(&else_label),
+        // block 1
+        INSTR_PUSH(KOKOS_NIL),
+        INSTR_STORE_SLOT(1),
+        INSTR_BRANCH(&end_label),
+        // block 2
+        INSTR_PUSH(KOKOS_NIL),
+        INSTR_STORE_SLOT(1),
+        // block 3
+        INSTR_LOAD_SLOT(1),
+        INSTR_RET,
+        // block 4, never reached
+        INSTR_LOAD_SLOT(2),
+        INSTR_RET,
+    };
+    kokos_code_t code = CODE(instrs);
+
+    kokos_cfg_t cfg;
+    kokos_cfg_build(&code, &cfg);
+
+    assert(cfg.len == 5);
+    assert(cfg.items[1].start == 2 && cfg.items[1].end == 5);
+    assert(cfg.items[0].succs_count == 2);
+    assert(cfg.items[0].succs[0] == 2 && cfg.items[0].succs[1] == 1);
+    assert(cfg.items[1].succs_count == 1 && cfg.items[1].succs[0] == 3);
+    assert(cfg.items[3].preds.len == 2);
+
+    assert(cfg.items[1].idom == 0 && cfg.items[2].idom == 0 && cfg.items[3].idom == 0);
+    assert(kokos_cfg_dominates(&cfg, 0, 3));
+    assert(kokos_cfg_dominates(&cfg, 3, 3));
+    assert(!kokos_cfg_dominates(&cfg, 1, 3));
+    assert(!kokos_cfg_dominates(&cfg, 2, 3));
+    assert(!cfg.items[4].reachable);
+    assert(!kokos_cfg_dominates(&cfg, 0, 4));
+
+    size_t slots_count = kokos_code_slots_count(&code);
+    assert(slots_count == 3);
+
+    bool* live = kokos_cfg_live_slots(&cfg, &code, slots_count);
+    // slot 1 is written on both paths before it is read
+    assert(live[0 * slots_count + 0] && !live[0 * slots_count + 1]);
+    assert(!live[1 * slots_count + 0] && !live[1 * slots_count + 1]);
+    assert(!live[2 * slots_count + 1]);
+    assert(live[3 * slots_count + 1] && !live[3 * slots_count + 0]);
+
+    KOKOS_FREE(live);
+    kokos_cfg_free(&cfg);
+}
+
+void test_cfg_loop(void)
+{
+    size_t head_label = 2;
+    size_t exit_label = 6;
+    kokos_instruction_t instrs[] = {
+        // block 0
+        INSTR_PUSH(KOKOS_NIL),
+        INSTR_STORE_SLOT(0),
+        // block 1, the loop head
+        INSTR_LOAD_SLOT(0),
+        INSTR_JZ(&exit_label),
+        // block 2, the loop body
+        INSTR_LOAD_SLOT(1),
+        INSTR_BRANCH(&head_label),
+        // block 3
+        INSTR_LOAD_SLOT(0),
+        INSTR_RET,
+    };
+    kokos_code_t code = CODE(instrs);
+
+    kokos_cfg_t cfg;
+    kokos_cfg_build(&code, &cfg);
+
+    assert(cfg.len == 4);
+    assert(cfg.items[1].preds.len == 2);
+    assert(cfg.items[2].idom == 1 && cfg.items[3].idom == 1);
+    assert(kokos_cfg_dominates(&cfg, 1, 2));
+    assert(!kokos_cfg_dominates(&cfg, 2, 1));
+    assert(!kokos_cfg_dominates(&cfg, 2, 3));
+
+    // the head comes before the body and the exit in reverse postorder
+    assert(cfg.order_len == 4 && cfg.order[0] == 0 && cfg.order[1] == 1);
+
+    size_t slots_count = kokos_code_slots_count(&code);
+    bool* live = kokos_cfg_live_slots(&cfg, &code, slots_count);
+    // slot 1 is read by the body and never written, so it is live all around the loop
+    assert(!live[0 * slots_count + 0] && live[0 * slots_count + 1]);
+    assert(live[1 * slots_count + 0] && live[1 * slots_count + 1]);
+    assert(live[2 * slots_count + 0] && live[2 * slots_count + 1]);
+    assert(live[3 * slots_count + 0] && !live[3 * slots_count + 1]);
+
+    KOKOS_FREE(live);
+    kokos_cfg_free(&cfg);
+}
+
+void test_dead_stores(void)
+{
+    // the stores of `x` are dead, the one of `y` is not
+    check_program("(proc f () (var x 1) (var y 2) (var x 3) y) (f)", "2");
+    // the store of the second `x` is dead, the one of `g` is not
+    check_program("(proc f () (var x 1) (var g (lambda () x)) (var x 2) (g)) (f)", "1");
+    // the only slot of the procedure is stored and never read
+    check_program("(proc f () (var x 1) 2) (f)", "2");
+}
+
+// procedures, closures, strings, constants and collections all have to survive serialization
+#define IMAGE_PROGRAM                                                                              \
+    "(proc fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) "                               \
+    "(proc adder (x) (lambda (y) (+ x y))) "                                                       \
+    "(proc tail (x & xs) xs) "                                                                     \
+    "(var add2 (adder 2)) "                                                                        \
+    "[(fib 20) (add2 3) (tail 1 \"a\" \"b\") {\"k\" [1 2 ] } (* 2 3) ]"
+
+void test_bytecode_images(void)
+{
+    const char* expected = "[6765 5 [\"a\" \"b\"] {\"k\" [1 2]} 6]";
+    uint64_t source_hash = kokos_bytecode_cache_hash(IMAGE_PROGRAM, strlen(IMAGE_PROGRAM));
+
+    for (size_t i = 0; i < CONFIGS_COUNT; i++) {
+        program_t program = program_run(IMAGE_PROGRAM, &configs[i]);
+
+        kokos_bytecode_image_t image;
+        assert(kokos_bytecode_image_build(&program.compiled, source_hash, &image));
+
+        // an image of other source is stale
+        kokos_scope_t* stale_scope = kokos_scope_root();
+        kokos_compiled_module_t stale;
+        assert(!kokos_bytecode_image_load(
+            image.data, image.size, source_hash + 1, stale_scope, &stale, NULL));
+        kokos_scope_destroy(stale_scope);
+
+        kokos_scope_t* scope = kokos_scope_root();
+        kokos_compiled_module_t compiled;
+        assert(kokos_bytecode_image_load(
+            image.data, image.size, source_hash, scope, &compiled, NULL));
+
+        kokos_vm_t* vm = kokos_vm_create(scope);
+        vm->jit_enabled = configs[i].jit;
+        kokos_vm_load_module(vm, &compiled);
+
+        // runs the loaded module like the one it was built from
+        program_t loaded = { .scope = scope, .compiled = compiled, .vm = vm };
+        char* results = program_results(&loaded);
+        assert(strcmp(results, expected) == 0);
+        free(results);
+
+        kokos_vm_destroy(vm);
+        kokos_scope_destroy(scope);
+        kokos_bytecode_image_free(&image);
+        program_destroy(&program);
+    }
+}
+
+/// Loads the first `size` bytes of `image` into a fresh scope, with the byte at `flip` inverted if
+/// there is one, and checks that a load that fails leaves the scope's constants and procedures as
+/// they were. Returns whether the load succeeded
+static bool image_load_corrupted(
+    const kokos_bytecode_image_t* image, size_t size, size_t flip, uint64_t source_hash)
+{
+    // a copy of just `size` bytes, so reading past them is caught by the sanitizers
+    char* data = malloc(size + 1);
+    memcpy(data, image->data, size);
+    if (flip < size) {
+        data[flip] = ~data[flip];
+    }
+
+    kokos_scope_t* scope = kokos_scope_root();
+    size_t constants_len = scope->constants->len;
+    size_t procs_len = scope->procs.len;
+
+    kokos_compiled_module_t compiled;
+    bool ok = kokos_bytecode_image_load(data, size, source_hash, scope, &compiled, NULL);
+    if (!ok) {
+        assert(scope->constants->len == constants_len);
+        assert(scope->procs.len == procs_len);
+    }
+
+    kokos_scope_destroy(scope);
+    free(data);
+    return ok;
+}
+
+void test_corrupted_bytecode_images(void)
+{
+    uint64_t source_hash = kokos_bytecode_cache_hash(IMAGE_PROGRAM, strlen(IMAGE_PROGRAM));
+    program_t program = program_run(IMAGE_PROGRAM, &configs[0]);
+
+    kokos_bytecode_image_t image;
+    assert(kokos_bytecode_image_build(&program.compiled, source_hash, &image));
+    assert(image_load_corrupted(&image, image.size, SIZE_MAX, source_hash));
+
+    // an image cut short anywhere is rejected
+    size_t truncated[] = { 0, 8, 55, 56, 64, image.size / 2, image.size - 16, image.size - 8 };
+    for (size_t i = 0; i < sizeof(truncated) / sizeof(truncated[0]); i++) {
+        assert(!image_load_corrupted(&image, truncated[i], SIZE_MAX, source_hash));
+    }
+
+    // so is one with a count of the header or the length of the first string past the end of the
+    // file, see `kokos_cache_header_t` for the offsets
+    size_t flipped[] = {
+        0,  // magic
+        4,  // version
+        8,  // instruction_types
+        15, // strings_count
+        19, // procs_count
+        23, // constants_count
+        39, // code_len
+        47, // locals_count
+        63, // length of the first string
+    };
+    for (size_t i = 0; i < sizeof(flipped) / sizeof(flipped[0]); i++) {
+        assert(!image_load_corrupted(&image, image.size, flipped[i], source_hash));
+    }
+
+    // the last instruction of the module is its return, without which it runs off its end
+    assert(!image_load_corrupted(&image, image.size, image.size - 16, source_hash));
+
+    // any other flipped byte either still makes a valid image, like one of a string or of the
+    // value of a constant, or is caught
+    for (size_t i = 0; i < image.size; i++) {
+        image_load_corrupted(&image, image.size, i, source_hash);
+    }
+
+    kokos_bytecode_image_free(&image);
+    program_destroy(&program);
+}
+
+void test_aot(void)
+{
+    uint64_t source_hash = kokos_bytecode_cache_hash(IMAGE_PROGRAM, strlen(IMAGE_PROGRAM));
+
+    for (size_t i = 0; i < CONFIGS_COUNT; i++) {
+        program_t program = program_run(IMAGE_PROGRAM, &configs[i]);
+
+        char* buf;
+        size_t len;
+        FILE* out = open_memstream(&buf, &len);
+        assert(kokos_aot_emit_c(out, "test.kokos", &program.compiled, source_hash));
+        fclose(out);
+
+        // the generated program is built around the runtime's main
+        assert(strstr(buf, "kokos_aot_main") != NULL);
+        free(buf);
+
+        program_destroy(&program);
+    }
+}
+
+int main()
+{
+    // calls
+    test_tail_calls();
+    test_hot_procs();
+    test_closures();
+    test_call_caches();
+    test_rest_args();
+    // control flow graphs
+    test_cfg_branches();
+    test_cfg_loop();
+    // optimization passes
+    test_inlining();
+    test_constants();
+    test_dead_stores();
+    // values
+    test_collections();
+    // serialization
+    test_bytecode_images();
+    test_corrupted_bytecode_images();
+    test_aot();
+    // garbage collection
+    test_gc_nested();
+    test_gc_closures();
+    test_gc_reclaims();
+}
@@ -0,0 +1,423 @@
+#include "aot.h"
+#include "bytecode-cache.h"
+#include "hash.h"
+#include "macros.h"
+#include "runtime.h"
+#include "scope.h"
+#include "vm.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+// The generated functions have the signature of jit code and are attached to the procedures the
+// same way, so the vm calls into them and they call back into the vm exactly like jit code does.
+// Their operands are read from the loaded instructions whenever they hold a pointer, everything
+// else is inlined as a constant.
+
+static const char* instruction_enum_names[] = {
+#define X(t, s) [I_##t] = "I_" #t,
+    ENUMERATE_INSTRUCTIONS
+#undef X
+};
+
+/// Whether `code` can be compiled, which takes the same as for the jit: a known stack depth before
+/// every instruction, slots inside the frame and a `I_RET` at the end
+static bool kokos_aot_compilable(const kokos_code_t* code, size_t locals_count, size_t* depths)
+{
+    if (code->len == 0 || code->items[code->len - 1].type != I_RET) {
+        return false;
+    }
+
+    TRY(kokos_code_stack_depths(code, depths));
+
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        bool slot = instr.type == I_LOAD_SLOT || instr.type == I_STORE_SLOT
+            || instr.type == I_LOAD_REST;
+        if (depths[i] != SIZE_MAX && slot && instr.operand >= locals_count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Whether the operand of the push `instr` is a pointer, which is only known once the image is
+/// loaded
+static bool push_operand_is_pointer(kokos_instruction_t instr)
+{
+    kokos_value_t value = { .as_int = instr.operand };
+    return !IS_DOUBLE(value) && (IS_STRING(value) || IS_SYM(value) || IS_PROC(value));
+}
+
+/// Writes the first `depth` stack values to the frame's operands, for the vm to see
+static void emit_spill(FILE* out, const char* indent, size_t depth)
+{
+    for (size_t i = 0; i < depth; i++) {
+        fprintf(out, "%sstack[%zu] = s%zu;\n", indent, i, i);
+    }
+
+    fprintf(out, "%svm->stack.sp = operands + %zu;\n", indent, depth);
+}
+
+/// Finds the frame's slots and operands again after a call, which can move the value stack
+static void emit_rebase(FILE* out, const char* indent)
+{
+    fprintf(out, "%slocals = vm->stack.data + base;\n", indent);
+    fprintf(out, "%sstack = vm->stack.data + operands;\n", indent);
+}
+
+/// Reads the first `depth` stack values back from the frame, the gc could have moved any of them
+static void emit_reload(FILE* out, const char* indent, size_t depth)
+{
+    for (size_t i = 0; i < depth; i++) {
+        fprintf(out, "%ss%zu = stack[%zu];\n", indent, i, i);
+    }
+}
+
+/// Executes the instruction at `index` by calling back into the vm
+static void emit_step(FILE* out, const char* indent, kokos_instruction_t instr, size_t index,
+    size_t depth, size_t after)
+{
+    emit_spill(out, indent, depth);
+    fprintf(out, "%sif (!kokos_vm_jit_step(vm, %s, code[%zu].operand)) {\n", indent,
+        instruction_enum_names[instr.type], index);
+    fprintf(out, "%s    return KOKOS_JIT_THROW;\n", indent);
+    fprintf(out, "%s}\n", indent);
+    emit_reload(out, indent, after);
+}
+
+/// Gets the C operator a fused compare-and-jump tests the result of `I_CMP` against 0 with
+static const char* compare_jump_op(kokos_instruction_type_e type)
+{
+    switch (type) {
+    case I_JLT: return "<";
+    case I_JGT: return ">";
+    case I_JLE: return "<=";
+    case I_JGE: return ">=";
+    case I_JEQ: return "==";
+    case I_JNE: return "!=";
+    default:    KOKOS_TODO("operator of a jump that does not compare");
+    }
+}
+
+static void emit_instruction(
+    FILE* out, kokos_instruction_t instr, size_t index, size_t depth, size_t after)
+{
+    // the generated code has integer fast paths of its own
+    instr = kokos_instruction_generic(instr);
+
+    switch (instr.type) {
+    case I_PUSH:
+        if (push_operand_is_pointer(instr)) {
+            fprintf(out, "    s%zu.as_int = code[%zu].operand;\n", depth, index);
+        } else {
+            fprintf(out, "    s%zu.as_int = 0x%016" PRIx64 "ull;\n", depth, instr.operand);
+        }
+        break;
+    case I_PUSH_CONST:
+        // the pool can grow while other modules are compiled, so its items are loaded every time
+        fprintf(out, "    s%zu = vm->store.constants->items[code[%zu].operand];\n", depth, index);
+        break;
+    case I_POP:        break;
+    case I_LOAD_SLOT:
+        fprintf(out, "    s%zu = locals[%" PRIu64 "];\n", depth, instr.operand);
+        break;
+    case I_STORE_SLOT:
+        fprintf(out, "    locals[%" PRIu64 "] = s%zu;\n", instr.operand, depth - 1);
+        break;
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+    case I_CMP: {
+        if (instr.type != I_CMP && instr.operand != 2) {
+            emit_step(out, "    ", instr, index, depth, after);
+            break;
+        }
+
+        const char* op = instr.type == I_ADD ? "ADD"
+            : instr.type == I_SUB            ? "SUB"
+            : instr.type == I_MUL            ? "MUL"
+                                             : "CMP";
+        size_t lhs = depth - 2, rhs = depth - 1;
+        fprintf(out, "    if (KOKOS_AOT_BOTH_INT(s%zu, s%zu)) {\n", lhs, rhs);
+        fprintf(out, "        s%zu = KOKOS_AOT_%s(s%zu, s%zu);\n", lhs, op, lhs, rhs);
+        fprintf(out, "    } else {\n");
+        emit_step(out, "        ", instr, index, depth, after);
+        fprintf(out, "    }\n");
+        break;
+    }
+    case I_IS_CALLEE:
+        fprintf(out, "    s%zu = KOKOS_AOT_BOOL(kokos_vm_jit_is_callee(vm, &code[%zu], s%zu));\n",
+            depth - 1, index, depth - 1);
+        break;
+    case I_EQ:
+    case I_NEQ:
+        fprintf(out, "    s%zu = KOKOS_AOT_BOOL(s%zu.as_int %s 0x%016" PRIx64 "ull);\n", depth - 1,
+            depth - 1, instr.type == I_EQ ? "==" : "!=", instr.operand);
+        break;
+    case I_DIV:
+    case I_GET_GLOBAL:
+    case I_ADD_GLOBAL:
+    case I_ALLOC:
+    case I_LOAD_REST:  emit_step(out, "    ", instr, index, depth, after); break;
+    case I_BRANCH:     fprintf(out, "    goto L%zu;\n", *(size_t*)instr.operand); break;
+    case I_JZ:
+    case I_JNZ:
+        fprintf(out, "    if (%sKOKOS_AOT_FALSY(s%zu)) {\n", instr.type == I_JZ ? "" : "!",
+            depth - 1);
+        fprintf(out, "        goto L%zu;\n", *(size_t*)instr.operand);
+        fprintf(out, "    }\n");
+        break;
+    case I_JLT:
+    case I_JGT:
+    case I_JLE:
+    case I_JGE:
+    case I_JEQ:
+    case I_JNE:        {
+        // compares like `I_CMP` into the lhs, then jumps on the -1, 0 or 1 it got
+        size_t lhs = depth - 2, rhs = depth - 1;
+        fprintf(out, "    if (KOKOS_AOT_BOTH_INT(s%zu, s%zu)) {\n", lhs, rhs);
+        fprintf(out, "        s%zu = KOKOS_AOT_CMP(s%zu, s%zu);\n", lhs, lhs, rhs);
+        fprintf(out, "    } else if (KOKOS_AOT_BOTH_DOUBLE(s%zu, s%zu)) {\n", lhs, rhs);
+        fprintf(out, "        s%zu = KOKOS_AOT_CMP_DOUBLE(s%zu, s%zu);\n", lhs, lhs, rhs);
+        fprintf(out, "    } else {\n");
+        kokos_instruction_t cmp = INSTR_CMP;
+        emit_step(out, "        ", cmp, index, depth, depth - 1);
+        fprintf(out, "    }\n");
+        fprintf(out, "    if ((int64_t)s%zu.as_int %s 0) {\n", lhs, compare_jump_op(instr.type));
+        fprintf(out, "        goto L%zu;\n", *(size_t*)instr.operand);
+        fprintf(out, "    }\n");
+        break;
+    }
+    case I_CALL:
+    case I_CALL0:
+    case I_CALL1:
+    case I_CALL2:
+    case I_CALL3:
+        emit_spill(out, "    ", depth);
+        fprintf(out, "    if (!kokos_vm_jit_call(vm, &code[%zu])) {\n", index);
+        fprintf(out, "        return KOKOS_JIT_THROW;\n");
+        fprintf(out, "    }\n");
+        emit_rebase(out, "    ");
+        emit_reload(out, "    ", after);
+        break;
+    case I_TAIL_CALL:
+        // anything but a native callee ends the function
+        emit_spill(out, "    ", depth);
+        fprintf(out, "    {\n");
+        fprintf(out,
+            "        kokos_jit_status_e status = kokos_vm_jit_tail_call(vm, &code[%zu]);\n", index);
+        fprintf(out, "        if (status != KOKOS_JIT_CONTINUE) {\n");
+        fprintf(out, "            return status;\n");
+        fprintf(out, "        }\n");
+        fprintf(out, "    }\n");
+        emit_rebase(out, "    ");
+        emit_reload(out, "    ", after);
+        break;
+    case I_RET:
+        emit_spill(out, "    ", depth);
+        fprintf(out, "    return KOKOS_JIT_RETURN;\n");
+        break;
+    // `kokos_aot_compilable` rejects everything else
+    default: KOKOS_TODO("compiling the instruction ahead of time");
+    }
+}
+
+/// Writes `code`, which has to be compilable, as a C function called `name` that finds its
+/// instructions at `index` of `aot_code`
+static void emit_function(
+    FILE* out, const char* name, size_t index, const kokos_code_t* code, const size_t* depths)
+{
+    bool* targets = KOKOS_CALLOC(code->len, sizeof(bool));
+    size_t* afters = KOKOS_CALLOC(code->len, sizeof(size_t));
+    size_t max_depth = 0;
+
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if (depths[i] == SIZE_MAX) {
+            continue;
+        }
+
+        size_t pops, pushes;
+        kokos_instruction_stack_effect(instr, &pops, &pushes);
+        afters[i] = depths[i] - pops + pushes;
+        if (afters[i] > max_depth) {
+            max_depth = afters[i];
+        }
+
+        if (kokos_instruction_is_jump(instr.type)) {
+            targets[*(size_t*)instr.operand] = true;
+        }
+    }
+
+    fprintf(out, "static kokos_jit_status_e %s(kokos_vm_t* vm, kokos_frame_t* frame)\n{\n", name);
+    fprintf(out, "    kokos_instruction_t* code = aot_code[%zu];\n", index);
+    fprintf(out, "    size_t base = frame->base;\n");
+    fprintf(out, "    size_t operands = base + frame->locals_count;\n");
+    fprintf(out, "    kokos_value_t* locals = vm->stack.data + base;\n");
+    fprintf(out, "    kokos_value_t* stack = vm->stack.data + operands;\n");
+    for (size_t i = 0; i < max_depth; i++) {
+        fprintf(out, "    kokos_value_t s%zu;\n", i);
+    }
+    fprintf(out, "    (void)code;\n    (void)locals;\n    (void)stack;\n\n");
+
+    for (size_t i = 0; i < code->len; i++) {
+        // nothing jumps to unreachable code, so there is no need to translate it
+        if (depths[i] == SIZE_MAX) {
+            continue;
+        }
+
+        if (targets[i]) {
+            fprintf(out, "L%zu:\n", i);
+        }
+
+        emit_instruction(out, code->items[i], i, depths[i], afters[i]);
+    }
+
+    fprintf(out, "}\n\n");
+
+    KOKOS_FREE(targets);
+    KOKOS_FREE(afters);
+}
+
+/// Compiles `code` to a function called `name` if it can be compiled
+static bool emit_function_if_compilable(FILE* out, const char* name, size_t index,
+    const kokos_code_t* code, size_t locals_count)
+{
+    size_t* depths = KOKOS_CALLOC(code->len + 1, sizeof(size_t));
+    bool ok = kokos_aot_compilable(code, locals_count, depths);
+    if (ok) {
+        emit_function(out, name, index, code, depths);
+    }
+
+    KOKOS_FREE(depths);
+    return ok;
+}
+
+bool kokos_aot_emit_c(FILE* out, const char* source_name, const kokos_compiled_module_t* module,
+    uint64_t source_hash)
+{
+    kokos_bytecode_image_t image;
+    TRY(kokos_bytecode_image_build(module, source_hash, &image));
+    KOKOS_ASSERT(image.size % sizeof(uint64_t) == 0);
+
+    hash_table proc_names = ht_make(hash_sizet_func, hash_sizet_eq_func, 17);
+    HT_ITER(module->procs, { ht_add(&proc_names, kv.value, kv.key); });
+
+    fprintf(out, "// Generated by `kokosvm --emit-c` from %s, do not edit.\n", source_name);
+    fprintf(out, "// Build it against the runtime, from the build directory of kokos:\n");
+    fprintf(out,
+        "//   cc -O2 -o program program.c -I<kokos>/include -I<kokos>/lexer/src -I<kokos>/vm "
+        "-I<kokos>/vm/src vm/libkokosrt.a lexer/libkokoslexer.a -lm\n\n");
+    fprintf(out, "#include \"aot.h\"\n#include \"vm.h\"\n\n");
+    fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n\n");
+    fprintf(out, "static kokos_instruction_t* aot_code[%zu];\n\n", image.procs_count + 1);
+
+    bool* compiled = KOKOS_CALLOC(image.procs_count + 1, sizeof(bool));
+    char name[64];
+
+    for (size_t i = 0; i < image.procs_count; i++) {
+        const kokos_runtime_proc_t* proc = image.procs[i];
+        if (proc->type != PROC_KOKOS) {
+            continue;
+        }
+
+        const kokos_runtime_string_t* proc_name = ht_find(&proc_names, proc);
+        if (proc_name) {
+            fprintf(out, "// " RT_STRING_FMT "\n", RT_STRING_ARG(*proc_name));
+        }
+
+        snprintf(name, sizeof(name), "kokos_aot_proc_%zu", i);
+        compiled[i] = emit_function_if_compilable(
+            out, name, i, &proc->kokos.code, proc->kokos.locals_count);
+    }
+
+    compiled[image.procs_count] = emit_function_if_compilable(out, "kokos_aot_module",
+        image.procs_count, &module->instructions, module->locals_count);
+
+    // what can't be compiled stays interpreted
+    fprintf(out, "static const kokos_jit_entry_t aot_entries[] = {\n");
+    for (size_t i = 0; i < image.procs_count; i++) {
+        if (compiled[i]) {
+            fprintf(out, "    kokos_aot_proc_%zu,\n", i);
+        } else {
+            fprintf(out, "    NULL,\n");
+        }
+    }
+    fprintf(out, "    %s,\n};\n\n", compiled[image.procs_count] ? "kokos_aot_module" : "NULL");
+
+    // stored as words, so the image is aligned like the loader expects
+    fprintf(out, "static const uint64_t aot_image[] = {");
+    const uint64_t* words = (const uint64_t*)image.data;
+    for (size_t i = 0; i < image.size / sizeof(uint64_t); i++) {
+        fprintf(out, "%s0x%016" PRIx64 "ull,", i % 4 == 0 ? "\n    " : " ", words[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "int main(int argc, char* argv[])\n{\n");
+    fprintf(out, "    kokos_aot_program_t program = {\n");
+    fprintf(out, "        .image = (const char*)aot_image,\n");
+    fprintf(out, "        .image_size = sizeof(aot_image),\n");
+    fprintf(out, "        .source_hash = 0x%016" PRIx64 "ull,\n", source_hash);
+    fprintf(out, "        .entries = aot_entries,\n");
+    fprintf(out, "        .code = aot_code,\n");
+    fprintf(out, "        .procs_count = %zu,\n", image.procs_count);
+    fprintf(out, "    };\n\n");
+    fprintf(out, "    return kokos_aot_main(&program, argc, argv);\n}\n");
+
+    KOKOS_FREE(compiled);
+    ht_destroy(&proc_names);
+    kokos_bytecode_image_free(&image);
+
+    return !ferror(out);
+}
+
+int kokos_aot_main(const kokos_aot_program_t* program, int argc, char* argv[])
+{
+    bool dump = false;
+    if (argc > 1) {
+        if (argc > 2 || strcmp(argv[1], "--dump") != 0) {
+            fprintf(stderr, "usage: %s [--dump]\n", argv[0]);
+            return 1;
+        }
+
+        dump = true;
+    }
+
+    kokos_scope_t* scope = kokos_scope_root();
+    kokos_compiled_module_t module;
+    kokos_runtime_proc_t** procs
+        = KOKOS_CALLOC(program->procs_count + 1, sizeof(kokos_runtime_proc_t*));
+
+    if (!kokos_bytecode_image_load(
+            program->image, program->image_size, program->source_hash, scope, &module, procs)) {
+        fprintf(stderr, "ERROR: the program was generated for another version of the runtime\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < program->procs_count; i++) {
+        if (!program->entries[i]) {
+            continue;
+        }
+
+        KOKOS_ASSERT(procs[i]->type == PROC_KOKOS);
+        program->code[i] = procs[i]->kokos.code.items;
+        procs[i]->kokos.jit = kokos_jit_code_from(program->entries[i]);
+    }
+
+    program->code[program->procs_count] = module.instructions.items;
+
+    kokos_vm_t* vm = kokos_vm_create(scope);
+    kokos_vm_load_compiled_module(vm, &module, program->entries[program->procs_count]);
+
+    if (dump) {
+        kokos_vm_dump(vm);
+    }
+
+    KOKOS_FREE(procs);
+    kokos_scope_destroy(scope);
+    kokos_vm_destroy(vm);
+
+    return 0;
+}
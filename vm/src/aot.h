@@ -0,0 +1,59 @@
+#ifndef AOT_H_
+#define AOT_H_
+
+#include "compile.h"
+#include "instruction.h"
+#include "jit.h"
+#include "value.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/// A module compiled ahead of time, this is what the C code written by `kokos_aot_emit_c` defines
+typedef struct {
+    // the module's bytecode image, see `kokos_bytecode_image_build`
+    const char* image;
+    size_t image_size;
+    uint64_t source_hash;
+
+    // the compiled code of every procedure of the image's procedure table, NULL for the ones that
+    // stay interpreted, followed by the code of the module itself
+    const kokos_jit_entry_t* entries;
+    // receives the instructions every entry was compiled from, since their operands only get their
+    // final values when the image is loaded, and the calls keep their inline caches in them
+    kokos_instruction_t** code;
+    size_t procs_count;
+} kokos_aot_program_t;
+
+/// Writes a C translation unit to `out` that runs `module` once it is linked against the runtime.
+/// Every procedure and the module's top-level code become C functions that keep the operand stack
+/// in C locals, and the module itself is embedded as a bytecode image
+bool kokos_aot_emit_c(FILE* out, const char* source_name, const kokos_compiled_module_t* module,
+    uint64_t source_hash);
+
+/// Loads and runs `program`, this is the `main` of the generated code
+int kokos_aot_main(const kokos_aot_program_t* program, int argc, char* argv[]);
+
+// The generated code does integer arithmetic and comparisons inline, with the same 32-bit
+// wrapping as the interpreter, and so are the comparisons of two doubles that decide a jump
+
+#define KOKOS_AOT_BOTH_INT(a, b) (VALUE_TAG((a)) == INT_TAG && VALUE_TAG((b)) == INT_TAG)
+#define KOKOS_AOT_INT(i) ((kokos_value_t) { .as_int = TO_INT((int32_t)(i)) })
+#define KOKOS_AOT_ADD(a, b) KOKOS_AOT_INT((uint32_t)GET_INT((a)) + (uint32_t)GET_INT((b)))
+#define KOKOS_AOT_SUB(a, b) KOKOS_AOT_INT((uint32_t)GET_INT((a)) - (uint32_t)GET_INT((b)))
+#define KOKOS_AOT_MUL(a, b) KOKOS_AOT_INT((uint32_t)GET_INT((a)) * (uint32_t)GET_INT((b)))
+// pushes the raw -1, 0 or 1 like `I_CMP`
+#define KOKOS_AOT_CMP(a, b)                                                                        \
+    ((kokos_value_t) { .as_int = (uint64_t)(int64_t)((GET_INT((a)) > GET_INT((b)))                 \
+                           - (GET_INT((a)) < GET_INT((b)))) })
+#define KOKOS_AOT_BOTH_DOUBLE(a, b) (IS_DOUBLE((a)) && IS_DOUBLE((b)))
+// `I_CMP` on two doubles
+#define KOKOS_AOT_CMP_DOUBLE(a, b)                                                                 \
+    ((kokos_value_t) { .as_int = (a).as_int == (b).as_int ? 0                                      \
+            : (a).as_double < (b).as_double              ? (uint64_t)-1                            \
+                                                          : 1 })
+#define KOKOS_AOT_BOOL(c) ((c) ? KOKOS_TRUE : KOKOS_FALSE)
+// only false and nil are falsy
+#define KOKOS_AOT_FALSY(v) ((v).as_int == FALSE_BITS || (v).as_int == NIL_BITS)
+
+#endif // AOT_H_
@@ -16,8 +16,7 @@ typedef size_t* kokos_label_t;
 
 static inline kokos_label_t kokos_asm_create_label(kokos_bytecode_assembler_t* ass)
 {
-    (void)ass;
-    return KOKOS_ZALLOC(sizeof(size_t));
+    return kokos_scope_add_label(ass->scope);
 }
 
 #define SET_SCOPE(s)                                                                               \
@@ -40,10 +39,10 @@ static inline kokos_label_t kokos_asm_create_label(kokos_bytecode_assembler_t* a
 #define JZ(l) _I(JZ((l)))
 #define BRANCH(l) _I(BRANCH((l)))
 
-#define PUSH_SCOPE(n) _I(PUSH_SCOPE((n)))
-#define POP_SCOPE() _I(POP_SCOPE)
+#define ADD_GLOBAL(n) _I(ADD_GLOBAL((n)))
 
-#define ADD_LOCAL(n) _I(ADD_LOCAL((n)))
+#define LOAD_SLOT(n) _I(LOAD_SLOT((n)))
+#define STORE_SLOT(n) _I(STORE_SLOT((n)))
 
 #define ALLOC(t, c) _I(ALLOC(t##_TAG, (c)))
 
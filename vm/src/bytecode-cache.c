@@ -0,0 +1,940 @@
+#include "bytecode-cache.h"
+#include "hash.h"
+#include "macros.h"
+#include "runtime.h"
+#include "string-store.h"
+#include "value.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// An image (the contents of a cache file) consists of the header, the string table, the constant
+// pool, the procedure table and the module's code, in that order. Every entry is padded to 8 bytes,
+// so an image can be read in place once it is mapped. Pointers in instruction operands are stored
+// as 1-based indices into the string and procedure tables (0 stands for NULL), and jump targets as
+// instruction indices.
+
+static const char cache_magic[4] = { 'K', 'K', 'B', 'C' };
+
+#define OPERAND_HIGH_BITS 0xFFFF000000000000
+
+#define PAD8(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    // the number of instruction types the writer knew about, so a cache written by a vm with a
+    // different instruction set is ignored
+    uint32_t instruction_types;
+    uint32_t strings_count;
+    uint32_t procs_count;
+    uint32_t constants_count;
+    uint64_t source_hash;
+    uint64_t code_len;
+    uint64_t locals_count;
+    uint64_t top_level_code_start;
+} kokos_cache_header_t;
+
+// every string is stored as its length followed by its bytes
+typedef struct {
+    uint64_t len;
+} kokos_cached_string_t;
+
+// constants are stored depth first, every collection followed by its elements
+typedef struct {
+    // the value itself for everything but collections, with strings and symbols relocated like
+    // push operands, and just the tag bits for collections
+    uint64_t value;
+    // the number of elements of a collection, or of key-value pairs of a map
+    uint64_t len;
+} kokos_cached_value_t;
+
+// followed by the indices of the parameter names as `uint32_t`s and then by the code
+typedef struct {
+    uint32_t native;
+    // index into the string table, 0 for lambdas
+    uint32_t name;
+    uint32_t params_count;
+    uint32_t variadic;
+    uint64_t locals_count;
+    uint64_t captures_count;
+    uint64_t code_len;
+} kokos_cached_proc_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t operand;
+} kokos_cached_instruction_t;
+
+static const uint32_t instruction_types = 0
+#define X(t, s) +1
+    ENUMERATE_INSTRUCTIONS
+#undef X
+    ;
+
+uint64_t kokos_bytecode_cache_hash(const char* source, size_t len)
+{
+    return hash_djb2_len(source, len);
+}
+
+typedef struct {
+    char* items;
+    size_t len;
+    size_t cap;
+} kokos_cache_buffer_t;
+
+static void buffer_write(kokos_cache_buffer_t* buf, const void* data, size_t size)
+{
+    size_t padded = PAD8(size);
+    while (buf->len + padded > buf->cap) {
+        DA_GROW(buf);
+    }
+
+    memcpy(buf->items + buf->len, data, size);
+    memset(buf->items + buf->len + size, 0, padded - size);
+    buf->len += padded;
+}
+
+typedef struct {
+    // pointer -> index + 1
+    hash_table string_ids;
+    hash_table proc_ids;
+    // procedure -> name, for the procedures that have one
+    hash_table proc_names;
+
+    struct {
+        const kokos_runtime_string_t** items;
+        size_t len;
+        size_t cap;
+    } strings;
+
+    struct {
+        const kokos_runtime_proc_t** items;
+        size_t len;
+        size_t cap;
+    } procs;
+} kokos_cache_writer_t;
+
+static uint64_t writer_string_ref(kokos_cache_writer_t* w, const kokos_runtime_string_t* string)
+{
+    if (!string) {
+        return 0;
+    }
+
+    uint64_t id = (uintptr_t)ht_find(&w->string_ids, string);
+    if (!id) {
+        DA_ADD(&w->strings, string);
+        id = w->strings.len;
+        ht_add(&w->string_ids, (void*)string, (void*)id);
+    }
+
+    return id;
+}
+
+static uint64_t writer_proc_ref(kokos_cache_writer_t* w, const kokos_runtime_proc_t* proc)
+{
+    uint64_t id = (uintptr_t)ht_find(&w->proc_ids, proc);
+    if (!id) {
+        DA_ADD(&w->procs, proc);
+        id = w->procs.len;
+        ht_add(&w->proc_ids, (void*)proc, (void*)id);
+    }
+
+    return id;
+}
+
+static bool writer_relocate_push(kokos_cache_writer_t* w, uint64_t operand, uint64_t* out)
+{
+    kokos_value_t value = { .as_int = operand };
+    if (IS_DOUBLE(value)) {
+        *out = operand;
+        return true;
+    }
+
+    uint64_t high = operand & OPERAND_HIGH_BITS;
+
+    switch (VALUE_TAG(value)) {
+    case STRING_TAG:
+    case SYM_TAG:    *out = high | writer_string_ref(w, GET_STRING(value)); return true;
+    case PROC_TAG:   *out = high | writer_proc_ref(w, GET_PROC(value)); return true;
+    // gc objects only exist at runtime
+    case VECTOR_TAG:
+    case MAP_TAG:
+    case LIST_TAG:   return false;
+    default:         *out = operand; return true;
+    }
+}
+
+static bool is_constant_collection(kokos_value_t value)
+{
+    return !IS_DOUBLE(value) && (IS_VECTOR(value) || IS_MAP(value) || IS_LIST(value));
+}
+
+static bool writer_write_constant(
+    kokos_cache_writer_t* w, kokos_value_t value, kokos_cache_buffer_t* buf)
+{
+    kokos_cached_value_t cached = { .value = value.as_int & OPERAND_HIGH_BITS };
+
+    switch (CHECKED_VALUE_TAG(value)) {
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vec = GET_VECTOR(value);
+        cached.len = vec->len;
+        buffer_write(buf, &cached, sizeof(cached));
+
+        for (size_t i = 0; i < vec->len; i++) {
+            TRY(writer_write_constant(w, vec->items[i], buf));
+        }
+
+        return true;
+    }
+    case LIST_TAG: {
+        kokos_runtime_list_t* list = GET_LIST(value);
+        cached.len = list->len;
+        buffer_write(buf, &cached, sizeof(cached));
+
+        for (size_t i = 0; i < list->len; i++) {
+            TRY(writer_write_constant(w, list->items[i], buf));
+        }
+
+        return true;
+    }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = GET_MAP(value);
+        HT_ITER(map->table, {
+            (void)kv;
+            cached.len++;
+        });
+        buffer_write(buf, &cached, sizeof(cached));
+
+        bool ok = true;
+        HT_ITER(map->table, {
+            ok = ok && writer_write_constant(w, FROM_PTR(kv.key), buf)
+                && writer_write_constant(w, FROM_PTR(kv.value), buf);
+        });
+
+        return ok;
+    }
+    case PROC_TAG: return false;
+    default:       {
+        TRY(writer_relocate_push(w, value.as_int, &cached.value));
+        buffer_write(buf, &cached, sizeof(cached));
+        return true;
+    }
+    }
+}
+
+static bool writer_write_code(
+    kokos_cache_writer_t* w, kokos_code_t code, kokos_cache_buffer_t* buf)
+{
+    for (size_t i = 0; i < code.len; i++) {
+        // the code may already have run, but quickening only holds for this run
+        kokos_instruction_t instr = kokos_instruction_generic(code.items[i]);
+        kokos_cached_instruction_t cached = { .type = instr.type, .operand = instr.operand };
+
+        switch (instr.type) {
+        case I_PUSH: TRY(writer_relocate_push(w, instr.operand, &cached.operand)); break;
+        case I_GET_GLOBAL:
+        case I_ADD_GLOBAL:
+        case I_IS_CALLEE:
+        case I_CALL:
+        case I_CALL0:
+        case I_CALL1:
+        case I_CALL2:
+        case I_CALL3:
+        case I_TAIL_CALL:  {
+            const kokos_runtime_string_t* name = (void*)GET_PTR_INT(instr.operand);
+            cached.operand = (instr.operand & OPERAND_HIGH_BITS) | writer_string_ref(w, name);
+            break;
+        }
+        case I_JZ:
+        case I_JNZ:
+        case I_JLT:
+        case I_JGT:
+        case I_JLE:
+        case I_JGE:
+        case I_JEQ:
+        case I_JNE:
+        case I_BRANCH: cached.operand = *(size_t*)instr.operand; break;
+        default:       break;
+        }
+
+        buffer_write(buf, &cached, sizeof(cached));
+    }
+
+    return true;
+}
+
+static bool writer_write_proc(
+    kokos_cache_writer_t* w, const kokos_runtime_proc_t* proc, kokos_cache_buffer_t* buf)
+{
+    const kokos_runtime_string_t* name = ht_find(&w->proc_names, proc);
+
+    kokos_cached_proc_t cached = {
+        .native = proc->type == PROC_NATIVE,
+        .name = writer_string_ref(w, name),
+    };
+
+    if (proc->type == PROC_NATIVE) {
+        // natives are looked up by name when loading
+        TRY(name);
+        buffer_write(buf, &cached, sizeof(cached));
+        return true;
+    }
+
+    const kokos_proc_t* kokos = &proc->kokos;
+    cached.params_count = kokos->params.len;
+    cached.variadic = kokos->params.variadic;
+    cached.locals_count = kokos->locals_count;
+    cached.captures_count = kokos->captures_count;
+    cached.code_len = kokos->code.len;
+    buffer_write(buf, &cached, sizeof(cached));
+
+    uint32_t* params = KOKOS_CALLOC(kokos->params.len + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < kokos->params.len; i++) {
+        params[i] = writer_string_ref(w, kokos->params.names[i]);
+    }
+
+    buffer_write(buf, params, kokos->params.len * sizeof(uint32_t));
+    KOKOS_FREE(params);
+
+    return writer_write_code(w, kokos->code, buf);
+}
+
+static bool kokos_cache_serialize(kokos_cache_writer_t* w, const kokos_compiled_module_t* module,
+    kokos_cache_buffer_t* constants, kokos_cache_buffer_t* code, kokos_cache_buffer_t* procs)
+{
+    for (size_t i = 0; i < module->constants->len; i++) {
+        TRY(writer_write_constant(w, module->constants->items[i], constants));
+    }
+
+    TRY(writer_write_code(w, module->instructions, code));
+
+    // writing a procedure can discover new ones
+    for (size_t i = 0; i < w->procs.len; i++) {
+        TRY(writer_write_proc(w, w->procs.items[i], procs));
+    }
+
+    return true;
+}
+
+bool kokos_bytecode_image_build(
+    const kokos_compiled_module_t* module, uint64_t source_hash, kokos_bytecode_image_t* image)
+{
+    kokos_cache_writer_t w = {
+        .string_ids = ht_make(hash_sizet_func, hash_sizet_eq_func, 89),
+        .proc_ids = ht_make(hash_sizet_func, hash_sizet_eq_func, 17),
+        .proc_names = ht_make(hash_sizet_func, hash_sizet_eq_func, 17),
+    };
+    DA_INIT(&w.strings, 0, 89);
+    DA_INIT(&w.procs, 0, 17);
+
+    HT_ITER(module->procs, { ht_add(&w.proc_names, kv.value, kv.key); });
+
+    kokos_cache_buffer_t constants, code, procs, strings;
+    DA_INIT(&constants, 0, 1024);
+    DA_INIT(&code, 0, 1024);
+    DA_INIT(&procs, 0, 1024);
+    DA_INIT(&strings, 0, 1024);
+
+    bool ok = kokos_cache_serialize(&w, module, &constants, &code, &procs);
+
+    for (size_t i = 0; ok && i < w.strings.len; i++) {
+        const kokos_runtime_string_t* string = w.strings.items[i];
+        kokos_cached_string_t cached = { .len = string->len };
+        buffer_write(&strings, &cached, sizeof(cached));
+        buffer_write(&strings, string->ptr, string->len);
+    }
+
+    kokos_cache_header_t header = {
+        .version = KOKOS_BYTECODE_CACHE_VERSION,
+        .instruction_types = instruction_types,
+        .strings_count = w.strings.len,
+        .procs_count = w.procs.len,
+        .constants_count = module->constants->len,
+        .source_hash = source_hash,
+        .code_len = module->instructions.len,
+        .locals_count = module->locals_count,
+        .top_level_code_start = module->top_level_code_start,
+    };
+
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+
+    if (ok) {
+        kokos_cache_buffer_t buf;
+        size_t size = sizeof(header) + strings.len + constants.len + procs.len + code.len;
+        DA_INIT(&buf, 0, size);
+        buffer_write(&buf, &header, sizeof(header));
+        buffer_write(&buf, strings.items, strings.len);
+        buffer_write(&buf, constants.items, constants.len);
+        buffer_write(&buf, procs.items, procs.len);
+        buffer_write(&buf, code.items, code.len);
+
+        *image = (kokos_bytecode_image_t) {
+            .data = buf.items,
+            .size = buf.len,
+            .procs = w.procs.items,
+            .procs_count = w.procs.len,
+        };
+    } else {
+        DA_FREE(&w.procs);
+    }
+
+    DA_FREE(&constants);
+    DA_FREE(&code);
+    DA_FREE(&procs);
+    DA_FREE(&strings);
+    DA_FREE(&w.strings);
+    ht_destroy(&w.string_ids);
+    ht_destroy(&w.proc_ids);
+    ht_destroy(&w.proc_names);
+
+    return ok;
+}
+
+void kokos_bytecode_image_free(kokos_bytecode_image_t* image)
+{
+    KOKOS_FREE(image->data);
+    KOKOS_FREE(image->procs);
+}
+
+bool kokos_bytecode_cache_write(
+    const char* path, const kokos_compiled_module_t* module, uint64_t source_hash)
+{
+    kokos_bytecode_image_t image;
+    TRY(kokos_bytecode_image_build(module, source_hash, &image));
+
+    // write to a temporary file first, so a concurrent load never sees a partially written cache
+    char tmp_path[4096];
+    bool ok = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) < (int)sizeof(tmp_path);
+
+    FILE* f = ok ? fopen(tmp_path, "wb") : NULL;
+    if (f) {
+        ok = fwrite(image.data, 1, image.size, f) == image.size;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+
+        if (!ok) {
+            remove(tmp_path);
+        }
+    } else {
+        ok = false;
+    }
+
+    kokos_bytecode_image_free(&image);
+
+    return ok;
+}
+
+typedef struct {
+    const char* ptr;
+    const char* end;
+
+    kokos_scope_t* scope;
+
+    const kokos_runtime_string_t** strings;
+    size_t strings_count;
+
+    kokos_runtime_proc_t** procs;
+    size_t procs_count;
+
+    // where the module's constants start in the scope's constant pool
+    size_t constants_base;
+    size_t constants_count;
+} kokos_cache_reader_t;
+
+/// Returns a pointer to the next `size` bytes of the file, or NULL if the file is too short
+static const void* reader_take(kokos_cache_reader_t* r, size_t size)
+{
+    // the size comes from the file, and padding it can wrap around
+    size_t left = r->end - r->ptr;
+    if (size > left || PAD8(size) > left) {
+        return NULL;
+    }
+
+    const void* data = r->ptr;
+    r->ptr += PAD8(size);
+    return data;
+}
+
+/// Returns a pointer to the next `count` entries of `size` bytes each, or NULL if the file is too
+/// short
+static const void* reader_take_array(kokos_cache_reader_t* r, uint64_t count, size_t size)
+{
+    if (count > (size_t)(r->end - r->ptr) / size) {
+        return NULL;
+    }
+
+    return reader_take(r, count * size);
+}
+
+static bool reader_string_ref(
+    const kokos_cache_reader_t* r, uint64_t id, const kokos_runtime_string_t** out)
+{
+    if (id > r->strings_count) {
+        return false;
+    }
+
+    *out = id ? r->strings[id - 1] : NULL;
+    return true;
+}
+
+/// Relocates a value that is neither a procedure nor a collection, after checking that it is one
+/// the writer stores
+static bool reader_read_scalar(const kokos_cache_reader_t* r, uint64_t bits, kokos_value_t* out)
+{
+    kokos_value_t value = { .as_int = bits };
+
+    switch (CHECKED_VALUE_TAG(value)) {
+    case 0:
+    case INT_TAG:    break;
+    case STRING_TAG:
+    case SYM_TAG:    {
+        const kokos_runtime_string_t* string;
+        TRY(reader_string_ref(r, GET_PTR_INT(bits), &string) && string);
+        value.as_int = (bits & OPERAND_HIGH_BITS) | (uintptr_t)string;
+        break;
+    }
+    default: TRY(IS_BOOL(value) || IS_NIL(value)); break;
+    }
+
+    *out = value;
+    return true;
+}
+
+/// Relocates the operand of an instruction of code that is `len` instructions long and uses
+/// `locals_count` slots, after checking it against what it refers to. `code` holds the
+/// instructions read before it
+static bool reader_read_instruction(kokos_cache_reader_t* r,
+    const kokos_cached_instruction_t* cached, size_t len, size_t locals_count,
+    const kokos_code_t* code, kokos_instruction_t* out)
+{
+    uint64_t operand = cached->operand;
+    uint64_t high = operand & OPERAND_HIGH_BITS;
+    uint64_t id = GET_PTR_INT(operand);
+
+    TRY(cached->type < instruction_types);
+
+    kokos_instruction_t instr = { .type = cached->type, .operand = operand };
+
+    // the writer stores the generic form of quickened instructions
+    TRY(kokos_instruction_generic(instr).type == instr.type);
+
+    switch (instr.type) {
+    case I_PUSH: {
+        kokos_value_t value = { .as_int = operand };
+        if (!IS_DOUBLE(value) && IS_PROC(value)) {
+            TRY(id != 0 && id <= r->procs_count);
+            instr.operand = high | (uintptr_t)r->procs[id - 1];
+            break;
+        }
+
+        // collections are pushed from the constant pool
+        TRY(reader_read_scalar(r, operand, &value));
+        instr.operand = value.as_int;
+        break;
+    }
+    case I_GET_GLOBAL:
+    case I_ADD_GLOBAL:
+    case I_IS_CALLEE:
+    case I_CALL:
+    case I_CALL0:
+    case I_CALL1:
+    case I_CALL2:
+    case I_CALL3:
+    case I_TAIL_CALL:  {
+        const kokos_runtime_string_t* name;
+        TRY(reader_string_ref(r, id, &name));
+        // only calls can do without a name, they take their callee from the stack then
+        TRY(name || (instr.type != I_GET_GLOBAL && instr.type != I_ADD_GLOBAL
+                        && instr.type != I_IS_CALLEE));
+        instr.operand = high | (uintptr_t)name;
+        break;
+    }
+    case I_PUSH_CONST: {
+        TRY(operand < r->constants_count);
+        instr.operand = r->constants_base + operand;
+        break;
+    }
+    case I_LOAD_SLOT:
+    case I_STORE_SLOT:
+    case I_LOAD_REST:  {
+        TRY(operand < locals_count);
+        break;
+    }
+    case I_ALLOC: {
+        if (GET_TAG(operand) != PROC_TAG) {
+            break;
+        }
+
+        // a closure is made of the procedure pushed right before it, and copies its values into
+        // the last slots of that procedure, so it has to capture exactly as many
+        TRY(code->len != 0 && code->items[code->len - 1].type == I_PUSH);
+        kokos_value_t proc = { .as_int = code->items[code->len - 1].operand };
+        TRY(!IS_DOUBLE(proc) && IS_PROC(proc) && GET_PROC(proc)->type == PROC_KOKOS);
+        TRY((operand & INSTR_ALLOC_ARG_MASK) == GET_PROC(proc)->kokos.captures_count);
+        break;
+    }
+    case I_JZ:
+    case I_JNZ:
+    case I_JLT:
+    case I_JGT:
+    case I_JLE:
+    case I_JGE:
+    case I_JEQ:
+    case I_JNE:
+    case I_BRANCH: {
+        TRY(operand < len);
+        size_t* label = kokos_scope_add_label(r->scope);
+        *label = operand;
+        instr.operand = (uintptr_t)label;
+        break;
+    }
+    default: break;
+    }
+
+    *out = instr;
+    return true;
+}
+
+/// Whether every path through `code` keeps the operand stack balanced and returns a value, so
+/// nothing runs off the end of the code or pops more than it pushed
+static bool reader_code_balanced(const kokos_code_t* code)
+{
+    if (code->len == 0) {
+        return false;
+    }
+
+    size_t* depths = KOKOS_CALLOC(code->len, sizeof(size_t));
+    bool ok = kokos_code_stack_depths(code, depths);
+    for (size_t i = 0; ok && i < code->len; i++) {
+        ok = code->items[i].type != I_RET || depths[i] != 0;
+    }
+
+    KOKOS_FREE(depths);
+    return ok;
+}
+
+/// Reads `len` instructions using `locals_count` slots into `code`, which is left empty if they
+/// are not valid
+static bool reader_read_code(
+    kokos_cache_reader_t* r, uint64_t len, uint64_t locals_count, kokos_code_t* code)
+{
+    const kokos_cached_instruction_t* cached
+        = reader_take_array(r, len, sizeof(kokos_cached_instruction_t));
+    TRY(cached);
+
+    kokos_code_t read;
+    DA_INIT(&read, 0, len);
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < len; i++) {
+        kokos_instruction_t instr;
+        ok = reader_read_instruction(r, &cached[i], len, locals_count, &read, &instr);
+        if (ok) {
+            DA_ADD(&read, instr);
+        }
+    }
+
+    if (!ok || !reader_code_balanced(&read)) {
+        DA_FREE(&read);
+        return false;
+    }
+
+    *code = read;
+    return true;
+}
+
+static bool reader_read_constant(kokos_cache_reader_t* r, kokos_value_t* out)
+{
+    const kokos_cached_value_t* cached = reader_take(r, sizeof(kokos_cached_value_t));
+    TRY(cached);
+
+    kokos_value_t value = { .as_int = cached->value };
+    if (!is_constant_collection(value)) {
+        return reader_read_scalar(r, cached->value, out);
+    }
+
+    // every element takes at least one entry, which bounds the size of the collection
+    TRY(cached->len <= (size_t)(r->end - r->ptr) / sizeof(kokos_cached_value_t));
+
+    *out = kokos_runtime_constant_new(VALUE_TAG(value), cached->len);
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < cached->len; i++) {
+        kokos_value_t elem, key;
+
+        switch (VALUE_TAG(value)) {
+        case VECTOR_TAG:
+            ok = reader_read_constant(r, &elem);
+            if (ok) {
+                DA_ADD(GET_VECTOR(*out), elem);
+            }
+            break;
+        case LIST_TAG:
+            ok = reader_read_constant(r, &elem);
+            if (ok) {
+                GET_LIST(*out)->items[i] = elem;
+            }
+            break;
+        case MAP_TAG:
+            ok = reader_read_constant(r, &key);
+            // maps are keyed by strings only, which the string store owns
+            if (ok && (IS_DOUBLE(key) || !IS_STRING(key))) {
+                if (is_constant_collection(key)) {
+                    kokos_runtime_constant_free(key);
+                }
+                ok = false;
+            }
+            if (ok) {
+                ok = reader_read_constant(r, &elem);
+            }
+            if (ok) {
+                kokos_runtime_map_add(GET_MAP(*out), key, elem);
+            }
+            break;
+        }
+    }
+
+    if (!ok) {
+        kokos_runtime_constant_free(*out);
+    }
+
+    return ok;
+}
+
+/// Creates the procedures of the procedure table, leaving the code of kokos ones to be read later
+static bool reader_create_procs(kokos_cache_reader_t* r, const kokos_cached_proc_t** entries)
+{
+    for (size_t i = 0; i < r->procs_count; i++) {
+        const kokos_cached_proc_t* entry = reader_take(r, sizeof(kokos_cached_proc_t));
+        TRY(entry);
+        entries[i] = entry;
+
+        const kokos_runtime_string_t* name;
+        TRY(reader_string_ref(r, entry->name, &name));
+
+        if (entry->native) {
+            TRY(name);
+            r->procs[i] = ht_find(&r->scope->procs, name);
+            TRY(r->procs[i] && r->procs[i]->type == PROC_NATIVE);
+            continue;
+        }
+
+        // the parameters and the captured values take the first and the last slots, and a rest
+        // parameter is a parameter too. Every other slot is stored to by some instruction
+        TRY(!entry->variadic || entry->params_count != 0);
+        TRY(entry->captures_count <= entry->locals_count);
+        TRY(entry->params_count <= entry->locals_count - entry->captures_count);
+        TRY(entry->locals_count - entry->params_count <= entry->code_len);
+
+        const uint32_t* params = reader_take_array(r, entry->params_count, sizeof(uint32_t));
+        TRY(params);
+        TRY(reader_take_array(r, entry->code_len, sizeof(kokos_cached_instruction_t)));
+
+        kokos_runtime_proc_t* proc = kokos_runtime_proc_new(PROC_KOKOS);
+        proc->kokos = (kokos_proc_t) {
+            .params = {
+                .names = KOKOS_CALLOC(entry->params_count + 1, sizeof(kokos_runtime_string_t*)),
+                .len = entry->params_count,
+                .variadic = entry->variadic,
+            },
+            .locals_count = entry->locals_count,
+            .captures_count = entry->captures_count,
+        };
+        r->procs[i] = proc;
+
+        for (size_t j = 0; j < entry->params_count; j++) {
+            const kokos_runtime_string_t* param;
+            TRY(reader_string_ref(r, params[j], &param) && param);
+            proc->kokos.params.names[j] = (kokos_runtime_string_t*)param;
+        }
+    }
+
+    return true;
+}
+
+static bool reader_read_procs(kokos_cache_reader_t* r, const kokos_cached_proc_t** entries)
+{
+    for (size_t i = 0; i < r->procs_count; i++) {
+        const kokos_cached_proc_t* entry = entries[i];
+        if (entry->native) {
+            continue;
+        }
+
+        r->ptr = (const char*)(entry + 1);
+        reader_take_array(r, entry->params_count, sizeof(uint32_t));
+        kokos_proc_t* kproc = &r->procs[i]->kokos;
+        TRY(reader_read_code(r, entry->code_len, entry->locals_count, &kproc->code));
+        kproc->max_depth = kokos_code_max_depth(&kproc->code);
+    }
+
+    return true;
+}
+
+static bool kokos_cache_deserialize(kokos_cache_reader_t* r, const kokos_cache_header_t* header,
+    const kokos_cached_proc_t** entries, kokos_code_t* code)
+{
+    for (size_t i = 0; i < r->strings_count; i++) {
+        const kokos_cached_string_t* cached = reader_take(r, sizeof(kokos_cached_string_t));
+        TRY(cached);
+
+        const char* data = reader_take(r, cached->len);
+        TRY(data);
+
+        r->strings[i]
+            = kokos_string_store_add_sv(r->scope->string_store, sv_make(data, cached->len));
+    }
+
+    kokos_constant_pool_t* constants = r->scope->constants;
+    for (size_t i = 0; i < r->constants_count; i++) {
+        kokos_value_t value;
+        TRY(reader_read_constant(r, &value));
+        // the pool holds just collections, their elements are read along with them
+        TRY(is_constant_collection(value));
+        DA_ADD(constants, value);
+    }
+
+    TRY(reader_create_procs(r, entries));
+
+    const char* code_start = r->ptr;
+    TRY(reader_read_procs(r, entries));
+
+    r->ptr = code_start;
+    TRY(reader_read_code(r, header->code_len, header->locals_count, code));
+
+    return r->ptr == r->end;
+}
+
+static bool kokos_cache_header_valid(
+    const kokos_cache_header_t* header, size_t size, uint64_t source_hash)
+{
+    if (size < sizeof(*header) || memcmp(header->magic, cache_magic, sizeof(cache_magic)) != 0
+        || header->version != KOKOS_BYTECODE_CACHE_VERSION
+        || header->instruction_types != instruction_types || header->source_hash != source_hash) {
+        return false;
+    }
+
+    // every entry takes at least its fixed part, so the counts can't be larger than what fits in
+    // the file. That also bounds the tables that are allocated for them before reading anything
+    return header->strings_count <= size / sizeof(kokos_cached_string_t)
+        && header->constants_count <= size / sizeof(kokos_cached_value_t)
+        && header->procs_count <= size / sizeof(kokos_cached_proc_t)
+        && header->code_len <= size / sizeof(kokos_cached_instruction_t)
+        && header->locals_count <= header->code_len
+        && header->top_level_code_start <= header->code_len;
+}
+
+bool kokos_bytecode_image_load(const char* data, size_t size, uint64_t source_hash,
+    kokos_scope_t* scope, kokos_compiled_module_t* module, kokos_runtime_proc_t** procs)
+{
+    KOKOS_ASSERT(scope->parent == NULL);
+
+    const kokos_cache_header_t* header = (const kokos_cache_header_t*)data;
+    TRY(kokos_cache_header_valid(header, size, source_hash));
+
+    kokos_cache_reader_t r = {
+        .ptr = data + sizeof(*header),
+        .end = data + size,
+        .scope = scope,
+        .strings = KOKOS_CALLOC(header->strings_count + 1, sizeof(kokos_runtime_string_t*)),
+        .strings_count = header->strings_count,
+        .procs = KOKOS_CALLOC(header->procs_count + 1, sizeof(kokos_runtime_proc_t*)),
+        .procs_count = header->procs_count,
+        .constants_base = scope->constants->len,
+        .constants_count = header->constants_count,
+    };
+
+    const kokos_cached_proc_t** entries
+        = KOKOS_CALLOC(header->procs_count + 1, sizeof(kokos_cached_proc_t*));
+
+    kokos_code_t code = { 0 };
+    bool ok = kokos_cache_deserialize(&r, header, entries, &code);
+
+    for (size_t i = 0; i < r.procs_count; i++) {
+        kokos_runtime_proc_t* proc = r.procs[i];
+        if (!proc || proc->type != PROC_KOKOS) {
+            continue;
+        }
+
+        if (!ok) {
+            DA_FREE(&proc->kokos.code);
+            kokos_runtime_proc_free(proc);
+            continue;
+        }
+
+        // procedures don't own their code, the scope they were compiled in does
+        kokos_scope_t* proc_scope = kokos_scope_derived(scope);
+        DA_FREE(&proc_scope->code);
+        proc_scope->code = proc->kokos.code;
+
+        const kokos_runtime_string_t* name = NULL;
+        reader_string_ref(&r, entries[i]->name, &name);
+        if (name) {
+            ht_add(&scope->procs, (void*)name, proc);
+        }
+    }
+
+    if (ok && procs) {
+        memcpy(procs, r.procs, r.procs_count * sizeof(kokos_runtime_proc_t*));
+    }
+
+    if (ok) {
+        DA_FREE(&scope->code);
+        scope->code = code;
+        scope->locals_count = header->locals_count;
+
+        module->call_locations = scope->call_locations;
+        module->string_store = *scope->string_store;
+        module->constants = scope->constants;
+        module->procs = scope->procs;
+        module->top_level_code_start = header->top_level_code_start;
+        module->locals_count = header->locals_count;
+        module->instructions = scope->code;
+    } else {
+        DA_FREE(&code);
+
+        // drop the constants that were read before the failure
+        while (scope->constants->len > r.constants_base) {
+            kokos_runtime_constant_free(scope->constants->items[--scope->constants->len]);
+        }
+    }
+
+    KOKOS_FREE(entries);
+    KOKOS_FREE(r.strings);
+    KOKOS_FREE(r.procs);
+
+    return ok;
+}
+
+bool kokos_bytecode_cache_load(const char* path, uint64_t source_hash, kokos_scope_t* scope,
+    kokos_compiled_module_t* module)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(kokos_cache_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    bool ok = kokos_bytecode_image_load(data, size, source_hash, scope, module, NULL);
+    munmap((void*)data, size);
+
+    return ok;
+}
@@ -0,0 +1,49 @@
+#ifndef BYTECODE_CACHE_H_
+#define BYTECODE_CACHE_H_
+
+#include "compile.h"
+#include "runtime.h"
+#include "scope.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// bump this whenever the layout of the cache file changes
+#define KOKOS_BYTECODE_CACHE_VERSION 7
+
+#define KOKOS_BYTECODE_CACHE_EXT "c"
+
+/// A serialized module, the same bytes `kokos_bytecode_cache_write` puts into a cache file
+typedef struct {
+    char* data;
+    size_t size;
+    // the procedures of the module in the order of the image's procedure table
+    const kokos_runtime_proc_t** procs;
+    size_t procs_count;
+} kokos_bytecode_image_t;
+
+/// Hashes the source a module was compiled from, a cache is only used if the hashes match
+uint64_t kokos_bytecode_cache_hash(const char* source, size_t len);
+
+/// Serializes the compiled module into memory
+bool kokos_bytecode_image_build(
+    const kokos_compiled_module_t* module, uint64_t source_hash, kokos_bytecode_image_t* image);
+void kokos_bytecode_image_free(kokos_bytecode_image_t* image);
+
+/// Loads the module in the image at `data`, which has to be 8-byte aligned, into `scope`, which has
+/// to be a fresh root scope. If `procs` isn't NULL it receives the procedures in the order of the
+/// image's procedure table
+bool kokos_bytecode_image_load(const char* data, size_t size, uint64_t source_hash,
+    kokos_scope_t* scope, kokos_compiled_module_t* module, kokos_runtime_proc_t** procs);
+
+/// Serializes the compiled module into the file at `path`, replacing it if it exists
+bool kokos_bytecode_cache_write(
+    const char* path, const kokos_compiled_module_t* module, uint64_t source_hash);
+
+/// Loads the module cached at `path` into `scope`, which has to be a fresh root scope.
+/// Returns false if there is no cache, or if it is stale or malformed, so the module has to be
+/// compiled from source
+bool kokos_bytecode_cache_load(const char* path, uint64_t source_hash, kokos_scope_t* scope,
+    kokos_compiled_module_t* module);
+
+#endif // BYTECODE_CACHE_H_
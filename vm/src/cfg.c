@@ -0,0 +1,276 @@
+#include "cfg.h"
+#include "base.h"
+#include "macros.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Whether the instruction ends its block no matter what comes after it
+static bool ends_block(kokos_instruction_type_e type)
+{
+    return type == I_RET || kokos_instruction_is_jump(type);
+}
+
+static void add_succ(kokos_cfg_t* cfg, size_t from, size_t to)
+{
+    kokos_block_t* block = &cfg->items[from];
+    block->succs[block->succs_count++] = to;
+    DA_ADD(&cfg->items[to].preds, from);
+}
+
+/// Numbers the reachable blocks in reverse postorder
+static void compute_order(kokos_cfg_t* cfg)
+{
+    cfg->order = KOKOS_CALLOC(cfg->len, sizeof(size_t));
+    cfg->order_len = 0;
+
+    // an explicit stack of blocks and how many of their successors were visited already
+    size_t* stack = KOKOS_CALLOC(cfg->len, sizeof(size_t));
+    size_t* visited_succs = KOKOS_CALLOC(cfg->len, sizeof(size_t));
+    size_t* postorder = KOKOS_CALLOC(cfg->len, sizeof(size_t));
+    size_t stack_len = 0;
+    size_t postorder_len = 0;
+
+    cfg->items[0].reachable = true;
+    stack[stack_len++] = 0;
+    while (stack_len != 0) {
+        size_t b = stack[stack_len - 1];
+        kokos_block_t* block = &cfg->items[b];
+        if (visited_succs[b] == block->succs_count) {
+            postorder[postorder_len++] = b;
+            stack_len--;
+            continue;
+        }
+
+        size_t succ = block->succs[visited_succs[b]++];
+        if (!cfg->items[succ].reachable) {
+            cfg->items[succ].reachable = true;
+            stack[stack_len++] = succ;
+        }
+    }
+
+    for (size_t i = 0; i < postorder_len; i++) {
+        cfg->order[cfg->order_len++] = postorder[postorder_len - 1 - i];
+    }
+
+    KOKOS_FREE(postorder);
+    KOKOS_FREE(visited_succs);
+    KOKOS_FREE(stack);
+}
+
+/// Walks up from `a` and `b` to the closest block that dominates both
+static size_t intersect(const size_t* idoms, const size_t* order_index, size_t a, size_t b)
+{
+    while (a != b) {
+        while (order_index[a] > order_index[b]) {
+            a = idoms[a];
+        }
+        while (order_index[b] > order_index[a]) {
+            b = idoms[b];
+        }
+    }
+
+    return a;
+}
+
+/// Computes the immediate dominators, the iterative algorithm from "A Simple, Fast Dominance
+/// Algorithm" by Cooper, Harvey and Kennedy
+static void compute_dominators(kokos_cfg_t* cfg)
+{
+    size_t* idoms = KOKOS_CALLOC(cfg->len, sizeof(size_t));
+    size_t* order_index = KOKOS_CALLOC(cfg->len, sizeof(size_t));
+    for (size_t i = 0; i < cfg->len; i++) {
+        idoms[i] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < cfg->order_len; i++) {
+        order_index[cfg->order[i]] = i;
+    }
+
+    idoms[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < cfg->order_len; i++) {
+            size_t b = cfg->order[i];
+            const kokos_block_list_t* preds = &cfg->items[b].preds;
+
+            // the predecessors that were not processed yet don't tell anything about `b`
+            size_t idom = SIZE_MAX;
+            for (size_t j = 0; j < preds->len; j++) {
+                size_t pred = preds->items[j];
+                if (idoms[pred] == SIZE_MAX) {
+                    continue;
+                }
+
+                idom = idom == SIZE_MAX ? pred : intersect(idoms, order_index, pred, idom);
+            }
+
+            if (idoms[b] != idom) {
+                idoms[b] = idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < cfg->len; i++) {
+        cfg->items[i].idom = i == 0 ? SIZE_MAX : idoms[i];
+    }
+
+    KOKOS_FREE(order_index);
+    KOKOS_FREE(idoms);
+}
+
+void kokos_cfg_build(const kokos_code_t* code, kokos_cfg_t* cfg)
+{
+    KOKOS_ASSERT(code->len != 0);
+
+    // a block starts at the entry, at every jump target and after every instruction that ends one
+    bool* leaders = KOKOS_CALLOC(code->len, sizeof(bool));
+    leaders[0] = true;
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if (kokos_instruction_is_jump(instr.type)) {
+            leaders[*(size_t*)instr.operand] = true;
+        }
+        if (ends_block(instr.type) && i + 1 < code->len) {
+            leaders[i + 1] = true;
+        }
+    }
+
+    DA_INIT(cfg, 0, 8);
+    cfg->block_of = KOKOS_CALLOC(code->len, sizeof(size_t));
+    for (size_t i = 0; i < code->len; i++) {
+        if (leaders[i]) {
+            kokos_block_t block = { .start = i, .idom = SIZE_MAX };
+            DA_INIT(&block.preds, 0, 2);
+            DA_ADD(cfg, block);
+        }
+
+        cfg->block_of[i] = cfg->len - 1;
+        cfg->items[cfg->len - 1].end = i + 1;
+    }
+
+    KOKOS_FREE(leaders);
+
+    for (size_t b = 0; b < cfg->len; b++) {
+        kokos_instruction_t last = code->items[cfg->items[b].end - 1];
+        bool has_next = b + 1 < cfg->len;
+
+        if (kokos_instruction_is_jump(last.type)) {
+            add_succ(cfg, b, cfg->block_of[*(size_t*)last.operand]);
+        }
+
+        // a conditional jump falls through when it is not taken
+        if (last.type != I_RET && last.type != I_BRANCH && has_next) {
+            add_succ(cfg, b, b + 1);
+        }
+    }
+
+    compute_order(cfg);
+    compute_dominators(cfg);
+}
+
+void kokos_cfg_free(kokos_cfg_t* cfg)
+{
+    for (size_t i = 0; i < cfg->len; i++) {
+        DA_FREE(&cfg->items[i].preds);
+    }
+
+    DA_FREE(cfg);
+    KOKOS_FREE(cfg->block_of);
+    KOKOS_FREE(cfg->order);
+}
+
+bool kokos_cfg_dominates(const kokos_cfg_t* cfg, size_t a, size_t b)
+{
+    if (!cfg->items[b].reachable) {
+        return false;
+    }
+
+    for (; b != SIZE_MAX; b = cfg->items[b].idom) {
+        if (b == a) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t kokos_code_slots_count(const kokos_code_t* code)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if ((instr.type == I_LOAD_SLOT || instr.type == I_STORE_SLOT) && instr.operand >= count) {
+            count = instr.operand + 1;
+        }
+    }
+
+    return count;
+}
+
+bool* kokos_cfg_live_slots(const kokos_cfg_t* cfg, const kokos_code_t* code, size_t slots_count)
+{
+    bool* live_in = KOKOS_CALLOC(cfg->len * slots_count + 1, sizeof(bool));
+    bool* live = KOKOS_CALLOC(slots_count + 1, sizeof(bool));
+
+    // the slots only ever become live, so this settles, and going against the order settles
+    // everything but loops in a single round
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = cfg->order_len; i-- > 0;) {
+            size_t b = cfg->order[i];
+            const kokos_block_t* block = &cfg->items[b];
+
+            memset(live, 0, slots_count * sizeof(bool));
+            for (size_t j = 0; j < block->succs_count; j++) {
+                const bool* succ_live = live_in + block->succs[j] * slots_count;
+                for (size_t s = 0; s < slots_count; s++) {
+                    live[s] |= succ_live[s];
+                }
+            }
+
+            for (size_t at = block->end; at-- > block->start;) {
+                kokos_instruction_t instr = code->items[at];
+                if (instr.type == I_LOAD_SLOT) {
+                    live[instr.operand] = true;
+                } else if (instr.type == I_STORE_SLOT) {
+                    live[instr.operand] = false;
+                }
+            }
+
+            bool* block_live = live_in + b * slots_count;
+            if (memcmp(block_live, live, slots_count * sizeof(bool)) != 0) {
+                memcpy(block_live, live, slots_count * sizeof(bool));
+                changed = true;
+            }
+        }
+    }
+
+    KOKOS_FREE(live);
+    return live_in;
+}
+
+void kokos_cfg_dump(const kokos_cfg_t* cfg)
+{
+    for (size_t b = 0; b < cfg->len; b++) {
+        const kokos_block_t* block = &cfg->items[b];
+        printf("block %zu [%zu, %zu)", b, block->start, block->end);
+        if (!block->reachable) {
+            printf(" unreachable\n");
+            continue;
+        }
+
+        if (block->idom != SIZE_MAX) {
+            printf(" idom %zu", block->idom);
+        }
+
+        printf(" ->");
+        for (size_t i = 0; i < block->succs_count; i++) {
+            printf(" %zu", block->succs[i]);
+        }
+        printf("\n");
+    }
+}
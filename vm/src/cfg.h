@@ -0,0 +1,65 @@
+#ifndef CFG_H_
+#define CFG_H_
+
+#include "instruction.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    size_t* items;
+    size_t len;
+    size_t cap;
+} kokos_block_list_t;
+
+/// A run of instructions that is only ever entered at its first one and left after its last one
+typedef struct {
+    // the block holds the instructions [start, end)
+    size_t start;
+    size_t end;
+
+    // the jump target comes first for the conditional jumps, then the block that follows
+    size_t succs[2];
+    size_t succs_count;
+    kokos_block_list_t preds;
+
+    bool reachable;
+    // the closest block every path from the entry to this one goes through, SIZE_MAX for the entry
+    // and the unreachable blocks
+    size_t idom;
+} kokos_block_t;
+
+/// The control flow graph of a piece of code, block 0 is the entry
+typedef struct {
+    kokos_block_t* items;
+    size_t len;
+    size_t cap;
+
+    // the block of every instruction
+    size_t* block_of;
+
+    // the reachable blocks in reverse postorder, so a block comes before the blocks it reaches
+    // unless it is through a loop
+    size_t* order;
+    size_t order_len;
+} kokos_cfg_t;
+
+/// Splits `code` into blocks, connects them and computes which ones are reachable and their
+/// dominators. The blocks follow the code, so block `i + 1` starts where block `i` ends
+void kokos_cfg_build(const kokos_code_t* code, kokos_cfg_t* cfg);
+void kokos_cfg_free(kokos_cfg_t* cfg);
+
+/// Whether every path from the entry to block `b` goes through block `a`
+bool kokos_cfg_dominates(const kokos_cfg_t* cfg, size_t a, size_t b);
+
+/// Gets the number of frame slots `code` uses, one more than the highest one it loads or stores
+size_t kokos_code_slots_count(const kokos_code_t* code);
+
+/// Computes which frame slots are live at the start of every block, i.e. read on some path before
+/// being written. Slot `s` of block `b` is at `b * slots_count + s` of the result, which the caller
+/// frees
+bool* kokos_cfg_live_slots(const kokos_cfg_t* cfg, const kokos_code_t* code, size_t slots_count);
+
+void kokos_cfg_dump(const kokos_cfg_t* cfg);
+
+#endif // CFG_H_
@@ -9,6 +9,7 @@
 
 #include "compile.h"
 #include "instruction.h"
+#include "optimize.h"
 #include "value.h"
 
 #include "vm.h"
@@ -29,6 +30,13 @@
 
 static char err_buf[512];
 
+static kokos_opt_level_e opt_level = KOKOS_OPT_DEFAULT;
+
+void kokos_compile_set_opt_level(kokos_opt_level_e level)
+{
+    opt_level = level;
+}
+
 bool kokos_compile_ok(void)
 {
     return strlen(err_buf) == 0;
@@ -173,6 +181,325 @@ static inline bool kokos_compile_all_reversed(
     return true;
 }
 
+/// Gives the parameters the first slots of the frame. The arguments are pushed last to first and
+/// the slots of the callee start where the last one is, so the parameters are numbered backwards,
+/// with the rest parameter after them
+static void bind_params(kokos_scope_t* scope, const kokos_params_t* params)
+{
+    size_t reg_count = params->variadic ? params->len - 1 : params->len;
+    for (size_t i = reg_count; i-- > 0;) {
+        kokos_scope_add_local(scope, params->names[i]);
+    }
+
+    if (params->variadic) {
+        scope->rest_slot = kokos_scope_add_local(scope, params->names[reg_count]);
+    }
+}
+
+/// Loads the local in `slot`, see `bind_params`
+static kokos_instruction_t load_local(const kokos_scope_t* scope, size_t slot)
+{
+    return slot == scope->rest_slot ? INSTR_LOAD_REST(slot) : INSTR_LOAD_SLOT(slot);
+}
+
+// the loads of captured variables are emitted before the procedure knows how many slots of its own
+// it needs, `place_captures` gives them their slots once it does
+#define CAPTURED_SLOT_FLAG ((uint64_t)1 << 62)
+
+/// Finds how the code of `scope` loads the innermost local variable called `name`. A variable of an
+/// enclosing procedure is captured by the procedure of `scope`, and by every procedure in between
+static bool find_local_load(
+    kokos_scope_t* scope, const kokos_runtime_string_t* name, kokos_instruction_t* load)
+{
+    size_t slot;
+    if (kokos_scope_find_local(scope, name, &slot)) {
+        *load = load_local(scope, slot);
+        return true;
+    }
+
+    kokos_instruction_t outer;
+    if (!scope->can_capture || !find_local_load(scope->parent, name, &outer)) {
+        return false;
+    }
+
+    *load = INSTR_LOAD_SLOT(CAPTURED_SLOT_FLAG | kokos_scope_add_capture(scope, name));
+    return true;
+}
+
+/// Gives the variables captured by the procedure compiled in `scope` the slots past the ones it
+/// needs for itself. Locals are never assigned to, so the procedure can have copies of the values
+static void place_captures(kokos_scope_t* scope)
+{
+    if (scope->captures.len == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < scope->code.len; i++) {
+        kokos_instruction_t* instr = &scope->code.items[i];
+        if (instr->type == I_LOAD_SLOT && (instr->operand & CAPTURED_SLOT_FLAG)) {
+            instr->operand = scope->locals_count + (instr->operand & ~CAPTURED_SLOT_FLAG);
+        }
+    }
+
+    scope->locals_count += scope->captures.len;
+}
+
+/// Pushes the value of the procedure `proc` compiled in `proc_scope`. It is `proc` itself, unless
+/// it captured variables, then it is a new closure of `proc` with their current values
+static void push_proc(kokos_scope_t* scope, kokos_scope_t* proc_scope, kokos_runtime_proc_t* proc)
+{
+    const kokos_variable_list_t* captures = &proc_scope->captures;
+
+    // `I_ALLOC` takes the first value from right below the procedure
+    for (size_t i = captures->len; i-- > 0;) {
+        kokos_instruction_t load;
+        KOKOS_VERIFY(find_local_load(scope, captures->items[i], &load));
+        DA_ADD(&scope->code, load);
+    }
+
+    DA_ADD(&scope->code, INSTR_PUSH(TO_PROC(proc)));
+
+    if (captures->len > 0) {
+        DA_ADD(&scope->code, INSTR_ALLOC(PROC_BITS, captures->len));
+    }
+}
+
+/// Whether execution starting at `idx` reaches `I_RET` without doing anything else
+static bool returns_immediately(const kokos_code_t* code, size_t idx)
+{
+    // follow the unconditional branches, giving up after `code->len` hops in case of a cycle
+    for (size_t hops = 0; idx < code->len && hops < code->len; hops++) {
+        kokos_instruction_t instr = code->items[idx];
+        if (instr.type == I_RET) {
+            return true;
+        }
+
+        if (instr.type != I_BRANCH) {
+            return false;
+        }
+
+        idx = *(size_t*)instr.operand;
+    }
+
+    return false;
+}
+
+/// Turns the calls in tail position of a procedure's code into tail calls. A call is in tail
+/// position if its result is returned right away, which covers the last form of the body, both
+/// arms of an `if` and the last form of a `let` in tail position
+static void mark_tail_calls(kokos_code_t* code)
+{
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t* instr = &code->items[i];
+        if (kokos_instruction_is_call(instr->type) && returns_immediately(code, i + 1)) {
+            instr->type = I_TAIL_CALL;
+        }
+    }
+}
+
+/// Finds the constant a top level `var` bound the global `name` to. Only the code of the top level
+/// sees them, since a procedure can be called after the global was bound to something else
+static bool find_constant_global(
+    kokos_scope_t* scope, const kokos_runtime_string_t* name, kokos_value_t* out)
+{
+    size_t slot;
+    if (opt_level == KOKOS_OPT_NONE || scope->parent != NULL
+        || kokos_scope_find_local(scope, name, &slot)) {
+        return false;
+    }
+
+    kokos_value_t* value = ht_find(&scope->constant_globals, name);
+    if (!value) {
+        return false;
+    }
+
+    *out = *value;
+    return true;
+}
+
+static void forget_constant_global(kokos_scope_t* scope, const kokos_runtime_string_t* name)
+{
+    KOKOS_FREE(ht_delete(&scope->constant_globals, name));
+}
+
+static void remember_constant_global(
+    kokos_scope_t* scope, const kokos_runtime_string_t* name, kokos_value_t value)
+{
+    kokos_value_t* stored = KOKOS_ALLOC(sizeof(kokos_value_t));
+    *stored = value;
+
+    forget_constant_global(scope, name);
+    ht_add(&scope->constant_globals, (void*)name, stored);
+}
+
+/// Emits the code binding the value on top of the stack to `name`, as a global at the top level
+/// and as a new frame slot everywhere else
+static void bind_variable(kokos_scope_t* scope, const kokos_runtime_string_t* name)
+{
+    if (kokos_scope_is_global(scope)) {
+        // whatever the global was bound to before, it is not known to be constant anymore
+        forget_constant_global(scope, name);
+        DA_ADD(&scope->code, INSTR_ADD_GLOBAL(name));
+        return;
+    }
+
+    DA_ADD(&scope->code, INSTR_STORE_SLOT(kokos_scope_add_local(scope, name)));
+}
+
+/// A special form that is evaluated at compile time when all of its arguments are constants
+typedef struct {
+    const char* name;
+    kokos_instruction_type_e type;
+    // the comparisons test the result of `I_CMP` the way their special forms do
+    kokos_instruction_t test;
+} kokos_foldable_sform_t;
+
+static const kokos_foldable_sform_t foldable_sforms[] = {
+    { "+", I_ADD },
+    { "-", I_SUB },
+    { "*", I_MUL },
+    { "/", I_DIV },
+    { "<", I_CMP, { .type = I_EQ, .operand = (uint64_t)-1 } },
+    { ">", I_CMP, { .type = I_EQ, .operand = 1 } },
+    { "<=", I_CMP, { .type = I_NEQ, .operand = 1 } },
+    { ">=", I_CMP, { .type = I_NEQ, .operand = (uint64_t)-1 } },
+    { "=", I_CMP, { .type = I_EQ, .operand = 0 } },
+    { "/=", I_CMP, { .type = I_NEQ, .operand = 0 } },
+};
+
+static const kokos_foldable_sform_t* get_foldable_sform(string_view name)
+{
+    for (size_t i = 0; i < sizeof(foldable_sforms) / sizeof(foldable_sforms[0]); i++) {
+        if (sv_eq_cstr(name, foldable_sforms[i].name)) {
+            return &foldable_sforms[i];
+        }
+    }
+
+    return NULL;
+}
+
+/// Whether dividing `values[0]` by the rest could be an integer division by 0 or -1, which would
+/// trap instead of throwing. Any divisor of 0 or -1 is, and so is a product of the divisors that
+/// wraps around to one of them, which is what the vm divides by
+static bool int_division_traps(const kokos_value_t* values, size_t count)
+{
+    uint32_t divisor = 1;
+    bool traps = false;
+    for (size_t i = 0; i < count; i++) {
+        if (VALUE_TAG(values[i]) != INT_TAG) {
+            return false;
+        }
+
+        if (i != 0) {
+            int32_t value = GET_INT(values[i]);
+            traps = traps || value == 0 || value == -1;
+            divisor *= (uint32_t)value;
+        }
+    }
+
+    return traps || divisor == 0 || (int32_t)divisor == -1;
+}
+
+/// Evaluates a foldable special form on the macro vm, so the result is exactly the one the code
+/// would compute at runtime. Returns false if the evaluation throws
+static bool fold_sform(const kokos_foldable_sform_t* sform, const kokos_value_t* values,
+    size_t count, kokos_scope_t* scope, kokos_value_t* out)
+{
+    bool comparison = sform->type == I_CMP;
+    if ((comparison && count != 2) || (sform->type == I_SUB && count == 0)
+        || (sform->type == I_DIV && int_division_traps(values, count))) {
+        return false;
+    }
+
+    kokos_code_t code;
+    DA_INIT(&code, 0, count + 3);
+    for (size_t i = 0; i < count; i++) {
+        DA_ADD(&code, INSTR_PUSH(values[i]));
+    }
+
+    if (comparison) {
+        DA_ADD(&code, INSTR_CMP);
+        DA_ADD(&code, sform->test);
+    } else {
+        DA_ADD(&code, ((kokos_instruction_t) { .type = sform->type, .operand = count }));
+    }
+
+    DA_ADD(&code, INSTR_RET);
+
+    kokos_vm_t* vm = scope->macro_vm;
+    size_t results_count = 0;
+    kokos_value_t* results = NULL;
+    if (kokos_vm_run_code(vm, code, 0)) {
+        results = kokos_vm_results(vm, &results_count);
+    }
+
+    bool ok = results_count != 0;
+    if (ok) {
+        *out = results[results_count - 1];
+    }
+
+    DA_FREE(&code);
+    return ok;
+}
+
+/// Computes the value of `expr` at compile time if it only depends on constants: literals, the
+/// constant globals, the arithmetic and comparison special forms and `if` on a constant test
+static bool fold_constant(const kokos_expr_t* expr, kokos_scope_t* scope, kokos_value_t* out)
+{
+    if (opt_level == KOKOS_OPT_NONE || EXPR_QUOTED(expr)) {
+        return false;
+    }
+
+    switch (expr->type) {
+    case EXPR_INT_LIT:   *out = TO_INT_INT(sv_atoi(expr->token.value)); return true;
+    case EXPR_FLOAT_LIT: *out = TO_VALUE(to_double_bytes(expr)); return true;
+    case EXPR_IDENT:     {
+        uint64_t special;
+        if (get_special_value(expr->token.value, &special)) {
+            *out = TO_VALUE(special);
+            return true;
+        }
+
+        const kokos_runtime_string_t* name
+            = kokos_string_store_add_sv(scope->string_store, expr->token.value);
+        return find_constant_global(scope, name, out);
+    }
+    case EXPR_LIST: {
+        kokos_list_t list = expr->list;
+        if (list.len == 0 || list.items[0].type != EXPR_IDENT || EXPR_QUOTED(&list.items[0])) {
+            return false;
+        }
+
+        string_view head = list.items[0].token.value;
+        if (sv_eq_cstr(head, "if")) {
+            kokos_value_t test;
+            if (list.len != 4 || !fold_constant(&list.items[1], scope, &test)) {
+                return false;
+            }
+
+            bool truthy = !IS_FALSE(test) && !IS_NIL(test);
+            return fold_constant(&list.items[truthy ? 2 : 3], scope, out);
+        }
+
+        const kokos_foldable_sform_t* sform = get_foldable_sform(head);
+        if (!sform) {
+            return false;
+        }
+
+        kokos_value_t* values = KOKOS_CALLOC(list.len, sizeof(kokos_value_t));
+        bool ok = true;
+        for (size_t i = 1; i < list.len && ok; i++) {
+            ok = fold_constant(&list.items[i], scope, &values[i - 1]);
+        }
+
+        ok = ok && fold_sform(sform, values, list.len - 1, scope, out);
+        KOKOS_FREE(values);
+        return ok;
+    }
+    default: return false;
+    }
+}
+
 #include "sform.c"
 
 typedef bool (*kokos_sform_t)(const kokos_expr_t* expr, kokos_scope_t* scope);
@@ -211,6 +538,104 @@ static kokos_scope_t* scope_get_root(kokos_scope_t* scope)
     return scope;
 }
 
+// the most instructions the code of a procedure can have, its returns included, for its calls to be
+// replaced with the code itself
+#define INLINE_BUDGET 24
+
+/// Finds the procedure a call of the global `name` with `nargs` arguments can be inlined as: a
+/// small procedure defined by a `proc` of the top level that doesn't call itself and leaves nothing
+/// but its result on the stack
+static const kokos_runtime_proc_t* get_inlinable_proc(
+    kokos_scope_t* scope, const kokos_runtime_string_t* name, size_t nargs)
+{
+    if (opt_level == KOKOS_OPT_NONE) {
+        return NULL;
+    }
+
+    const kokos_runtime_proc_t* proc = ht_find(&scope_get_root(scope)->procs, name);
+    if (!proc || proc->type != PROC_KOKOS) {
+        return NULL;
+    }
+
+    // the code of a procedure that captures variables only runs in the frame of one of its closures
+    const kokos_proc_t* kproc = &proc->kokos;
+    if (kproc->params.variadic || kproc->params.len != nargs || kproc->code.len > INLINE_BUDGET
+        || kproc->captures_count > 0) {
+        return NULL;
+    }
+
+    size_t* depths = KOKOS_CALLOC(kproc->code.len, sizeof(size_t));
+    bool ok = kokos_code_stack_depths(&kproc->code, depths);
+    for (size_t i = 0; i < kproc->code.len && ok; i++) {
+        kokos_instruction_t instr = kokos_instruction_generic(kproc->code.items[i]);
+        bool calls = kokos_instruction_is_call(instr.type) || instr.type == I_TAIL_CALL;
+        bool returns = instr.type == I_RET && depths[i] != SIZE_MAX;
+
+        ok = !(calls && GET_STRING_INT(instr.operand) == name) && !(returns && depths[i] != 1);
+    }
+
+    KOKOS_FREE(depths);
+    return ok ? proc : NULL;
+}
+
+/// Compiles a call of the global `name` whose arguments are on the stack, the first one on top, to
+/// the code of `proc`. The code only runs while `name` is still bound to `proc`, the call is made
+/// as usual otherwise
+static void inline_call(kokos_scope_t* scope, const kokos_runtime_string_t* name,
+    const kokos_runtime_proc_t* proc, size_t nargs)
+{
+    const kokos_proc_t* kproc = &proc->kokos;
+    kokos_code_t* code = &scope->code;
+    KOKOS_ASSERT(kproc->locals_count >= nargs);
+
+    // the procedure gets slots of its own after the ones in use, starting with its parameters. The
+    // slots have no name, so nothing else can find them
+    size_t locals_len = scope->locals.len;
+    for (size_t i = 0; i < kproc->locals_count; i++) {
+        kokos_scope_add_local(scope, NULL);
+    }
+
+    // the first argument is on top, and goes to the last parameter slot, see `bind_params`
+    for (size_t i = 0; i < nargs; i++) {
+        DA_ADD(code, INSTR_STORE_SLOT(locals_len + nargs - 1 - i));
+    }
+
+    kokos_label_t call_label = kokos_scope_add_label(scope);
+    kokos_label_t end_label = kokos_scope_add_label(scope);
+
+    DA_ADD(code, INSTR_PUSH(TO_PROC((void*)proc)));
+    DA_ADD(code, INSTR_IS_CALLEE(name));
+    DA_ADD(code, INSTR_JZ(call_label));
+
+    size_t start = code->len;
+    for (size_t i = 0; i < kproc->code.len; i++) {
+        kokos_instruction_t instr = kokos_instruction_generic(kproc->code.items[i]);
+        if (instr.type == I_LOAD_SLOT || instr.type == I_STORE_SLOT) {
+            instr.operand += locals_len;
+        } else if (instr.type == I_TAIL_CALL) {
+            // the caller carries on after it
+            instr.type = kokos_instruction_call_type(instr.operand >> 48);
+        } else if (instr.type == I_RET) {
+            instr = INSTR_BRANCH(end_label);
+        } else if (kokos_instruction_is_jump(instr.type)) {
+            kokos_label_t label = kokos_scope_add_label(scope);
+            *label = start + *(size_t*)instr.operand;
+            instr.operand = (uintptr_t)label;
+        }
+
+        DA_ADD(code, instr);
+    }
+
+    *call_label = code->len;
+    for (size_t i = 0; i < nargs; i++) {
+        DA_ADD(code, INSTR_LOAD_SLOT(locals_len + i));
+    }
+    DA_ADD(code, INSTR_CALL(name, nargs));
+    *end_label = code->len;
+
+    kokos_scope_truncate_locals(scope, locals_len);
+}
+
 static void scope_add_call_location(kokos_scope_t* scope, size_t ip, kokos_token_t where)
 {
     scope = scope_get_root(scope);
@@ -338,22 +763,24 @@ static bool kokos_eval_macro(
 
     kokos_scope_t* dumb_scope = kokos_scope_derived(scope);
 
+    // the macro body expects its parameters in the first slots of the frame, see `bind_params`
     for (size_t i = 0; i < args.len; i++) {
         TRY(kokos_expr_compile_quoted(&args.items[i], dumb_scope));
-        DA_ADD(&dumb_scope->code, INSTR_ADD_LOCAL(macro->params.names[i]));
+        DA_ADD(&dumb_scope->code, INSTR_STORE_SLOT(args.len - 1 - i));
     }
 
     DA_EXTEND(&dumb_scope->code, &macro->instructions);
 
     kokos_vm_t* vm = scope->macro_vm;
-    if (!kokos_vm_run_code(vm, dumb_scope->code)) {
+    if (!kokos_vm_run_code(vm, dumb_scope->code, macro->locals_count)) {
         const char* ex = kokos_exception_to_string(&vm->registers.exception);
         set_error(expr->token.location, "macro evaluation has produced an exception: %s", ex);
         return false;
     }
 
-    kokos_frame_t* f = vm->frames.data[0];
-    kokos_expr_list_t exprs = kokos_values_to_exprs(f->stack.data, f->stack.sp, scope);
+    size_t results_count;
+    kokos_value_t* results = kokos_vm_results(vm, &results_count);
+    kokos_expr_list_t exprs = kokos_values_to_exprs(results, results_count, scope);
     for (size_t i = 0; i < exprs.len; i++) {
         TRY(kokos_expr_compile(&exprs.exprs[i], scope));
     }
@@ -371,6 +798,13 @@ static bool compile_list(const kokos_expr_t* expr, kokos_scope_t* scope)
         return true;
     }
 
+    // the arithmetic and the comparisons of constants are computed right away
+    kokos_value_t folded;
+    if (fold_constant(expr, scope, &folded)) {
+        DA_ADD(&scope->code, INSTR_PUSH(folded));
+        return true;
+    }
+
     string_view head = list.items[0].token.value;
 
     kokos_sform_t sform = get_sform(head);
@@ -392,14 +826,150 @@ static bool compile_list(const kokos_expr_t* expr, kokos_scope_t* scope)
     /**/
     kokos_list_t args = list_slice(expr->list, 1);
     TRY(kokos_compile_all_reversed(args, scope, kokos_expr_compile));
-    DA_ADD(&scope->code,
-        INSTR_CALL(kokos_string_store_add_sv(scope->string_store, head), list.len - 1));
+
+    const kokos_expr_t* callee = &list.items[0];
+    if (callee->type != EXPR_IDENT) {
+        TRY(kokos_expr_compile(callee, scope));
+        DA_ADD(&scope->code, INSTR_CALL(NULL, args.len));
+        return true;
+    }
+
+    const kokos_runtime_string_t* name = kokos_string_store_add_sv(scope->string_store, head);
+
+    kokos_instruction_t load;
+    if (find_local_load(scope, name, &load)) {
+        DA_ADD(&scope->code, load);
+        DA_ADD(&scope->code, INSTR_CALL(NULL, args.len));
+        return true;
+    }
+
+    const kokos_runtime_proc_t* inlinee = get_inlinable_proc(scope, name, args.len);
+    if (inlinee) {
+        inline_call(scope, name, inlinee, args.len);
+        return true;
+    }
+
+    DA_ADD(&scope->code, INSTR_CALL(name, args.len));
 
     return true;
 }
 
+/// Whether `expr` is a literal collection whose elements are all literals, so its value can be
+/// built once at compile time. `quoted` is true for the elements of a quoted list
+static bool is_constant_literal(const kokos_expr_t* expr, bool quoted)
+{
+    uint64_t special;
+
+    switch (expr->type) {
+    case EXPR_INT_LIT:
+    case EXPR_FLOAT_LIT:
+    case EXPR_STRING_LIT: return true;
+    case EXPR_IDENT:      return quoted || get_special_value(expr->token.value, &special);
+    case EXPR_LIST:       {
+        if (!quoted && !EXPR_QUOTED(expr)) {
+            return false;
+        }
+
+        for (size_t i = 0; i < expr->list.len; i++) {
+            if (!is_constant_literal(&expr->list.items[i], true)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+    case EXPR_VECTOR: {
+        for (size_t i = 0; i < expr->vec.len; i++) {
+            if (!is_constant_literal(&expr->vec.items[i], false)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+    case EXPR_MAP: {
+        for (size_t i = 0; i < expr->map.len; i++) {
+            // only strings can be hashed as keys
+            if (expr->map.keys[i].type != EXPR_STRING_LIT
+                || !is_constant_literal(&expr->map.values[i], false)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+    default: return false;
+    }
+}
+
+/// Builds the value of an expression `is_constant_literal` returned true for
+static kokos_value_t build_constant(const kokos_expr_t* expr, bool quoted, kokos_scope_t* scope)
+{
+    switch (expr->type) {
+    case EXPR_INT_LIT:   return TO_INT_INT(sv_atoi(expr->token.value));
+    case EXPR_FLOAT_LIT: return TO_VALUE(to_double_bytes(expr));
+    case EXPR_STRING_LIT:
+        return TO_STRING((void*)kokos_string_store_add_sv(scope->string_store, expr->token.value));
+    case EXPR_IDENT: {
+        uint64_t special;
+        if (!quoted && get_special_value(expr->token.value, &special)) {
+            return TO_VALUE(special);
+        }
+
+        return TO_SYM((void*)kokos_string_store_add_sv(scope->string_store, expr->token.value));
+    }
+    case EXPR_LIST: {
+        kokos_value_t value = kokos_runtime_constant_new(LIST_TAG, expr->list.len);
+        kokos_runtime_list_t* list = GET_LIST(value);
+        for (size_t i = 0; i < expr->list.len; i++) {
+            list->items[i] = build_constant(&expr->list.items[i], true, scope);
+        }
+
+        return value;
+    }
+    case EXPR_VECTOR: {
+        kokos_value_t value = kokos_runtime_constant_new(VECTOR_TAG, expr->vec.len);
+        kokos_runtime_vector_t* vec = GET_VECTOR(value);
+        for (size_t i = 0; i < expr->vec.len; i++) {
+            DA_ADD(vec, build_constant(&expr->vec.items[i], false, scope));
+        }
+
+        return value;
+    }
+    case EXPR_MAP: {
+        kokos_value_t value = kokos_runtime_constant_new(MAP_TAG, expr->map.len);
+        // add the pairs in the same order `I_ALLOC` does
+        for (ssize_t i = expr->map.len - 1; i >= 0; i--) {
+            kokos_value_t key = build_constant(&expr->map.keys[i], false, scope);
+            kokos_value_t val = build_constant(&expr->map.values[i], false, scope);
+            kokos_runtime_map_add(GET_MAP(value), key, val);
+        }
+
+        return value;
+    }
+    default: KOKOS_TODO();
+    }
+}
+
+/// Compiles a literal collection that only contains literals into a push from the constant pool,
+/// so evaluating it doesn't allocate. Returns false if the collection is not constant
+static bool compile_constant_literal(const kokos_expr_t* expr, bool quoted, kokos_scope_t* scope)
+{
+    if (!is_constant_literal(expr, quoted)) {
+        return false;
+    }
+
+    DA_ADD(scope->constants, build_constant(expr, quoted, scope));
+    DA_ADD(&scope->code, INSTR_PUSH_CONST(scope->constants->len - 1));
+    return true;
+}
+
 bool compile_quoted_list(const kokos_expr_t* expr, kokos_scope_t* scope)
 {
+    if (compile_constant_literal(expr, true, scope)) {
+        return true;
+    }
+
     kokos_list_t list = expr->list;
     for (ssize_t i = list.len - 1; i >= 0; i--) {
         TRY(kokos_expr_compile_quoted(&list.items[i], scope));
@@ -433,12 +1003,26 @@ bool kokos_expr_compile(const kokos_expr_t* expr, kokos_scope_t* scope)
     case EXPR_IDENT: {
         uint64_t special;
         if (get_special_value(expr->token.value, &special)) {
-            DA_ADD(code, INSTR_PUSH(TO_STRING_INT(special)));
+            DA_ADD(code, INSTR_PUSH(TO_VALUE(special)));
+            break;
+        }
+
+        const kokos_runtime_string_t* name
+            = kokos_string_store_add_sv(scope->string_store, expr->token.value);
+
+        kokos_instruction_t load;
+        if (find_local_load(scope, name, &load)) {
+            DA_ADD(code, load);
+            break;
+        }
+
+        kokos_value_t constant;
+        if (find_constant_global(scope, name, &constant)) {
+            DA_ADD(code, INSTR_PUSH(constant));
             break;
         }
 
-        DA_ADD(code,
-            INSTR_GET_LOCAL(kokos_string_store_add_sv(scope->string_store, expr->token.value)));
+        DA_ADD(code, INSTR_GET_GLOBAL(name));
         break;
     }
     case EXPR_STRING_LIT: {
@@ -448,6 +1032,10 @@ bool kokos_expr_compile(const kokos_expr_t* expr, kokos_scope_t* scope)
         break;
     }
     case EXPR_MAP: {
+        if (compile_constant_literal(expr, false, scope)) {
+            break;
+        }
+
         kokos_map_t map = expr->map;
         for (size_t i = 0; i < map.len; i++) {
             TRY(kokos_expr_compile(&map.keys[i], scope));
@@ -458,6 +1046,10 @@ bool kokos_expr_compile(const kokos_expr_t* expr, kokos_scope_t* scope)
         break;
     }
     case EXPR_VECTOR: {
+        if (compile_constant_literal(expr, false, scope)) {
+            break;
+        }
+
         kokos_vec_t vec = expr->vec;
         for (ssize_t i = vec.len - 1; i >= 0; i--) {
             TRY(kokos_expr_compile(&vec.items[i], scope));
@@ -514,11 +1106,15 @@ static void kokos_compiled_module_init_from_scope(
 
     module->call_locations = scope->call_locations;
     module->string_store = *scope->string_store;
+    module->constants = scope->constants;
     module->procs = scope->procs;
     /*module->macros = scope->macros;*/
-    module->top_level_code_start = module->instructions.len;
+    // procedures have code of their own, everything in the scope's code is top level
+    module->top_level_code_start = 0;
+    module->locals_count = scope->locals_count;
 
     DA_ADD(&scope->code, INSTR_RET);
+    kokos_optimize(&scope->code, opt_level);
     module->instructions = scope->code;
 }
 
@@ -526,7 +1122,24 @@ bool kokos_compile_module(
     kokos_module_t module, kokos_scope_t* scope, kokos_compiled_module_t* compiled_module)
 {
     for (size_t i = 0; i < module.len; i++) {
-        TRY(kokos_expr_compile(&module.items[i], scope));
+        const kokos_expr_t* expr = &module.items[i];
+
+        // a global bound to a constant by a `var` of the top level stays bound to it until the next
+        // `var` or `proc` of the same name
+        kokos_value_t constant;
+        bool binds_constant = kokos_scope_is_global(scope) && expr->type == EXPR_LIST
+            && !EXPR_QUOTED(expr) && expr->list.len == 3 && expr->list.items[0].type == EXPR_IDENT
+            && sv_eq_cstr(expr->list.items[0].token.value, "var")
+            && expr->list.items[1].type == EXPR_IDENT
+            && fold_constant(&expr->list.items[2], scope, &constant);
+
+        TRY(kokos_expr_compile(expr, scope));
+
+        if (binds_constant) {
+            remember_constant_global(scope,
+                kokos_string_store_add_sv(scope->string_store, expr->list.items[1].token.value),
+                constant);
+        }
     }
 
     kokos_compiled_module_init_from_scope(compiled_module, scope);
@@ -4,15 +4,19 @@
 #include "ast.h"
 #include "base.h"
 #include "instruction.h"
+#include "optimize.h"
 #include "scope.h"
 #include "string-store.h"
 
 typedef struct {
     kokos_string_store_t string_store;
+    const kokos_constant_pool_t* constants;
     kokos_code_t instructions;
     hash_table call_locations;
     hash_table procs;
     size_t top_level_code_start;
+    // number of slots the top-level code needs for its `let` bindings
+    size_t locals_count;
 } kokos_compiled_module_t;
 
 // NOTE: maybe create a compiler structure so we potentially can run it multithreaded
@@ -20,6 +24,9 @@ bool kokos_expr_compile(const kokos_expr_t* expr, kokos_scope_t* scope);
 bool kokos_compile_module(
     kokos_module_t module, kokos_scope_t* scope, kokos_compiled_module_t* compiled_module);
 
+/// Sets how much the code compiled from now on is optimized, `KOKOS_OPT_DEFAULT` if it is never set
+void kokos_compile_set_opt_level(kokos_opt_level_e level);
+
 bool kokos_compile_ok(void);
 const char* kokos_compile_get_err(void);
 
@@ -2,11 +2,15 @@
 #include "hash.h"
 #include "macros.h"
 
+// 0 is never a version, so it can mean that nothing was looked up yet
+static uint64_t last_version = 0;
+
 kokos_env_t* kokos_env_create(kokos_env_t* parent, size_t cap)
 {
     kokos_env_t* env = KOKOS_ZALLOC(sizeof(*parent));
     env->vars = ht_make(hash_runtime_string_func, hash_runtime_string_eq_func, cap || 1);
     env->parent = parent;
+    env->version = ++last_version;
     return env;
 }
 
@@ -28,6 +32,7 @@ bool kokos_env_lookup(kokos_env_t* env, const kokos_runtime_string_t* name, koko
 void kokos_env_add(kokos_env_t* env, const kokos_runtime_string_t* name, kokos_value_t value)
 {
     ht_add(&env->vars, (kokos_runtime_string_t*)name, TO_PTR(value));
+    env->version = ++last_version;
 }
 
 void kokos_env_destroy(kokos_env_t* env)
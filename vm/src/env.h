@@ -7,10 +7,16 @@
 typedef struct kokos_env {
     hash_table vars;
     struct kokos_env* parent;
+    // changes whenever a variable is bound, and no two environments ever share one, so anything
+    // looked up in the environment stays valid for as long as the version does not change
+    uint64_t version;
 } kokos_env_t;
 
 kokos_env_t* kokos_env_create(kokos_env_t* parent, size_t cap);
 bool kokos_env_lookup(kokos_env_t* env, const kokos_runtime_string_t* name, kokos_value_t* out);
+/// Binds `name` to `value`. An environment is not a gc object, and the globals of a vm are a root
+/// of every collection that the marking scans again before it finishes, so this needs no write
+/// barrier
 void kokos_env_add(kokos_env_t* env, const kokos_runtime_string_t* name, kokos_value_t value);
 void kokos_env_destroy(kokos_env_t* env);
 
@@ -1,99 +1,802 @@
 #include "gc.h"
 #include "macros.h"
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
-kokos_gc_objs_t objs_new(size_t cap)
+// the sizes of the slots of the pages, from the smallest one. They are multiples of 16, so every
+// slot is aligned like the ones of `malloc`
+static const uint32_t kokos_gc_slot_sizes[GC_SIZE_CLASSES_COUNT] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320,
+    384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+kokos_gc_t kokos_gc_new(size_t nursery_size, size_t min_heap_size, size_t max_heap_size)
 {
-    kokos_gc_obj_t* values = KOKOS_CALLOC(cap, sizeof(kokos_gc_obj_t));
-    return (kokos_gc_objs_t) { .values = values, .len = 0, .cap = cap };
+    kokos_gc_t gc = {
+        .large = NULL,
+        .heap_size = 0,
+        .heap_target = min_heap_size,
+        .min_heap_size = min_heap_size,
+        .max_heap_size = max_heap_size,
+    };
+
+    for (size_t i = 0; i < GC_SIZE_CLASSES_COUNT; i++) {
+        gc.classes[i] = (kokos_gc_size_class_t) { .slot_size = kokos_gc_slot_sizes[i] };
+    }
+
+    gc.nursery.start = KOKOS_ALLOC(nursery_size);
+    gc.nursery.top = gc.nursery.start;
+    gc.nursery.end = gc.nursery.start + nursery_size;
+
+    DA_INIT(&gc.remembered, 0, 16);
+    DA_INIT(&gc.promoted, 0, 64);
+    DA_INIT(&gc.gray, 0, 64);
+
+    return gc;
 }
 
-kokos_gc_t kokos_gc_new(size_t max_objs)
+// objects in the nursery are laid out back to back, keep every header aligned
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+#define NURSERY_ITER(gc, body)                                                                     \
+    do {                                                                                           \
+        char* __cur = (gc)->nursery.start;                                                         \
+        while (__cur < (gc)->nursery.top) {                                                        \
+            kokos_gc_header_t* header = (kokos_gc_header_t*)__cur;                                 \
+            __cur += NURSERY_ALIGN(sizeof(kokos_gc_header_t) + header->size);                      \
+            body                                                                                   \
+        }                                                                                          \
+    } while (0)
+
+/// Frees the memory owned by the object, but not the object itself
+static void kokos_gc_obj_release(kokos_gc_header_t* header)
 {
-    return (kokos_gc_t) {
-        .max_objs = max_objs,
-        .objects = objs_new(max_objs),
-    };
+    void* obj = header + 1;
+
+    switch (header->tag) {
+    case STRING_TAG:
+    case SYM_TAG: {
+        kokos_runtime_string_t* str = obj;
+        if (!HAS_INLINE_ELEMENTS(str, str->ptr)) {
+            KOKOS_FREE(str->ptr);
+        }
+
+        break;
+    }
+    case LIST_TAG: {
+        kokos_runtime_list_t* list = obj;
+        if (!HAS_INLINE_ELEMENTS(list, list->items)) {
+            KOKOS_FREE(list->items);
+        }
+
+        break;
+    }
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vec = obj;
+        if (!HAS_INLINE_ELEMENTS(vec, vec->items)) {
+            KOKOS_FREE(vec->items);
+        }
+
+        break;
+    }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = obj;
+        ht_destroy(&map->table);
+        break;
+    }
+    case PROC_TAG: break;
+    default:       {
+        char buf[512];
+        sprintf(buf, "gc object value tag %x", header->tag);
+        KOKOS_TODO(buf);
+    }
+    }
+}
+
+static void kokos_gc_obj_free(kokos_gc_header_t* header)
+{
+    kokos_gc_obj_release(header);
+    KOKOS_FREE(header);
+}
+
+/// Whether the object `header` owns memory that `kokos_gc_obj_release` has to free
+static bool kokos_gc_obj_owns_memory(const kokos_gc_header_t* header)
+{
+    const void* obj = header + 1;
+
+    switch (header->tag) {
+    case STRING_TAG:
+    case SYM_TAG: {
+        const kokos_runtime_string_t* str = obj;
+        return !HAS_INLINE_ELEMENTS(str, str->ptr);
+    }
+    case LIST_TAG: {
+        const kokos_runtime_list_t* list = obj;
+        return !HAS_INLINE_ELEMENTS(list, list->items);
+    }
+    case VECTOR_TAG: {
+        const kokos_runtime_vector_t* vec = obj;
+        return !HAS_INLINE_ELEMENTS(vec, vec->items);
+    }
+    case MAP_TAG:  return true;
+    case PROC_TAG: return false;
+    default:       KOKOS_TODO();
+    }
+}
+
+/// Points the elements of `copy`, a copy of `header`, to its own if `header` kept them inline
+static void kokos_gc_move_elements(kokos_gc_header_t* copy, const kokos_gc_header_t* header)
+{
+    const void* obj = header + 1;
+    void* copy_obj = copy + 1;
+
+    switch (header->tag) {
+    case STRING_TAG:
+    case SYM_TAG: {
+        const kokos_runtime_string_t* str = obj;
+        kokos_runtime_string_t* copy_str = copy_obj;
+        if (HAS_INLINE_ELEMENTS(str, str->ptr)) {
+            copy_str->ptr = (char*)(copy_str + 1);
+        }
+
+        break;
+    }
+    case LIST_TAG: {
+        const kokos_runtime_list_t* list = obj;
+        kokos_runtime_list_t* copy_list = copy_obj;
+        if (HAS_INLINE_ELEMENTS(list, list->items)) {
+            copy_list->items = (kokos_value_t*)(copy_list + 1);
+        }
+
+        break;
+    }
+    case VECTOR_TAG: {
+        const kokos_runtime_vector_t* vec = obj;
+        kokos_runtime_vector_t* copy_vec = copy_obj;
+        if (HAS_INLINE_ELEMENTS(vec, vec->items)) {
+            copy_vec->items = (kokos_value_t*)(copy_vec + 1);
+        }
+
+        break;
+    }
+    default: break;
+    }
+}
+
+#define PAGE_WORDS_COUNT(page) (((page)->slots_count + 63) / 64)
+
+static kokos_gc_header_t* kokos_gc_page_slot(kokos_gc_page_t* page, size_t slot)
+{
+    return (kokos_gc_header_t*)(page->slots + slot * page->slot_size);
+}
+
+/// Returns the bits of the word `w` of a bitmap of `page` that stand for one of its slots
+static uint64_t kokos_gc_page_word_mask(const kokos_gc_page_t* page, size_t w)
+{
+    size_t rest = page->slots_count - w * 64;
+    return rest >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << rest) - 1;
+}
+
+static kokos_gc_page_t* kokos_gc_page_new(uint32_t slot_size)
+{
+    kokos_gc_page_t* page = KOKOS_ALIGNED_ALLOC(GC_PAGE_SIZE, GC_PAGE_SIZE);
+    memset(page, 0, sizeof(kokos_gc_page_t));
+    page->slot_size = slot_size;
+    page->slots_count = (GC_PAGE_SIZE - sizeof(kokos_gc_page_t)) / slot_size;
+
+    return page;
+}
+
+/// Releases every object of `page`, the dead ones that were not swept included, and frees it
+static void kokos_gc_page_free(kokos_gc_page_t* page)
+{
+    for (size_t w = 0; w < PAGE_WORDS_COUNT(page); w++) {
+        for (uint64_t owners = page->live[w] & page->owners[w]; owners; owners &= owners - 1) {
+            kokos_gc_obj_release(kokos_gc_page_slot(page, w * 64 + __builtin_ctzll(owners)));
+        }
+    }
+
+    KOKOS_FREE(page);
+}
+
+static void kokos_gc_pages_free(kokos_gc_page_t* page)
+{
+    while (page) {
+        kokos_gc_page_t* next = page->next;
+        kokos_gc_page_free(page);
+        page = next;
+    }
+}
+
+/// Returns the bytes the old object `header` takes, its slot and the memory it owns
+static size_t kokos_gc_obj_footprint(const kokos_gc_header_t* header)
+{
+    const void* obj = header + 1;
+
+    size_t size = IS_LARGE(header) ? sizeof(kokos_gc_header_t) + header->size
+                                   : kokos_gc_page_of(header)->slot_size;
+    if (!kokos_gc_obj_owns_memory(header)) {
+        return size;
+    }
+
+    switch (header->tag) {
+    case STRING_TAG:
+    case SYM_TAG: {
+        const kokos_runtime_string_t* str = obj;
+        return size + str->len;
+    }
+    case LIST_TAG: {
+        const kokos_runtime_list_t* list = obj;
+        return size + list->len * sizeof(kokos_value_t);
+    }
+    case VECTOR_TAG: {
+        const kokos_runtime_vector_t* vec = obj;
+        return size + vec->cap * sizeof(kokos_value_t);
+    }
+    case MAP_TAG: {
+        const kokos_runtime_map_t* map = obj;
+        return size + map->table.cap * (sizeof(ht_kv_pair) + sizeof(uint64_t) + sizeof(int8_t));
+    }
+    default: return size;
+    }
 }
 
 void kokos_gc_destroy(kokos_gc_t* gc)
 {
-    for (size_t i = 0; i < gc->objects.cap; i++) {
-        kokos_gc_obj_t obj = gc->objects.values[i];
-        if (!IS_OCCUPIED(obj)) {
+    NURSERY_ITER(gc, { kokos_gc_obj_release(header); });
+
+    KOKOS_FREE(gc->nursery.start);
+    DA_FREE(&gc->remembered);
+    DA_FREE(&gc->promoted);
+    DA_FREE(&gc->gray);
+
+    for (size_t i = 0; i < GC_SIZE_CLASSES_COUNT; i++) {
+        kokos_gc_size_class_t* class = &gc->classes[i];
+        kokos_gc_pages_free(class->available);
+        kokos_gc_pages_free(class->full);
+        kokos_gc_pages_free(class->unswept);
+        *class = (kokos_gc_size_class_t) { .slot_size = class->slot_size };
+    }
+
+    kokos_gc_header_t* header = gc->large;
+    while (header) {
+        kokos_gc_header_t* next = header->next;
+        kokos_gc_obj_free(header);
+        header = next;
+    }
+
+    gc->large = NULL;
+    gc->heap_size = 0;
+    gc->live_size = 0;
+}
+
+void* kokos_gc_alloc(kokos_gc_t* gc, uint16_t tag, size_t size)
+{
+    size_t total = NURSERY_ALIGN(sizeof(kokos_gc_header_t) + size);
+    if (UNLIKELY((size_t)(gc->nursery.end - gc->nursery.top) < total)) {
+        return NULL;
+    }
+
+    kokos_gc_header_t* header = (kokos_gc_header_t*)gc->nursery.top;
+    gc->nursery.top += total;
+
+    header->tag = tag;
+    header->flags = OBJ_FLAG_YOUNG;
+    header->size = size;
+    header->next = NULL;
+
+    return header + 1;
+}
+
+void* kokos_gc_alloc_static(uint16_t tag, size_t size)
+{
+    kokos_gc_header_t* header = KOKOS_ZALLOC(sizeof(kokos_gc_header_t) + size);
+    header->tag = tag;
+    header->flags = OBJ_FLAG_STATIC;
+    header->size = size;
+    header->next = NULL;
+
+    return header + 1;
+}
+
+void kokos_gc_free_static(void* obj)
+{
+    kokos_gc_header_t* header = kokos_gc_header(obj);
+    KOKOS_ASSERT(IS_STATIC(header));
+
+    KOKOS_FREE(header);
+}
+
+static void kokos_gc_set_marked(kokos_gc_header_t* header)
+{
+    if (IS_LARGE(header)) {
+        header->flags |= OBJ_FLAG_MARKED;
+        return;
+    }
+
+    kokos_gc_page_t* page = kokos_gc_page_of(header);
+    size_t slot = kokos_gc_slot_index(page, header);
+    page->marks[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+/// Takes the first free slot of `page`, or returns NULL if it has none
+static kokos_gc_header_t* kokos_gc_page_alloc(kokos_gc_page_t* page)
+{
+    for (; page->free_word < PAGE_WORDS_COUNT(page); page->free_word++) {
+        size_t w = page->free_word;
+        uint64_t free = ~page->live[w] & kokos_gc_page_word_mask(page, w);
+        if (free) {
+            size_t bit = __builtin_ctzll(free);
+            page->live[w] |= (uint64_t)1 << bit;
+            return kokos_gc_page_slot(page, w * 64 + bit);
+        }
+    }
+
+    return NULL;
+}
+
+/// Frees the objects of `page` that were not marked and clears the marks of the rest. Returns the
+/// number of objects left on the page
+static size_t kokos_gc_page_sweep(kokos_gc_page_t* page)
+{
+    size_t live = 0;
+    for (size_t w = 0; w < PAGE_WORDS_COUNT(page); w++) {
+        uint64_t dead = page->live[w] & ~page->marks[w];
+        for (uint64_t owners = dead & page->owners[w]; owners; owners &= owners - 1) {
+            kokos_gc_obj_release(kokos_gc_page_slot(page, w * 64 + __builtin_ctzll(owners)));
+        }
+
+        page->owners[w] &= page->marks[w];
+        page->live[w] = page->marks[w];
+        page->marks[w] = 0;
+        live += __builtin_popcountll(page->live[w]);
+    }
+
+    page->free_word = 0;
+    return live;
+}
+
+#define PAGE_PUSH(list, page)                                                                      \
+    do {                                                                                           \
+        (page)->next = (list);                                                                     \
+        (list) = (page);                                                                           \
+    } while (0)
+
+/// Sweeps the page and files it under `class` by what is left on it, or frees it if it is empty
+static void kokos_gc_class_sweep_page(kokos_gc_size_class_t* class, kokos_gc_page_t* page)
+{
+    size_t live = kokos_gc_page_sweep(page);
+    if (live == 0) {
+        KOKOS_FREE(page);
+    } else if (live == page->slots_count) {
+        PAGE_PUSH(class->full, page);
+    } else {
+        PAGE_PUSH(class->available, page);
+    }
+}
+
+/// Takes a free slot of `class`. The pages left by the last full collection are swept only when the
+/// pages that were swept already are full, and a new page is added only when there is none left
+static kokos_gc_header_t* kokos_gc_class_alloc(kokos_gc_size_class_t* class)
+{
+    for (;;) {
+        kokos_gc_page_t* page = class->available;
+        if (page) {
+            kokos_gc_header_t* header = kokos_gc_page_alloc(page);
+            if (header) {
+                return header;
+            }
+
+            class->available = page->next;
+            PAGE_PUSH(class->full, page);
             continue;
         }
 
-        kokos_gc_obj_free(&obj);
+        page = class->unswept;
+        if (!page) {
+            break;
+        }
+
+        class->unswept = page->next;
+        // an empty page is kept for the allocation instead of being freed
+        if (kokos_gc_page_sweep(page) == page->slots_count) {
+            PAGE_PUSH(class->full, page);
+        } else {
+            PAGE_PUSH(class->available, page);
+        }
+    }
+
+    kokos_gc_page_t* page = kokos_gc_page_new(class->slot_size);
+    PAGE_PUSH(class->available, page);
+    return kokos_gc_page_alloc(page);
+}
+
+/// Copies the young object `header` to the old space
+static kokos_gc_header_t* kokos_gc_promote(kokos_gc_t* gc, const kokos_gc_header_t* header)
+{
+    size_t total = sizeof(kokos_gc_header_t) + header->size;
+
+    kokos_gc_header_t* copy = NULL;
+    for (size_t i = 0; i < GC_SIZE_CLASSES_COUNT && !copy; i++) {
+        if (total <= gc->classes[i].slot_size) {
+            copy = kokos_gc_class_alloc(&gc->classes[i]);
+        }
+    }
+
+    if (copy) {
+        memcpy(copy, header, total);
+        copy->flags = 0;
+        copy->next = NULL;
+        kokos_gc_move_elements(copy, header);
+
+        if (kokos_gc_obj_owns_memory(copy)) {
+            kokos_gc_page_t* page = kokos_gc_page_of(copy);
+            size_t slot = kokos_gc_slot_index(page, copy);
+            page->owners[slot / 64] |= (uint64_t)1 << (slot % 64);
+        }
+    } else {
+        copy = KOKOS_ALLOC(total);
+        memcpy(copy, header, total);
+        kokos_gc_move_elements(copy, header);
+        copy->flags = OBJ_FLAG_LARGE;
+        copy->next = gc->large;
+        gc->large = copy;
+    }
+
+    gc->heap_size += kokos_gc_obj_footprint(copy);
+    return copy;
+}
+
+void kokos_gc_evacuate(kokos_gc_t* gc, kokos_value_t* slot)
+{
+    if (!kokos_gc_is_heap_value(*slot)) {
+        return;
+    }
+
+    void* obj = GET_PTR(*slot);
+    kokos_gc_header_t* header = kokos_gc_header(obj);
+    if (!IS_YOUNG(header)) {
+        return;
+    }
+
+    if (!IS_FORWARDED(header)) {
+        kokos_gc_header_t* copy = kokos_gc_promote(gc, header);
+
+        header->flags |= OBJ_FLAG_FORWARDED;
+        header->next = copy;
+
+        DA_ADD(&gc->promoted, copy);
+
+        // the marking may be past whatever references the object now, so it is taken as reachable
+        if (gc->marking) {
+            kokos_gc_set_marked(copy);
+            gc->marked_size += kokos_gc_obj_footprint(copy);
+            DA_ADD(&gc->gray, copy);
+        }
     }
 
-    KOKOS_FREE(gc->objects.values);
+    slot->as_int = (uint64_t)VALUE_TAG(*slot) << 48 | (uintptr_t)(header->next + 1);
 }
 
-size_t objs_load(const kokos_gc_objs_t* objs)
+static void kokos_gc_evacuate_table(kokos_gc_t* gc, hash_table* table)
 {
-    return ((float)objs->len / (float)objs->cap) * 100;
+    HT_ITER_PTR(*table, {
+        // keys are hashed by their contents, so moving them keeps the table valid
+        kokos_value_t key = FROM_PTR(kv->key);
+        kokos_value_t value = FROM_PTR(kv->value);
+        kokos_gc_evacuate(gc, &key);
+        kokos_gc_evacuate(gc, &value);
+        kv->key = TO_PTR(key);
+        kv->value = TO_PTR(value);
+    });
 }
 
-size_t value_hash(kokos_value_t value)
+/// Evacuates every young object referenced by the fields of `header`
+static void kokos_gc_evacuate_fields(kokos_gc_t* gc, kokos_gc_header_t* header)
 {
-    return value.as_int;
+    void* obj = header + 1;
+
+    switch (header->tag) {
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vec = obj;
+        for (size_t i = 0; i < vec->len; i++) {
+            kokos_gc_evacuate(gc, &vec->items[i]);
+        }
+
+        break;
+    }
+    case LIST_TAG: {
+        kokos_runtime_list_t* list = obj;
+        for (size_t i = 0; i < list->len; i++) {
+            kokos_gc_evacuate(gc, &list->items[i]);
+        }
+
+        break;
+    }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = obj;
+        kokos_gc_evacuate_table(gc, &map->table);
+        break;
+    }
+    case PROC_TAG: {
+        kokos_runtime_proc_t* closure = obj;
+        kokos_value_t* values = kokos_closure_values(closure);
+        for (size_t i = 0; i < closure->closure.len; i++) {
+            kokos_gc_evacuate(gc, &values[i]);
+        }
+
+        break;
+    }
+    case STRING_TAG:
+    case SYM_TAG:    break;
+    default:         KOKOS_TODO();
+    }
 }
 
-void objs_add(kokos_gc_objs_t* objs, kokos_gc_obj_t obj)
+void kokos_gc_scavenge(kokos_gc_t* gc)
 {
-    if (objs_load(objs) >= 70) {
-        kokos_gc_objs_t new_objs = objs_new(objs->cap * 2);
+    for (size_t i = 0; i < gc->remembered.len; i++) {
+        kokos_gc_header_t* header = gc->remembered.items[i];
+        header->flags &= ~OBJ_FLAG_REMEMBERED;
+        kokos_gc_evacuate_fields(gc, header);
+    }
+
+    gc->remembered.len = 0;
 
-        for (size_t i = 0; i < objs->cap; i++) {
-            if (IS_OCCUPIED(objs->values[i])) {
-                objs_add(&new_objs, objs->values[i]);
+    // evacuating the fields of a promoted object may promote more objects
+    while (gc->promoted.len > 0) {
+        kokos_gc_header_t* header = gc->promoted.items[--gc->promoted.len];
+        kokos_gc_evacuate_fields(gc, header);
+    }
+
+    // the copies own the memory of the promoted objects now, only the dead ones have to be released
+    NURSERY_ITER(gc, {
+        if (!IS_FORWARDED(header)) {
+            kokos_gc_obj_release(header);
+        }
+    });
+
+    gc->nursery.top = gc->nursery.start;
+}
+
+void kokos_gc_mark_value(kokos_gc_t* gc, kokos_value_t value)
+{
+    if (!kokos_gc_is_heap_value(value)) {
+        return;
+    }
+
+    kokos_gc_header_t* header = kokos_gc_header(GET_PTR(value));
+
+    // static objects never reference gc objects, so there is nothing to do for them
+    if (IS_STATIC(header) || IS_YOUNG(header) || kokos_gc_is_marked(header)) {
+        return;
+    }
+
+    kokos_gc_set_marked(header);
+    gc->marked_size += kokos_gc_obj_footprint(header);
+
+    // strings and symbols have no fields to trace
+    if (header->tag != STRING_TAG && header->tag != SYM_TAG) {
+        DA_ADD(&gc->gray, header);
+    }
+}
+
+// how many values ahead of the one being marked the header of a value is fetched, so it is in the
+// cache by the time it is marked
+#define MARK_PREFETCH_DISTANCE 8
+
+static void kokos_gc_mark_values(kokos_gc_t* gc, const kokos_value_t* values, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (i + MARK_PREFETCH_DISTANCE < len) {
+            kokos_value_t ahead = values[i + MARK_PREFETCH_DISTANCE];
+            if (kokos_gc_is_heap_value(ahead)) {
+                __builtin_prefetch(kokos_gc_header(GET_PTR(ahead)), 1);
             }
         }
 
-        KOKOS_FREE(objs->values);
-        *objs = new_objs;
+        kokos_gc_mark_value(gc, values[i]);
     }
+}
 
-    size_t idx = value_hash(obj.value) % objs->cap;
-    kokos_gc_obj_t iv = objs->values[idx];
+/// Marks the objects referenced by the fields of the marked object `header`
+static void kokos_gc_mark_fields(kokos_gc_t* gc, kokos_gc_header_t* header)
+{
+    void* obj = header + 1;
 
-    while (IS_OCCUPIED(iv)) {
-        idx = (idx + 1) % objs->cap;
-        iv = objs->values[idx];
+    switch (header->tag) {
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vec = obj;
+        kokos_gc_mark_values(gc, vec->items, vec->len);
+        break;
+    }
+    case LIST_TAG: {
+        kokos_runtime_list_t* list = obj;
+        kokos_gc_mark_values(gc, list->items, list->len);
+        break;
     }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = obj;
+        HT_ITER(map->table, {
+            kokos_gc_mark_value(gc, FROM_PTR(kv.key));
+            kokos_gc_mark_value(gc, FROM_PTR(kv.value));
+        });
 
-    objs->values[idx] = obj;
-    objs->len++;
+        break;
+    }
+    case PROC_TAG: {
+        kokos_runtime_proc_t* closure = obj;
+        kokos_gc_mark_values(gc, kokos_closure_values(closure), closure->closure.len);
+        break;
+    }
+    case STRING_TAG:
+    case SYM_TAG:    break;
+    default:         {
+        char buf[128];
+        sprintf(buf, "gc object value tag %x", header->tag);
+        KOKOS_TODO(buf);
+    }
+    }
 }
 
-kokos_gc_obj_t* objs_find(kokos_gc_objs_t* objs, kokos_value_t value)
+void kokos_gc_trace(kokos_gc_t* gc)
 {
-    size_t idx = value_hash(value) % objs->cap;
-    kokos_gc_obj_t* iv = &objs->values[idx];
-    if (!IS_OCCUPIED(*iv)) {
-        return NULL;
+    // marking the fields of an object may add more objects to the stack
+    while (gc->gray.len > 0) {
+        kokos_gc_header_t* header = gc->gray.items[--gc->gray.len];
+        kokos_gc_mark_fields(gc, header);
     }
+}
 
-    while (iv->value.as_int != value.as_int) {
-        idx = (idx + 1) % objs->cap;
-        iv = &objs->values[idx];
+static uint64_t kokos_gc_clock_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-        if (!IS_OCCUPIED(*iv)) {
-            return NULL;
+// number of objects a slice of marking scans between two looks at the clock
+#define TRACE_CLOCK_INTERVAL 256
+
+bool kokos_gc_trace_slice(kokos_gc_t* gc)
+{
+    if (gc->max_pause_us == 0) {
+        kokos_gc_trace(gc);
+        return true;
+    }
+
+    uint64_t deadline = kokos_gc_clock_us() + gc->max_pause_us;
+    for (size_t scanned = 1; gc->gray.len > 0; scanned++) {
+        kokos_gc_header_t* header = gc->gray.items[--gc->gray.len];
+        kokos_gc_mark_fields(gc, header);
+
+        if (scanned % TRACE_CLOCK_INTERVAL == 0 && kokos_gc_clock_us() >= deadline) {
+            break;
         }
     }
 
-    return iv;
+    return gc->gray.len == 0;
 }
 
-kokos_gc_obj_t* kokos_gc_find(kokos_gc_t* gc, kokos_value_t value)
+// how much the old space may grow after a full collection, relative to what survived it. The more
+// of it survives, the more it grows, since marking it again soon would free little
+#define HEAP_MIN_GROWTH 1.5
+#define HEAP_MAX_GROWTH 3.0
+
+bool kokos_gc_should_mark(const kokos_gc_t* gc)
 {
-    return objs_find(&gc->objects, value);
+    size_t target = gc->heap_target;
+    if (target < gc->min_heap_size) {
+        target = gc->min_heap_size;
+    }
+
+    if (target > gc->max_heap_size) {
+        target = gc->max_heap_size;
+    }
+
+    if (target <= gc->live_size) {
+        target = gc->live_size + gc->min_heap_size;
+    }
+
+    return gc->heap_size >= target;
 }
 
-void kokos_gc_add_obj(kokos_gc_t* gc, kokos_value_t value)
+void kokos_gc_start_sweep(kokos_gc_t* gc)
 {
-    kokos_gc_obj_t m = { .value = value, .flags = OBJ_FLAG_OCCUPIED };
-    objs_add(&gc->objects, m);
+    for (size_t i = 0; i < GC_SIZE_CLASSES_COUNT; i++) {
+        kokos_gc_size_class_t* class = &gc->classes[i];
+        kokos_gc_page_t* lists[] = { class->available, class->full };
+        class->available = NULL;
+        class->full = NULL;
+
+        for (size_t l = 0; l < 2; l++) {
+            kokos_gc_page_t* page = lists[l];
+            while (page) {
+                kokos_gc_page_t* next = page->next;
+                PAGE_PUSH(class->unswept, page);
+                page = next;
+            }
+        }
+    }
+
+    // large objects are few and are freed one by one anyway, so they are swept right away
+    kokos_gc_header_t** link = &gc->large;
+    while (*link) {
+        kokos_gc_header_t* header = *link;
+
+        if (IS_MARKED(header)) {
+            header->flags &= ~OBJ_FLAG_MARKED;
+            link = &header->next;
+            continue;
+        }
+
+        *link = header->next;
+        kokos_gc_obj_free(header);
+    }
+
+    double survival = gc->heap_size > 0 ? (double)gc->marked_size / gc->heap_size : 1.0;
+    if (survival > 1.0) {
+        survival = 1.0;
+    }
+
+    double growth = HEAP_MIN_GROWTH + (HEAP_MAX_GROWTH - HEAP_MIN_GROWTH) * survival;
+
+    gc->live_size = gc->marked_size;
+    gc->heap_size = gc->marked_size;
+    gc->heap_target = gc->live_size * growth;
+    gc->marked_size = 0;
+    gc->marking = false;
+    gc->sweeping = true;
+}
+
+// number of pages a slice of sweeping sweeps between two looks at the clock
+#define SWEEP_CLOCK_INTERVAL 16
+
+bool kokos_gc_sweep_slice(kokos_gc_t* gc)
+{
+    if (!gc->sweeping) {
+        return true;
+    }
+
+    if (gc->max_pause_us == 0) {
+        kokos_gc_finish_sweep(gc);
+        return true;
+    }
+
+    uint64_t deadline = kokos_gc_clock_us() + gc->max_pause_us;
+    size_t swept = 0;
+    for (size_t i = 0; i < GC_SIZE_CLASSES_COUNT; i++) {
+        kokos_gc_size_class_t* class = &gc->classes[i];
+        while (class->unswept) {
+            kokos_gc_page_t* page = class->unswept;
+            class->unswept = page->next;
+            kokos_gc_class_sweep_page(class, page);
+
+            if (++swept % SWEEP_CLOCK_INTERVAL == 0 && kokos_gc_clock_us() >= deadline) {
+                return false;
+            }
+        }
+    }
+
+    gc->sweeping = false;
+    return true;
+}
+
+void kokos_gc_finish_sweep(kokos_gc_t* gc)
+{
+    if (!gc->sweeping) {
+        return;
+    }
+
+    for (size_t i = 0; i < GC_SIZE_CLASSES_COUNT; i++) {
+        kokos_gc_size_class_t* class = &gc->classes[i];
+        while (class->unswept) {
+            kokos_gc_page_t* page = class->unswept;
+            class->unswept = page->next;
+            kokos_gc_class_sweep_page(class, page);
+        }
+    }
+
+    gc->sweeping = false;
 }
@@ -9,68 +9,268 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-typedef struct marked_value {
-    kokos_value_t value;
-    uint8_t flags; // 0x02 - marked
-                   // 0x01 - occupied
-} kokos_gc_obj_t;
+/// Every object a heap tagged value can point to is preceded by this header, so the collector can
+/// get to an object's state straight from the value
+typedef struct kokos_gc_header {
+    // for old objects, the next object owned by the gc, used for sweeping;
+    // for evacuated young objects, the header of their copy in the old space
+    struct kokos_gc_header* next;
+    uint16_t tag;
+    uint8_t flags;
+    // the size of the payload following the header
+    uint32_t size;
+} kokos_gc_header_t;
 
-#define OBJ_FLAG_MARKED 0x02
-#define OBJ_FLAG_OCCUPIED 0x01
+#define OBJ_FLAG_MARKED 0x01
+// the object is not owned by the gc, e.g. interned strings and compiled procedures
+#define OBJ_FLAG_STATIC 0x02
+// the object lives in the nursery
+#define OBJ_FLAG_YOUNG 0x04
+// the object has been copied to the old space, `next` points to the copy
+#define OBJ_FLAG_FORWARDED 0x08
+// the object is in the remembered set
+#define OBJ_FLAG_REMEMBERED 0x10
+// the old object is too big for a page and was allocated on its own, its mark is `OBJ_FLAG_MARKED`
+#define OBJ_FLAG_LARGE 0x20
 
-#define IS_MARKED(v) ((v).flags & OBJ_FLAG_MARKED)
-#define IS_OCCUPIED(v) ((v).flags & OBJ_FLAG_OCCUPIED)
+#define IS_MARKED(h) ((h)->flags & OBJ_FLAG_MARKED)
+#define IS_STATIC(h) ((h)->flags & OBJ_FLAG_STATIC)
+#define IS_YOUNG(h) ((h)->flags & OBJ_FLAG_YOUNG)
+#define IS_FORWARDED(h) ((h)->flags & OBJ_FLAG_FORWARDED)
+#define IS_REMEMBERED(h) ((h)->flags & OBJ_FLAG_REMEMBERED)
+#define IS_LARGE(h) ((h)->flags & OBJ_FLAG_LARGE)
 
-typedef struct objs {
-    kokos_gc_obj_t* values;
-    size_t cap;
+/// Whether the collection `obj` stores its `elements` right after itself, like the small ones the
+/// vm allocates do. The elements are then copied and freed along with the object
+#define HAS_INLINE_ELEMENTS(obj, elements) ((const void*)(elements) == (const void*)((obj) + 1))
+
+static inline kokos_gc_header_t* kokos_gc_header(const void* obj)
+{
+    return (kokos_gc_header_t*)obj - 1;
+}
+
+static inline bool kokos_gc_is_heap_value(kokos_value_t value)
+{
+    if (IS_DOUBLE(value)) {
+        return false;
+    }
+
+    switch (VALUE_TAG(value)) {
+#define X(t) case t##_TAG:
+        ENUMERATE_HEAP_TYPES
+#undef X
+        return true;
+    default: return false;
+    }
+}
+
+typedef struct {
+    kokos_gc_header_t** items;
     size_t len;
-} kokos_gc_objs_t;
+    size_t cap;
+} kokos_gc_object_list_t;
+
+// the old space is made of pages of this many bytes. They are aligned to their size, so the page
+// of an object is found from its address
+#define GC_PAGE_SIZE (64 * 1024)
+// the smallest slot of a page, which bounds the number of slots a page has
+#define GC_MIN_SLOT_SIZE 32
+// old objects bigger than this, header included, are allocated on their own
+#define GC_MAX_SLOT_SIZE 2048
+#define GC_SIZE_CLASSES_COUNT 23
+#define GC_PAGE_BITMAP_WORDS (GC_PAGE_SIZE / GC_MIN_SLOT_SIZE / 64)
+
+/// A page of the old space, split in slots of the same size. The state of the slots is kept in
+/// bitmaps, so it is scanned a word at a time
+typedef struct kokos_gc_page {
+    struct kokos_gc_page* next;
+    uint32_t slot_size;
+    uint32_t slots_count;
+    // the word of `live` the search for a free slot starts at, the ones before it are full
+    uint32_t free_word;
+    // the slots holding an object, which includes the dead ones until the page is swept
+    uint64_t live[GC_PAGE_BITMAP_WORDS];
+    // the slots holding an object marked by the current full collection
+    uint64_t marks[GC_PAGE_BITMAP_WORDS];
+    // the slots holding an object that owns memory outside of its slot. Only those are released one
+    // by one when they die, the slots of the others are just reused
+    uint64_t owners[GC_PAGE_BITMAP_WORDS];
+    _Alignas(16) char slots[];
+} kokos_gc_page_t;
+
+/// The pages of the old space with slots of one size. After a full collection, a page is swept
+/// only once its size class needs room, or once there is time for it after a minor collection
+typedef struct {
+    uint32_t slot_size;
+    // the pages that were swept and have free slots, objects are allocated in the first one
+    kokos_gc_page_t* available;
+    // the pages that were swept and have no free slot
+    kokos_gc_page_t* full;
+    // the pages holding the unmarked objects of the last full collection
+    kokos_gc_page_t* unswept;
+} kokos_gc_size_class_t;
+
+static inline kokos_gc_page_t* kokos_gc_page_of(const kokos_gc_header_t* header)
+{
+    return (kokos_gc_page_t*)((uintptr_t)header & ~(uintptr_t)(GC_PAGE_SIZE - 1));
+}
+
+static inline size_t kokos_gc_slot_index(
+    const kokos_gc_page_t* page, const kokos_gc_header_t* header)
+{
+    return (size_t)((const char*)header - page->slots) / page->slot_size;
+}
+
+/// Whether the current full collection marked the object `header`. Young and static objects are
+/// never marked
+static inline bool kokos_gc_is_marked(const kokos_gc_header_t* header)
+{
+    if (header->flags & (OBJ_FLAG_YOUNG | OBJ_FLAG_STATIC | OBJ_FLAG_LARGE)) {
+        return IS_MARKED(header);
+    }
+
+    const kokos_gc_page_t* page = kokos_gc_page_of(header);
+    size_t slot = kokos_gc_slot_index(page, header);
+    return page->marks[slot / 64] >> (slot % 64) & 1;
+}
 
+/// New objects are bump allocated in the nursery. A minor collection copies the ones that are
+/// still reachable into the old space and resets the nursery, while the old space is collected
+/// with a full mark and sweep only once it grows enough, see `kokos_gc_should_mark`. The marking is
+/// incremental, it is done in slices of at most `max_pause_us` after the minor collections, and the
+/// sweeping is lazy
 typedef struct kokos_gc {
-    kokos_gc_objs_t objects;
-    size_t max_objs;
-} kokos_gc_t;
+    struct {
+        char* start;
+        char* top;
+        char* end;
+    } nursery;
 
-kokos_gc_t kokos_gc_new(size_t max_objs);
-void kokos_gc_add_obj(kokos_gc_t* gc, kokos_value_t value);
-kokos_gc_obj_t* kokos_gc_find(kokos_gc_t* gc, kokos_value_t value);
+    // the old space
+    kokos_gc_size_class_t classes[GC_SIZE_CLASSES_COUNT];
+    // the old objects too big for a page, linked by their `next`
+    kokos_gc_header_t* large;
+    // the bytes taken by the old objects, counting the memory they own, until the next full
+    // collection finds out which of them died
+    size_t heap_size;
+    // the bytes of the old objects the last full collection found alive
+    size_t live_size;
+    // the bytes of the objects the current full collection marked so far
+    size_t marked_size;
+    // the size the old space may grow to before the next full collection, which is kept between
+    // `min_heap_size` and `max_heap_size`
+    size_t heap_target;
+    size_t min_heap_size;
+    size_t max_heap_size;
+
+    // old objects that may reference young ones, see `kokos_gc_write_barrier`
+    kokos_gc_object_list_t remembered;
+    // objects promoted during the current minor collection whose fields are yet to be scanned
+    kokos_gc_object_list_t promoted;
+    // objects marked during the current full collection whose fields are yet to be marked
+    kokos_gc_object_list_t gray;
+    // whether a full collection is marking the old space. The objects promoted in the meantime are
+    // marked right away
+    bool marking;
+    // whether some pages still have to be swept after the last full collection
+    bool sweeping;
+    // the longest a slice of marking or sweeping may take, see `kokos_gc_trace_slice`
+    uint64_t max_pause_us;
+} kokos_gc_t;
 
+kokos_gc_t kokos_gc_new(size_t nursery_size, size_t min_heap_size, size_t max_heap_size);
 void kokos_gc_destroy(kokos_gc_t*);
 
-static void kokos_gc_obj_free(kokos_gc_obj_t* obj)
+/// Allocates an object of `size` bytes in the nursery, returning a pointer past its header,
+/// or NULL if the nursery is full and a minor collection has to be run first
+void* kokos_gc_alloc(kokos_gc_t* gc, uint16_t tag, size_t size);
+
+/// Allocates an object that the gc never frees, but that can still be referenced by values
+void* kokos_gc_alloc_static(uint16_t tag, size_t size);
+void kokos_gc_free_static(void* obj);
+
+/// Marks the old object `value` points to, if any. The objects it references are marked by
+/// `kokos_gc_trace`. Young objects are marked when they are promoted
+void kokos_gc_mark_value(kokos_gc_t* gc, kokos_value_t value);
+
+/// Must be called after storing `value` into the gc object `obj` that was not just allocated, so
+/// minor collections know about references from the old space into the nursery, and the marking
+/// about references from the objects it is done with
+static inline void kokos_gc_write_barrier(kokos_gc_t* gc, void* obj, kokos_value_t value)
 {
-    switch (VALUE_TAG(obj->value)) {
-    case STRING_TAG: {
-        kokos_runtime_string_t* str = GET_STRING(obj->value);
-        KOKOS_FREE(str->ptr);
-        break;
-    }
-    case LIST_TAG: {
-        kokos_runtime_list_t* list = GET_LIST(obj->value);
-        KOKOS_FREE(list->items);
-        break;
-    }
-    case VECTOR_TAG: {
-        kokos_runtime_vector_t* vec = GET_VECTOR(obj->value);
-        KOKOS_FREE(vec->items);
-        break;
-    }
-    case PROC_TAG: {
-        KOKOS_TODO();
+    kokos_gc_header_t* header = kokos_gc_header(obj);
+
+    // the fields of a marked object may have been marked already, so the marking would miss `value`
+    if (gc->marking && kokos_gc_is_marked(header)) {
+        kokos_gc_mark_value(gc, value);
     }
-    case MAP_TAG: {
-        ht_destroy(&GET_MAP(obj->value)->table);
-        break;
+
+    if (IS_YOUNG(header) || IS_REMEMBERED(header) || !kokos_gc_is_heap_value(value)) {
+        return;
     }
-    default: {
-        char buf[512];
-        sprintf(buf, "gc object value tag %ld", VALUE_TAG(obj->value));
-        KOKOS_TODO(buf);
+
+    if (!IS_YOUNG(kokos_gc_header(GET_PTR(value)))) {
+        return;
     }
+
+    header->flags |= OBJ_FLAG_REMEMBERED;
+    DA_ADD(&gc->remembered, header);
+}
+
+/// Checks, in debug builds, that storing `value` into the gc object `obj` can do without
+/// `kokos_gc_write_barrier`. The vm only stores into the objects it has just allocated, which are
+/// still young: the marking never looks at them, and a minor collection scans all of their fields
+/// when it promotes them. The check fails if an old object gains a reference to a young one, or if
+/// a marked one gains a reference to an unmarked one during the marking
+static inline void kokos_gc_check_store(kokos_gc_t* gc, const void* obj, kokos_value_t value)
+{
+#ifdef KOKOS_DEBUG_BUILD
+    const kokos_gc_header_t* header = kokos_gc_header(obj);
+    if (IS_YOUNG(header) || !kokos_gc_is_heap_value(value)) {
+        return;
     }
 
-    KOKOS_FREE((void*)GET_PTR(obj->value));
+    const kokos_gc_header_t* target = kokos_gc_header(GET_PTR(value));
+    KOKOS_ASSERT(IS_STATIC(target) || !IS_YOUNG(target));
+    KOKOS_ASSERT(!gc->marking || !kokos_gc_is_marked(header) || kokos_gc_is_marked(target));
+#else
+    (void)gc;
+    (void)obj;
+    (void)value;
+#endif
 }
 
+/// Copies the young object `*slot` points to, if any, into the old space and updates the slot
+void kokos_gc_evacuate(kokos_gc_t* gc, kokos_value_t* slot);
+
+/// Finishes a minor collection once every root has been evacuated: evacuates everything reachable
+/// from the remembered set and the promoted objects, then empties the nursery
+void kokos_gc_scavenge(kokos_gc_t* gc);
+
+/// Marks everything reachable from the objects marked so far. The objects left to scan are kept on
+/// an explicit stack, so arbitrarily deep nesting does not grow the C stack
+void kokos_gc_trace(kokos_gc_t* gc);
+
+/// Like `kokos_gc_trace`, but stops once it took `max_pause_us`. Returns whether everything
+/// reachable is marked
+bool kokos_gc_trace_slice(kokos_gc_t* gc);
+
+/// Whether the old space grew enough since the last full collection to start the next one. Once the
+/// live objects alone take more than `max_heap_size`, the old space is collected every time it grew
+/// by `min_heap_size`
+bool kokos_gc_should_mark(const kokos_gc_t* gc);
+
+/// Ends the marking and sets how much the old space may grow before the next one from the portion
+/// of it that survived. The large objects that were not marked are freed right away, the pages are
+/// swept later, see `kokos_gc_size_class_t`. The nursery must be empty
+void kokos_gc_start_sweep(kokos_gc_t* gc);
+
+/// Sweeps the pages left by the last full collection for at most `max_pause_us`. Returns whether
+/// every page is swept
+bool kokos_gc_sweep_slice(kokos_gc_t* gc);
+
+/// Sweeps every page left by the last full collection, which has to be done before the next
+/// marking starts
+void kokos_gc_finish_sweep(kokos_gc_t* gc);
+
 #endif // GC_H_
@@ -6,26 +6,11 @@
 const char* kokos_instruction_type_str(kokos_instruction_type_e type)
 {
     switch (type) {
-    case I_PUSH:       return "push";
-    case I_POP:        return "pop";
-    case I_ADD:        return "add";
-    case I_SUB:        return "sub";
-    case I_MUL:        return "mul";
-    case I_DIV:        return "div";
-    case I_GET_LOCAL:  return "get_local";
-    case I_ADD_LOCAL:  return "add_local";
-    case I_CALL:       return "call";
-    case I_JZ:         return "jz";
-    case I_JNZ:        return "jnz";
-    case I_BRANCH:     return "branch";
-    case I_CMP:        return "cmp";
-    case I_EQ:         return "eq";
-    case I_NEQ:        return "neq";
-    case I_RET:        return "ret";
-    case I_ALLOC:      return "alloc";
-    case I_PUSH_SCOPE: return "push_scope";
-    case I_POP_SCOPE:  return "pop_scope";
-    default:           {
+#define X(t, s)                                                                                    \
+    case I_##t: return #s;
+        ENUMERATE_INSTRUCTIONS
+#undef X
+    default: {
         char buf[512];
         sprintf(buf, "printing of instruction type %d", type);
         KOKOS_TODO(buf);
@@ -42,12 +27,31 @@ void kokos_instruction_dump(kokos_instruction_t instruction)
     switch (instruction.type) {
     case I_CMP:
     case I_RET:
-    case I_POP_SCOPE:
-    case I_POP:       break;
+    case I_POP:
+    case I_LT_INT:
+    case I_GT_INT:
+    case I_LTE_INT:
+    case I_GTE_INT:
+    case I_EQ_INT:
+    case I_NEQ_INT: break;
 
     case I_CALL:
-    case I_GET_LOCAL:
-    case I_ADD_LOCAL: {
+    case I_CALL0:
+    case I_CALL1:
+    case I_CALL2:
+    case I_CALL3:
+    case I_TAIL_CALL: {
+        const kokos_runtime_string_t* name = GET_STRING_INT(instruction.operand);
+        if (name) {
+            printf(" " RT_STRING_FMT, RT_STRING_ARG(*name));
+        }
+        printf(" %lu", instruction.operand >> 48);
+        break;
+    }
+
+    case I_GET_GLOBAL:
+    case I_ADD_GLOBAL:
+    case I_IS_CALLEE: {
         printf(" " RT_STRING_FMT, RT_STRING_ARG(*GET_STRING_INT(instruction.operand)));
         break;
     }
@@ -83,11 +87,23 @@ void kokos_instruction_dump(kokos_instruction_t instruction)
     case I_MUL:
     case I_DIV:
     case I_SUB:
-    case I_PUSH_SCOPE: printf(" %lu", instruction.operand); break;
+    case I_ADD_INT:
+    case I_SUB_INT:
+    case I_MUL_INT:
+    case I_LOAD_SLOT:
+    case I_LOAD_REST:
+    case I_STORE_SLOT:
+    case I_PUSH_CONST: printf(" %lu", instruction.operand); break;
 
     case I_BRANCH:
     case I_JZ:
-    case I_JNZ:        printf(" %lu", *(size_t*)instruction.operand); break;
+    case I_JNZ:
+    case I_JLT:
+    case I_JGT:
+    case I_JLE:
+    case I_JGE:
+    case I_JEQ:
+    case I_JNE:        printf(" %lu", *(size_t*)instruction.operand); break;
     default:           {
         char buf[512];
         sprintf(buf, "printing of instruction type %d", instruction.type);
@@ -118,3 +134,246 @@ void kokos_code_dump(kokos_code_t code)
         printf("\n");
     }
 }
+
+bool kokos_instruction_is_jump(kokos_instruction_type_e type)
+{
+    switch (type) {
+    case I_BRANCH:
+    case I_JZ:
+    case I_JNZ:
+#define X(t, s) case I_##t:
+        ENUMERATE_COMPARE_JUMPS
+#undef X
+        return true;
+    default: return false;
+    }
+}
+
+bool kokos_instruction_is_call(kokos_instruction_type_e type)
+{
+    switch (type) {
+    case I_CALL:
+#define X(t, s) case I_##t:
+        ENUMERATE_ARITY_CALLS
+#undef X
+        return true;
+    default: return false;
+    }
+}
+
+kokos_instruction_type_e kokos_instruction_call_type(size_t nargs)
+{
+    return nargs <= 3 ? I_CALL0 + nargs : I_CALL;
+}
+
+kokos_instruction_t kokos_instruction_generic(kokos_instruction_t instr)
+{
+    switch (instr.type) {
+    case I_ADD_INT: instr.type = I_ADD; break;
+    case I_SUB_INT: instr.type = I_SUB; break;
+    case I_MUL_INT: instr.type = I_MUL; break;
+    case I_LT_INT:
+    case I_GT_INT:
+    case I_LTE_INT:
+    case I_GTE_INT:
+    case I_EQ_INT:
+    case I_NEQ_INT: instr.type = I_CMP; break;
+    default:        break;
+    }
+
+    instr.cache = 0;
+    return instr;
+}
+
+kokos_instruction_type_e kokos_instruction_quicken_cmp(kokos_instruction_t next)
+{
+    // these are the sequences the comparison special forms compile to
+    if (next.type == I_EQ) {
+        switch ((int64_t)next.operand) {
+        case -1: return I_LT_INT;
+        case 1:  return I_GT_INT;
+        case 0:  return I_EQ_INT;
+        }
+    } else if (next.type == I_NEQ) {
+        switch ((int64_t)next.operand) {
+        case 1:  return I_LTE_INT;
+        case -1: return I_GTE_INT;
+        case 0:  return I_NEQ_INT;
+        }
+    }
+
+    return I_CMP;
+}
+
+bool kokos_instruction_stack_effect(kokos_instruction_t instr, size_t* pops, size_t* pushes)
+{
+    *pops = 0;
+    *pushes = 0;
+
+    // a quickened instruction is only ever a faster way to run the generic one, and the instruction
+    // a quickened comparison skips is still there
+    instr = kokos_instruction_generic(instr);
+
+    switch (instr.type) {
+    case I_PUSH:
+    case I_PUSH_CONST:
+    case I_LOAD_SLOT:
+    case I_LOAD_REST:
+    case I_GET_GLOBAL: *pushes = 1; return true;
+    case I_POP:
+    case I_STORE_SLOT:
+    case I_ADD_GLOBAL:
+    case I_JZ:
+    case I_JNZ:        *pops = 1; return true;
+    case I_JLT:
+    case I_JGT:
+    case I_JLE:
+    case I_JGE:
+    case I_JEQ:
+    case I_JNE:        *pops = 2; return true;
+    case I_BRANCH:
+    case I_RET:        return true;
+    case I_SUB:
+        // the interpreter does not handle a subtraction without arguments either
+        if (instr.operand == 0) {
+            return false;
+        }
+        // fallthrough
+    case I_ADD:
+    case I_MUL:
+    case I_DIV:
+        *pops = instr.operand;
+        *pushes = 1;
+        return true;
+    case I_CMP:
+        *pops = 2;
+        *pushes = 1;
+        return true;
+    case I_EQ:
+    case I_NEQ:
+    case I_IS_CALLEE:
+        *pops = 1;
+        *pushes = 1;
+        return true;
+    case I_CALL:
+    case I_CALL0:
+    case I_CALL1:
+    case I_CALL2:
+    case I_CALL3:
+    case I_TAIL_CALL:
+        // the callee is on the stack too if it is not called by name
+        *pops = (instr.operand >> 48) + (GET_PTR_INT(instr.operand) == 0);
+        *pushes = 1;
+        return true;
+    case I_ALLOC: {
+        size_t count = instr.operand & INSTR_ALLOC_ARG_MASK;
+        switch (GET_TAG(instr.operand)) {
+        case VECTOR_TAG:
+        case LIST_TAG:   *pops = count; break;
+        case MAP_TAG:    *pops = count * 2; break;
+        case PROC_TAG:   *pops = count + 1; break;
+        default:         return false;
+        }
+
+        *pushes = 1;
+        return true;
+    }
+    default: return false;
+    }
+}
+
+bool kokos_code_stack_depths(const kokos_code_t* code, size_t* depths)
+{
+    for (size_t i = 0; i < code->len; i++) {
+        depths[i] = SIZE_MAX;
+    }
+
+    // every instruction is added at most once, when its depth is first set
+    size_t* worklist = KOKOS_CALLOC(code->len, sizeof(size_t));
+    size_t worklist_len = 0;
+
+    depths[0] = 0;
+    worklist[worklist_len++] = 0;
+
+    bool ok = true;
+    while (ok && worklist_len != 0) {
+        size_t i = worklist[--worklist_len];
+        kokos_instruction_t instr = code->items[i];
+
+        size_t pops, pushes;
+        if (!kokos_instruction_stack_effect(instr, &pops, &pushes) || depths[i] < pops) {
+            ok = false;
+            break;
+        }
+
+        size_t depth = depths[i] - pops + pushes;
+
+        size_t successors[2];
+        size_t successors_count = 0;
+
+        switch (instr.type) {
+        case I_RET:    break;
+        case I_BRANCH: successors[successors_count++] = *(size_t*)instr.operand; break;
+        case I_JZ:
+        case I_JNZ:
+        case I_JLT:
+        case I_JGT:
+        case I_JLE:
+        case I_JGE:
+        case I_JEQ:
+        case I_JNE:
+            successors[successors_count++] = *(size_t*)instr.operand;
+            successors[successors_count++] = i + 1;
+            break;
+        default: successors[successors_count++] = i + 1; break;
+        }
+
+        for (size_t j = 0; j < successors_count; j++) {
+            size_t next = successors[j];
+            if (next >= code->len) {
+                ok = false;
+                break;
+            }
+
+            if (depths[next] == SIZE_MAX) {
+                depths[next] = depth;
+                worklist[worklist_len++] = next;
+            } else if (depths[next] != depth) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    KOKOS_FREE(worklist);
+    return ok;
+}
+
+size_t kokos_code_max_depth(const kokos_code_t* code)
+{
+    size_t* depths = KOKOS_CALLOC(code->len + 1, sizeof(size_t));
+
+    // every instruction leaves at most one more value than it found, so the code can't go deeper
+    // than its length without looping, which the compiler never makes push
+    size_t max_depth = code->len;
+    if (code->len != 0 && kokos_code_stack_depths(code, depths)) {
+        max_depth = 0;
+        for (size_t i = 0; i < code->len; i++) {
+            size_t pops, pushes;
+            if (depths[i] == SIZE_MAX) {
+                continue;
+            }
+
+            // instructions pop before they push, and the depth before one is the depth after
+            // another
+            kokos_instruction_stack_effect(code->items[i], &pops, &pushes);
+            size_t after = depths[i] - pops + pushes;
+            if (after > max_depth) {
+                max_depth = after;
+            }
+        }
+    }
+
+    KOKOS_FREE(depths);
+    return max_depth;
+}
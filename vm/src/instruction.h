@@ -4,45 +4,103 @@
 #include "base.h"
 #include <stdint.h>
 
+#define ENUMERATE_INSTRUCTIONS                                                                     \
+    X(PUSH, push)                                                                                  \
+    X(POP, pop)                                                                                    \
+    X(ADD, add)                                                                                    \
+    X(SUB, sub)                                                                                    \
+    X(MUL, mul)                                                                                    \
+    X(DIV, div)                                                                                    \
+    X(GET_GLOBAL, get_global)                                                                      \
+    X(ADD_GLOBAL, add_global)                                                                      \
+    X(CALL, call)                                                                                  \
+    X(JNZ, jnz)                                                                                    \
+    X(JZ, jz)                                                                                      \
+    X(BRANCH, branch)                                                                              \
+    X(CMP, cmp)                                                                                    \
+    X(EQ, eq)                                                                                      \
+    X(NEQ, neq)                                                                                    \
+    X(RET, ret)                                                                                    \
+    X(ALLOC, alloc)                                                                                \
+    X(LOAD_SLOT, load_slot)                                                                        \
+    X(STORE_SLOT, store_slot)                                                                      \
+    X(TAIL_CALL, tail_call)                                                                        \
+    X(PUSH_CONST, push_const)                                                                      \
+    X(IS_CALLEE, is_callee)                                                                        \
+    X(LOAD_REST, load_rest)                                                                        \
+    ENUMERATE_ARITY_CALLS                                                                          \
+    ENUMERATE_COMPARE_JUMPS                                                                        \
+    ENUMERATE_QUICKENED_INSTRUCTIONS
+
+// An `I_CALL` of 0 to 3 arguments is one of these instead, in this order, so the vm checks the
+// arity of the callee against a constant. The operand is the same as the one of `I_CALL`
+#define ENUMERATE_ARITY_CALLS                                                                      \
+    X(CALL0, call0)                                                                                \
+    X(CALL1, call1)                                                                                \
+    X(CALL2, call2)                                                                                \
+    X(CALL3, call3)
+
+// A comparison that is only used by a conditional jump is fused into one of these, see
+// `fuse_compare_jumps`. They pop the rhs and the lhs and jump to their label if comparing them like
+// `I_CMP` gives a result that is less than, greater than, ... zero
+#define ENUMERATE_COMPARE_JUMPS                                                                    \
+    X(JLT, jlt)                                                                                    \
+    X(JGT, jgt)                                                                                    \
+    X(JLE, jle)                                                                                    \
+    X(JGE, jge)                                                                                    \
+    X(JEQ, jeq)                                                                                    \
+    X(JNE, jne)
+
+// The vm rewrites an instruction in place to one of these once it sees it run on integers, and
+// back to the generic form as soon as it sees anything else. The comparisons replace an `I_CMP` and
+// skip the `I_EQ`/`I_NEQ` after it, which stays in place for when they fall back
+#define ENUMERATE_QUICKENED_INSTRUCTIONS                                                           \
+    X(ADD_INT, add_int)                                                                            \
+    X(SUB_INT, sub_int)                                                                            \
+    X(MUL_INT, mul_int)                                                                            \
+    X(LT_INT, lt_int)                                                                              \
+    X(GT_INT, gt_int)                                                                              \
+    X(LTE_INT, lte_int)                                                                            \
+    X(GTE_INT, gte_int)                                                                            \
+    X(EQ_INT, eq_int)                                                                              \
+    X(NEQ_INT, neq_int)
+
 typedef enum {
-    I_PUSH = 0,
-    I_POP = 1,
-    I_ADD = 2,
-    I_SUB = 3,
-    I_MUL = 4,
-    I_DIV = 5,
-    I_GET_LOCAL = 6,
-    I_ADD_LOCAL = 7,
-    I_CALL = 8,
-    I_JNZ = 9,
-    I_JZ = 10,
-    I_BRANCH = 11,
-    I_CMP = 12,
-    I_EQ = 13,
-    I_NEQ = 14,
-    I_RET = 15,
-    I_ALLOC = 16,
-    I_PUSH_SCOPE = 17,
-    I_POP_SCOPE = 18,
+#define X(t, s) I_##t,
+    ENUMERATE_INSTRUCTIONS
+#undef X
 } kokos_instruction_type_e;
 
 typedef struct {
     kokos_instruction_type_e type;
+    // the inline cache of a call by name or of an `I_IS_CALLEE`, which the vm assigns when the
+    // instruction first runs. It fits in the padding after the type
+    uint32_t cache;
     uint64_t operand;
 } kokos_instruction_t;
 
 #define INSTR_PUSH(op) ((kokos_instruction_t) { .type = I_PUSH, .operand = (op).as_int })
+// pushes the value at index `idx` of the module's constant pool
+#define INSTR_PUSH_CONST(idx) ((kokos_instruction_t) { .type = I_PUSH_CONST, .operand = (idx) })
 #define INSTR_POP(op) ((kokos_instruction_t) { .type = I_POP, .operand = (op) })
 #define INSTR_ADD(op) ((kokos_instruction_t) { .type = I_ADD, .operand = (op) })
 #define INSTR_MUL(op) ((kokos_instruction_t) { .type = I_MUL, .operand = (op) })
 #define INSTR_DIV(op) ((kokos_instruction_t) { .type = I_DIV, .operand = (op) })
 #define INSTR_SUB(op) ((kokos_instruction_t) { .type = I_SUB, .operand = (op) })
-#define INSTR_GET_LOCAL(name)                                                                      \
-    ((kokos_instruction_t) { .type = I_GET_LOCAL, .operand = (uintptr_t)(name) })
-#define INSTR_ADD_LOCAL(name)                                                                      \
-    ((kokos_instruction_t) { .type = I_ADD_LOCAL, .operand = (uintptr_t)(name) })
+#define INSTR_GET_GLOBAL(name)                                                                     \
+    ((kokos_instruction_t) { .type = I_GET_GLOBAL, .operand = (uintptr_t)(name) })
+#define INSTR_ADD_GLOBAL(name)                                                                     \
+    ((kokos_instruction_t) { .type = I_ADD_GLOBAL, .operand = (uintptr_t)(name) })
+#define INSTR_LOAD_SLOT(slot) ((kokos_instruction_t) { .type = I_LOAD_SLOT, .operand = (slot) })
+#define INSTR_STORE_SLOT(slot) ((kokos_instruction_t) { .type = I_STORE_SLOT, .operand = (slot) })
+// loads the rest parameter in `slot`, which only becomes a vector the first time it is loaded
+#define INSTR_LOAD_REST(slot) ((kokos_instruction_t) { .type = I_LOAD_REST, .operand = (slot) })
+// if `name` is NULL, the callee is popped from the top of the stack instead of looked up
 #define INSTR_CALL(name, nargs)                                                                    \
-    ((kokos_instruction_t) { .type = I_CALL, .operand = (nargs) << 48 | (uintptr_t)name })
+    ((kokos_instruction_t) { .type = kokos_instruction_call_type(nargs),                           \
+        .operand = (nargs) << 48 | (uintptr_t)name })
+#define INSTR_TAIL_CALL(name, nargs)                                                               \
+    ((kokos_instruction_t) { .type = I_TAIL_CALL, .operand = (nargs) << 48 | (uintptr_t)name })
 #define INSTR_JZ(op) ((kokos_instruction_t) { .type = I_JZ, .operand = (size_t)(op) })
 #define INSTR_JNZ(op) ((kokos_instruction_t) { .type = I_JNZ, .operand = (size_t)(op) })
 #define INSTR_BRANCH(op) ((kokos_instruction_t) { .type = I_BRANCH, .operand = (size_t)(op) })
@@ -52,11 +110,12 @@ typedef struct {
 #define INSTR_SFORM(op) ((kokos_instruction_t) { .type = I_SFORM, .operand = (op) })
 
 #define INSTR_CMP ((kokos_instruction_t) { .type = I_CMP })
+// pops a procedure and pushes whether a call of the global `name` would call it, which never
+// throws. It keeps an inline cache like the calls by name
+#define INSTR_IS_CALLEE(name)                                                                      \
+    ((kokos_instruction_t) { .type = I_IS_CALLEE, .operand = (uintptr_t)(name) })
 #define INSTR_RET ((kokos_instruction_t) { .type = I_RET })
 
-#define INSTR_PUSH_SCOPE(count) ((kokos_instruction_t) { .type = I_PUSH_SCOPE, .operand = (count) })
-#define INSTR_POP_SCOPE ((kokos_instruction_t) { .type = I_POP_SCOPE })
-
 #define INSTR_ALLOC(t, count) ((kokos_instruction_t) { .type = I_ALLOC, .operand = (t) | (count) })
 
 #define INSTR_ALLOC_ARG_MASK 0xFFFFFFFF
@@ -72,4 +131,32 @@ const char* kokos_instruction_type_str(kokos_instruction_type_e type);
 
 void kokos_code_dump(kokos_code_t code);
 
+/// Whether `type` jumps, in which case its operand points to the index of the instruction it jumps
+/// to
+bool kokos_instruction_is_jump(kokos_instruction_type_e type);
+
+/// Whether `type` is an `I_CALL` or one of the `I_CALL<n>`, which are not tail calls
+bool kokos_instruction_is_call(kokos_instruction_type_e type);
+
+/// Gets the type of a call that is not a tail call with `nargs` arguments
+kokos_instruction_type_e kokos_instruction_call_type(size_t nargs);
+
+/// Gets the generic form of a quickened instruction, anything else is returned as is
+kokos_instruction_t kokos_instruction_generic(kokos_instruction_t instr);
+
+/// Gets the quickened comparison for an `I_CMP` followed by `next`, or `I_CMP` if there is none
+kokos_instruction_type_e kokos_instruction_quicken_cmp(kokos_instruction_t next);
+
+/// Gets the number of values `instr` pops from and pushes to the stack, returns false if that
+/// depends on something only known at runtime
+bool kokos_instruction_stack_effect(kokos_instruction_t instr, size_t* pops, size_t* pushes);
+
+/// Computes the depth of the operand stack before every reachable instruction, with SIZE_MAX for
+/// unreachable ones. Fails if the depth differs between the paths to an instruction or the stack
+/// could underflow
+bool kokos_code_stack_depths(const kokos_code_t* code, size_t* depths);
+
+/// Gets the most values `code` has on the operand stack at once
+size_t kokos_code_max_depth(const kokos_code_t* code);
+
 #endif // INSTRUCTION_H_
@@ -0,0 +1,721 @@
+#include "jit.h"
+#include "base.h"
+#include "instruction.h"
+#include "macros.h"
+#include "runtime.h"
+#include "value.h"
+#include "vm.h"
+#include "vmconstants.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef KOKOS_JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// This is a template jit: every instruction is translated on its own into a fixed sequence of
+// machine code, with inline fast paths for integers and calls back into the vm for everything else.
+//
+// The depth of the operand stack before every instruction is known when compiling, so there is no
+// stack pointer at runtime. The operands are addressed straight off the frame's slots, which they
+// follow on the value stack, and `vm->stack.sp` is only written before calling into the vm, which
+// is the only place the gc can run.
+//
+// Compiled code keeps the vm in rbx, the offset of the frame's slots into the value stack in r12,
+// the slots themselves in r13 and INT_BITS in r15. These are callee saved, so they survive the
+// calls into the vm. The calls can move the value stack, so r13 is computed again after them.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define VM_REG RBX
+#define BASE_REG R12
+#define LOCALS_REG R13
+#define INT_BITS_REG R15
+
+// condition codes, the low nibble of the jcc, setcc and cmovcc opcodes
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+
+// opcodes of the `op r/m, r` forms
+#define OP_ADD 0x01
+#define OP_OR 0x09
+#define OP_SUB 0x29
+#define OP_XOR 0x31
+#define OP_CMP 0x39
+#define OP_MOV 0x89
+
+#define LOCAL_SLOT(i) ((int32_t)((i) * sizeof(kokos_value_t)))
+#define STACK_SLOT(ctx, i) LOCAL_SLOT((ctx)->locals_count + (i))
+
+// instruction indices past the end of the code, used as jump targets for the shared exits
+#define TARGET_THROW(ctx) ((ctx)->code_len)
+#define TARGET_EXIT(ctx) ((ctx)->code_len + 1)
+
+typedef struct {
+    uint8_t* items;
+    size_t len;
+    size_t cap;
+} kokos_jit_buffer_t;
+
+// a rel32 operand at `at` that has to point to the machine code of the instruction `target`
+typedef struct {
+    size_t at;
+    size_t target;
+} kokos_jit_fixup_t;
+
+typedef struct {
+    kokos_jit_fixup_t* items;
+    size_t len;
+    size_t cap;
+} kokos_jit_fixup_list_t;
+
+typedef struct {
+    kokos_jit_buffer_t buf;
+    kokos_jit_fixup_list_t fixups;
+    // offset of the machine code of every instruction, followed by the two exits
+    size_t* offsets;
+    size_t code_len;
+    // the operands come right after the slots
+    size_t locals_count;
+} kokos_jit_ctx_t;
+
+static void emit8(kokos_jit_ctx_t* ctx, uint8_t byte)
+{
+    DA_ADD(&ctx->buf, byte);
+}
+
+static void emit32(kokos_jit_ctx_t* ctx, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++) {
+        emit8(ctx, value >> (i * 8));
+    }
+}
+
+static void emit64(kokos_jit_ctx_t* ctx, uint64_t value)
+{
+    for (size_t i = 0; i < 8; i++) {
+        emit8(ctx, value >> (i * 8));
+    }
+}
+
+static void emit_rex(kokos_jit_ctx_t* ctx, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3;
+    if (rex != 0x40) {
+        emit8(ctx, rex);
+    }
+}
+
+static void emit_modrm_reg(kokos_jit_ctx_t* ctx, int reg, int rm)
+{
+    emit8(ctx, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// always uses a 32 bit displacement, which also sidesteps the special encodings of rbp and r13
+static void emit_modrm_mem(kokos_jit_ctx_t* ctx, int reg, int base, int32_t disp)
+{
+    emit8(ctx, 0x80 | (reg & 7) << 3 | (base & 7));
+    // rsp and r12 as a base need a sib byte
+    if ((base & 7) == RSP) {
+        emit8(ctx, 0x24);
+    }
+
+    emit32(ctx, disp);
+}
+
+// mov dst, [base + disp]
+static void emit_load(kokos_jit_ctx_t* ctx, int dst, int base, int32_t disp)
+{
+    emit_rex(ctx, true, dst, base);
+    emit8(ctx, 0x8B);
+    emit_modrm_mem(ctx, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emit_store(kokos_jit_ctx_t* ctx, int base, int32_t disp, int src)
+{
+    emit_rex(ctx, true, src, base);
+    emit8(ctx, 0x89);
+    emit_modrm_mem(ctx, src, base, disp);
+}
+
+// lea dst, [base + disp]
+static void emit_lea(kokos_jit_ctx_t* ctx, int dst, int base, int32_t disp)
+{
+    emit_rex(ctx, true, dst, base);
+    emit8(ctx, 0x8D);
+    emit_modrm_mem(ctx, dst, base, disp);
+}
+
+// mov dst, imm64
+static void emit_mov_imm(kokos_jit_ctx_t* ctx, int dst, uint64_t imm)
+{
+    emit_rex(ctx, true, 0, dst);
+    emit8(ctx, 0xB8 + (dst & 7));
+    emit64(ctx, imm);
+}
+
+// mov dst32, imm32
+static void emit_mov_imm32(kokos_jit_ctx_t* ctx, int dst, uint32_t imm)
+{
+    emit_rex(ctx, false, 0, dst);
+    emit8(ctx, 0xB8 + (dst & 7));
+    emit32(ctx, imm);
+}
+
+// `op dst, src` for one of the OP_* opcodes, on 64 bit registers if `wide`
+static void emit_op(kokos_jit_ctx_t* ctx, uint8_t opcode, bool wide, int dst, int src)
+{
+    emit_rex(ctx, wide, src, dst);
+    emit8(ctx, opcode);
+    emit_modrm_reg(ctx, src, dst);
+}
+
+// imul dst32, src32
+static void emit_imul32(kokos_jit_ctx_t* ctx, int dst, int src)
+{
+    emit_rex(ctx, false, dst, src);
+    emit8(ctx, 0x0F);
+    emit8(ctx, 0xAF);
+    emit_modrm_reg(ctx, dst, src);
+}
+
+// shl reg, imm
+static void emit_shl(kokos_jit_ctx_t* ctx, int reg, uint8_t imm)
+{
+    emit_rex(ctx, true, 0, reg);
+    emit8(ctx, 0xC1);
+    emit_modrm_reg(ctx, 4, reg);
+    emit8(ctx, imm);
+}
+
+// shr reg, imm
+static void emit_shr(kokos_jit_ctx_t* ctx, int reg, uint8_t imm)
+{
+    emit_rex(ctx, true, 0, reg);
+    emit8(ctx, 0xC1);
+    emit_modrm_reg(ctx, 5, reg);
+    emit8(ctx, imm);
+}
+
+// cmp reg32, imm
+static void emit_cmp_imm32(kokos_jit_ctx_t* ctx, int reg, uint32_t imm)
+{
+    emit_rex(ctx, false, 0, reg);
+    emit8(ctx, 0x81);
+    emit_modrm_reg(ctx, 7, reg);
+    emit32(ctx, imm);
+}
+
+// setcc reg8, only for the registers that don't need a rex prefix for their low byte
+static void emit_setcc(kokos_jit_ctx_t* ctx, uint8_t cc, int reg)
+{
+    KOKOS_ASSERT(reg < RSP);
+    emit8(ctx, 0x0F);
+    emit8(ctx, 0x90 | cc);
+    emit_modrm_reg(ctx, 0, reg);
+}
+
+// cmovcc dst, src
+static void emit_cmovcc(kokos_jit_ctx_t* ctx, uint8_t cc, int dst, int src)
+{
+    emit_rex(ctx, true, dst, src);
+    emit8(ctx, 0x0F);
+    emit8(ctx, 0x40 | cc);
+    emit_modrm_reg(ctx, dst, src);
+}
+
+static void emit_push(kokos_jit_ctx_t* ctx, int reg)
+{
+    emit_rex(ctx, false, 0, reg);
+    emit8(ctx, 0x50 + (reg & 7));
+}
+
+static void emit_pop(kokos_jit_ctx_t* ctx, int reg)
+{
+    emit_rex(ctx, false, 0, reg);
+    emit8(ctx, 0x58 + (reg & 7));
+}
+
+/// Emits a conditional jump with an empty rel32 and returns its position, for `emit_patch_here`
+static size_t emit_jcc_forward(kokos_jit_ctx_t* ctx, uint8_t cc)
+{
+    emit8(ctx, 0x0F);
+    emit8(ctx, 0x80 | cc);
+    size_t at = ctx->buf.len;
+    emit32(ctx, 0);
+    return at;
+}
+
+static size_t emit_jmp_forward(kokos_jit_ctx_t* ctx)
+{
+    emit8(ctx, 0xE9);
+    size_t at = ctx->buf.len;
+    emit32(ctx, 0);
+    return at;
+}
+
+/// Makes the jump whose rel32 is at `at` jump to the code emitted next
+static void emit_patch_here(kokos_jit_ctx_t* ctx, size_t at)
+{
+    int32_t rel = (int32_t)(ctx->buf.len - (at + 4));
+    memcpy(ctx->buf.items + at, &rel, sizeof(rel));
+}
+
+static void emit_jcc_to(kokos_jit_ctx_t* ctx, uint8_t cc, size_t target)
+{
+    size_t at = emit_jcc_forward(ctx, cc);
+    DA_ADD(&ctx->fixups, ((kokos_jit_fixup_t) { .at = at, .target = target }));
+}
+
+static void emit_jmp_to(kokos_jit_ctx_t* ctx, size_t target)
+{
+    size_t at = emit_jmp_forward(ctx);
+    DA_ADD(&ctx->fixups, ((kokos_jit_fixup_t) { .at = at, .target = target }));
+}
+
+/// Stores the stack pointer for the statically known stack depth, so the vm sees the stack as it is
+static void emit_sync_stack(kokos_jit_ctx_t* ctx, size_t depth)
+{
+    emit_lea(ctx, RAX, BASE_REG, STACK_SLOT(ctx, depth));
+    emit_shr(ctx, RAX, 3);
+    emit_store(ctx, VM_REG, offsetof(kokos_vm_t, stack.sp), RAX);
+}
+
+/// Points r13 at the frame's slots, wherever the value stack is now
+static void emit_load_locals(kokos_jit_ctx_t* ctx)
+{
+    emit_load(ctx, LOCALS_REG, VM_REG, offsetof(kokos_vm_t, stack.data));
+    emit_op(ctx, OP_ADD, true, LOCALS_REG, BASE_REG);
+}
+
+/// Calls a vm function with the vm as its first argument, the others have to already be in rsi and
+/// rdx
+static void emit_call_vm(kokos_jit_ctx_t* ctx, uintptr_t fn)
+{
+    emit_op(ctx, OP_MOV, true, RDI, VM_REG);
+    emit_mov_imm(ctx, RAX, fn);
+    // call rax
+    emit8(ctx, 0xFF);
+    emit_modrm_reg(ctx, 2, RAX);
+}
+
+/// Jumps to the throw exit if the vm function that was just called returned false
+static void emit_check_call(kokos_jit_ctx_t* ctx)
+{
+    // test al, al
+    emit8(ctx, 0x84);
+    emit_modrm_reg(ctx, RAX, RAX);
+    emit_jcc_to(ctx, CC_E, TARGET_THROW(ctx));
+}
+
+/// Executes `instr` by calling back into the vm
+static void emit_step(kokos_jit_ctx_t* ctx, kokos_instruction_t instr, size_t depth)
+{
+    emit_sync_stack(ctx, depth);
+    emit_mov_imm32(ctx, RSI, instr.type);
+    emit_mov_imm(ctx, RDX, instr.operand);
+    emit_call_vm(ctx, (uintptr_t)kokos_vm_jit_step);
+    emit_check_call(ctx);
+}
+
+/// Jumps to `slow` unless `reg` holds an integer, clobbers rcx
+static void emit_check_int(kokos_jit_ctx_t* ctx, int reg, size_t* slow, size_t* slow_count)
+{
+    emit_op(ctx, OP_MOV, true, RCX, reg);
+    emit_shr(ctx, RCX, 48);
+    emit_cmp_imm32(ctx, RCX, INT_TAG);
+    slow[(*slow_count)++] = emit_jcc_forward(ctx, CC_NE);
+}
+
+/// Binary ADD, SUB, MUL and CMP on two integers are done inline, the rest in the vm. Loads the
+/// operands into rax and rdx, and the fast path in `fast` writes its result to rax
+#define EMIT_INT_BINOP(ctx, instr, depth, fast)                                                    \
+    do {                                                                                           \
+        size_t slow[2];                                                                            \
+        size_t slow_count = 0;                                                                     \
+        emit_load((ctx), RAX, LOCALS_REG, STACK_SLOT((ctx), (depth) - 2));                         \
+        emit_load((ctx), RDX, LOCALS_REG, STACK_SLOT((ctx), (depth) - 1));                         \
+        emit_check_int((ctx), RAX, slow, &slow_count);                                             \
+        emit_check_int((ctx), RDX, slow, &slow_count);                                             \
+        fast;                                                                                      \
+        emit_store((ctx), LOCALS_REG, STACK_SLOT((ctx), (depth) - 2), RAX);                        \
+        size_t done = emit_jmp_forward((ctx));                                                     \
+        for (size_t i = 0; i < slow_count; i++) {                                                  \
+            emit_patch_here((ctx), slow[i]);                                                       \
+        }                                                                                          \
+        emit_step((ctx), (instr), (depth));                                                        \
+        emit_patch_here((ctx), done);                                                              \
+    } while (0)
+
+// the same as TO_INT in the interpreter, a 32 bit mov zero extends the result before it is tagged
+#define EMIT_TAG_INT(ctx)                                                                          \
+    do {                                                                                           \
+        emit_op((ctx), OP_MOV, false, RAX, RAX);                                                   \
+        emit_op((ctx), OP_OR, true, RAX, INT_BITS_REG);                                            \
+    } while (0)
+
+/// Gets the condition a fused compare-and-jump jumps on, after a signed compare of lhs with rhs or
+/// of the result of `I_CMP` with 0
+static uint8_t compare_jump_cc(kokos_instruction_type_e type)
+{
+    switch (type) {
+    case I_JLT: return CC_L;
+    case I_JGT: return CC_G;
+    case I_JLE: return CC_LE;
+    case I_JGE: return CC_GE;
+    case I_JEQ: return CC_E;
+    case I_JNE: return CC_NE;
+    default:    KOKOS_TODO("condition of a jump that does not compare");
+    }
+}
+
+static bool emit_instruction(
+    kokos_jit_ctx_t* ctx, const kokos_proc_t* proc, kokos_instruction_t* at, size_t depth)
+{
+    // the machine code has integer fast paths of its own
+    kokos_instruction_t instr = kokos_instruction_generic(*at);
+
+    switch (instr.type) {
+    case I_PUSH:
+        emit_mov_imm(ctx, RAX, instr.operand);
+        emit_store(ctx, LOCALS_REG, STACK_SLOT(ctx, depth), RAX);
+        return true;
+    case I_PUSH_CONST:
+        if (instr.operand > INT32_MAX / sizeof(kokos_value_t)) {
+            return false;
+        }
+
+        // the pool can grow while other modules are compiled, so its items are loaded every time
+        emit_load(ctx, RAX, VM_REG, offsetof(kokos_vm_t, store.constants));
+        emit_load(ctx, RAX, RAX, offsetof(kokos_constant_pool_t, items));
+        emit_load(ctx, RAX, RAX, LOCAL_SLOT(instr.operand));
+        emit_store(ctx, LOCALS_REG, STACK_SLOT(ctx, depth), RAX);
+        return true;
+    case I_POP: return true;
+    case I_LOAD_SLOT:
+        if (instr.operand >= proc->locals_count) {
+            return false;
+        }
+
+        emit_load(ctx, RAX, LOCALS_REG, LOCAL_SLOT(instr.operand));
+        emit_store(ctx, LOCALS_REG, STACK_SLOT(ctx, depth), RAX);
+        return true;
+    case I_STORE_SLOT:
+        if (instr.operand >= proc->locals_count) {
+            return false;
+        }
+
+        emit_load(ctx, RAX, LOCALS_REG, STACK_SLOT(ctx, depth - 1));
+        emit_store(ctx, LOCALS_REG, LOCAL_SLOT(instr.operand), RAX);
+        return true;
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+        if (instr.operand != 2) {
+            emit_step(ctx, instr, depth);
+            return true;
+        }
+
+        EMIT_INT_BINOP(ctx, instr, depth, {
+            if (instr.type == I_ADD) {
+                emit_op(ctx, OP_ADD, false, RAX, RDX);
+            } else if (instr.type == I_SUB) {
+                emit_op(ctx, OP_SUB, false, RAX, RDX);
+            } else {
+                emit_imul32(ctx, RAX, RDX);
+            }
+
+            EMIT_TAG_INT(ctx);
+        });
+        return true;
+    case I_CMP:
+        EMIT_INT_BINOP(ctx, instr, depth, {
+            // rcx is 1 if lhs > rhs, -1 if lhs < rhs and 0 otherwise
+            emit_op(ctx, OP_XOR, false, RCX, RCX);
+            emit_op(ctx, OP_CMP, false, RAX, RDX);
+            emit_setcc(ctx, CC_G, RCX);
+            emit_mov_imm(ctx, RAX, (uint64_t)-1);
+            emit_cmovcc(ctx, CC_L, RCX, RAX);
+            emit_op(ctx, OP_MOV, true, RAX, RCX);
+        });
+        return true;
+    case I_IS_CALLEE:
+        // the instruction keeps its inline cache in it, like a call
+        emit_mov_imm(ctx, RSI, (uintptr_t)at);
+        emit_load(ctx, RDX, LOCALS_REG, STACK_SLOT(ctx, depth - 1));
+        emit_call_vm(ctx, (uintptr_t)kokos_vm_jit_is_callee);
+        // test al, al
+        emit8(ctx, 0x84);
+        emit_modrm_reg(ctx, RAX, RAX);
+        emit_mov_imm(ctx, RAX, FALSE_BITS);
+        emit_mov_imm(ctx, RCX, TRUE_BITS);
+        emit_cmovcc(ctx, CC_NE, RAX, RCX);
+        emit_store(ctx, LOCALS_REG, STACK_SLOT(ctx, depth - 1), RAX);
+        return true;
+    case I_EQ:
+    case I_NEQ:
+        emit_load(ctx, RAX, LOCALS_REG, STACK_SLOT(ctx, depth - 1));
+        emit_mov_imm(ctx, RCX, instr.operand);
+        emit_op(ctx, OP_CMP, true, RAX, RCX);
+        emit_mov_imm(ctx, RAX, FALSE_BITS);
+        emit_mov_imm(ctx, RCX, TRUE_BITS);
+        emit_cmovcc(ctx, instr.type == I_EQ ? CC_E : CC_NE, RAX, RCX);
+        emit_store(ctx, LOCALS_REG, STACK_SLOT(ctx, depth - 1), RAX);
+        return true;
+    case I_DIV:
+    case I_GET_GLOBAL:
+    case I_ADD_GLOBAL:
+    case I_ALLOC:
+        emit_step(ctx, instr, depth);
+        return true;
+    case I_LOAD_REST:
+        if (instr.operand >= proc->locals_count) {
+            return false;
+        }
+
+        emit_step(ctx, instr, depth);
+        return true;
+    case I_BRANCH:
+        emit_jmp_to(ctx, *(size_t*)instr.operand);
+        return true;
+    case I_JZ:
+    case I_JNZ: {
+        // only false and nil are falsy
+        size_t target = *(size_t*)instr.operand;
+        emit_load(ctx, RAX, LOCALS_REG, STACK_SLOT(ctx, depth - 1));
+        emit_mov_imm(ctx, RCX, FALSE_BITS);
+        emit_op(ctx, OP_CMP, true, RAX, RCX);
+
+        if (instr.type == I_JZ) {
+            emit_jcc_to(ctx, CC_E, target);
+            emit_mov_imm(ctx, RCX, NIL_BITS);
+            emit_op(ctx, OP_CMP, true, RAX, RCX);
+            emit_jcc_to(ctx, CC_E, target);
+            return true;
+        }
+
+        size_t falsy = emit_jcc_forward(ctx, CC_E);
+        emit_mov_imm(ctx, RCX, NIL_BITS);
+        emit_op(ctx, OP_CMP, true, RAX, RCX);
+        size_t nil = emit_jcc_forward(ctx, CC_E);
+        emit_jmp_to(ctx, target);
+        emit_patch_here(ctx, falsy);
+        emit_patch_here(ctx, nil);
+        return true;
+    }
+    case I_JLT:
+    case I_JGT:
+    case I_JLE:
+    case I_JGE:
+    case I_JEQ:
+    case I_JNE: {
+        uint8_t cc = compare_jump_cc(instr.type);
+        size_t target = *(size_t*)instr.operand;
+        size_t slow[2];
+        size_t slow_count = 0;
+        emit_load(ctx, RAX, LOCALS_REG, STACK_SLOT(ctx, depth - 2));
+        emit_load(ctx, RDX, LOCALS_REG, STACK_SLOT(ctx, depth - 1));
+        emit_check_int(ctx, RAX, slow, &slow_count);
+        emit_check_int(ctx, RDX, slow, &slow_count);
+        emit_op(ctx, OP_CMP, false, RAX, RDX);
+        emit_jcc_to(ctx, cc, target);
+        size_t done = emit_jmp_forward(ctx);
+        for (size_t i = 0; i < slow_count; i++) {
+            emit_patch_here(ctx, slow[i]);
+        }
+
+        // let the vm compare them like `I_CMP`, then test the -1, 0 or 1 it pushed
+        emit_step(ctx, INSTR_CMP, depth);
+        emit_load(ctx, RAX, LOCALS_REG, STACK_SLOT(ctx, depth - 2));
+        emit_cmp_imm32(ctx, RAX, 0);
+        emit_jcc_to(ctx, cc, target);
+        emit_patch_here(ctx, done);
+        return true;
+    }
+    case I_CALL:
+    case I_CALL0:
+    case I_CALL1:
+    case I_CALL2:
+    case I_CALL3:
+        emit_sync_stack(ctx, depth);
+        // the call keeps its inline cache in the instruction
+        emit_mov_imm(ctx, RSI, (uintptr_t)at);
+        emit_call_vm(ctx, (uintptr_t)kokos_vm_jit_call);
+        emit_check_call(ctx);
+        emit_load_locals(ctx);
+        return true;
+    case I_TAIL_CALL:
+        // anything but a native callee ends the compiled code, with the status already in eax
+        emit_sync_stack(ctx, depth);
+        emit_mov_imm(ctx, RSI, (uintptr_t)at);
+        emit_call_vm(ctx, (uintptr_t)kokos_vm_jit_tail_call);
+        emit_cmp_imm32(ctx, RAX, KOKOS_JIT_CONTINUE);
+        emit_jcc_to(ctx, CC_NE, TARGET_EXIT(ctx));
+        emit_load_locals(ctx);
+        return true;
+    case I_RET:
+        emit_sync_stack(ctx, depth);
+        emit_mov_imm32(ctx, RAX, KOKOS_JIT_RETURN);
+        emit_jmp_to(ctx, TARGET_EXIT(ctx));
+        return true;
+    default: return false;
+    }
+}
+
+#undef EMIT_TAG_INT
+#undef EMIT_INT_BINOP
+
+static void emit_prologue(kokos_jit_ctx_t* ctx)
+{
+    // five pushes on top of the return address keep the stack 16 byte aligned for the calls
+    emit_push(ctx, RBP);
+    emit_op(ctx, OP_MOV, true, RBP, RSP);
+    emit_push(ctx, VM_REG);
+    emit_push(ctx, BASE_REG);
+    emit_push(ctx, LOCALS_REG);
+    emit_push(ctx, INT_BITS_REG);
+
+    emit_op(ctx, OP_MOV, true, VM_REG, RDI);
+    emit_load(ctx, BASE_REG, RSI, offsetof(kokos_frame_t, base));
+    emit_shl(ctx, BASE_REG, 3);
+    emit_load_locals(ctx);
+    emit_mov_imm(ctx, INT_BITS_REG, INT_BITS);
+}
+
+static void emit_exits(kokos_jit_ctx_t* ctx)
+{
+    _Static_assert(KOKOS_JIT_THROW == 0, "the throw exit zeroes eax");
+
+    ctx->offsets[TARGET_THROW(ctx)] = ctx->buf.len;
+    emit_op(ctx, OP_XOR, false, RAX, RAX);
+
+    ctx->offsets[TARGET_EXIT(ctx)] = ctx->buf.len;
+    emit_pop(ctx, INT_BITS_REG);
+    emit_pop(ctx, LOCALS_REG);
+    emit_pop(ctx, BASE_REG);
+    emit_pop(ctx, VM_REG);
+    emit_pop(ctx, RBP);
+    // ret
+    emit8(ctx, 0xC3);
+}
+
+/// Copies the code into a fresh executable mapping
+static kokos_jit_code_t* kokos_jit_install(const kokos_jit_buffer_t* buf)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size = (buf->len + page_size - 1) / page_size * page_size;
+
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    memcpy(mem, buf->items, buf->len);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return NULL;
+    }
+
+    kokos_jit_code_t* code = KOKOS_ZALLOC(sizeof(kokos_jit_code_t));
+    code->entry = (kokos_jit_entry_t)mem;
+    code->size = size;
+    return code;
+}
+
+kokos_jit_code_t* kokos_jit_compile(const kokos_proc_t* proc)
+{
+    const kokos_code_t* code = &proc->code;
+    if (code->len == 0 || code->items[code->len - 1].type != I_RET) {
+        return NULL;
+    }
+
+    // every slot and operand has to be in reach of a 32 bit displacement
+    if (proc->locals_count + proc->max_depth > INT32_MAX / sizeof(kokos_value_t)) {
+        return NULL;
+    }
+
+    size_t* depths = KOKOS_CALLOC(code->len, sizeof(size_t));
+    if (!kokos_code_stack_depths(code, depths)) {
+        KOKOS_FREE(depths);
+        return NULL;
+    }
+
+    kokos_jit_ctx_t ctx = { .code_len = code->len, .locals_count = proc->locals_count };
+    // a rough guess, most instructions take a few dozen bytes
+    size_t buf_cap = code->len * 32;
+    DA_INIT(&ctx.buf, 0, buf_cap);
+    DA_INIT(&ctx.fixups, 0, code->len);
+    ctx.offsets = KOKOS_CALLOC(code->len + 2, sizeof(size_t));
+
+    emit_prologue(&ctx);
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < code->len; i++) {
+        ctx.offsets[i] = ctx.buf.len;
+
+        // nothing jumps to unreachable code, so there is no need to translate it
+        if (depths[i] != SIZE_MAX) {
+            ok = emit_instruction(&ctx, proc, &code->items[i], depths[i]);
+        }
+    }
+
+    kokos_jit_code_t* result = NULL;
+    if (ok) {
+        emit_exits(&ctx);
+
+        for (size_t i = 0; i < ctx.fixups.len; i++) {
+            kokos_jit_fixup_t fixup = ctx.fixups.items[i];
+            int32_t rel = (int32_t)(ctx.offsets[fixup.target] - (fixup.at + 4));
+            memcpy(ctx.buf.items + fixup.at, &rel, sizeof(rel));
+        }
+
+        result = kokos_jit_install(&ctx.buf);
+    }
+
+    DA_FREE(&ctx.buf);
+    DA_FREE(&ctx.fixups);
+    KOKOS_FREE(ctx.offsets);
+    KOKOS_FREE(depths);
+
+    return result;
+}
+
+#else
+
+kokos_jit_code_t* kokos_jit_compile(const kokos_proc_t* proc)
+{
+    (void)proc;
+    return NULL;
+}
+
+#endif // KOKOS_JIT_SUPPORTED
+
+kokos_jit_code_t* kokos_jit_code_from(kokos_jit_entry_t entry)
+{
+    kokos_jit_code_t* code = KOKOS_ALLOC(sizeof(kokos_jit_code_t));
+    *code = (kokos_jit_code_t) { .entry = entry };
+    return code;
+}
+
+void kokos_jit_free(kokos_jit_code_t* code)
+{
+    if (!code) {
+        return;
+    }
+
+#ifdef KOKOS_JIT_SUPPORTED
+    // code compiled ahead of time is part of the executable
+    if (code->size != 0) {
+        munmap((void*)code->entry, code->size);
+    }
+#endif
+
+    KOKOS_FREE(code);
+}
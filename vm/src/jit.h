@@ -0,0 +1,47 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "runtime.h"
+
+#include <stddef.h>
+
+// the jit emits x86-64 code for the System V calling convention, everywhere else (and in tracing
+// builds, since compiled code can't trace) every procedure is interpreted
+#if defined(__x86_64__) && defined(__linux__) && !defined(KOKOS_VM_NO_JIT)                        \
+    && !defined(KOKOS_VM_TRACE)
+#define KOKOS_JIT_SUPPORTED
+#endif
+
+typedef struct kokos_vm kokos_vm_t;
+typedef struct kokos_frame kokos_frame_t;
+
+typedef enum {
+    // an exception was thrown and is in the exception register of the vm
+    KOKOS_JIT_THROW,
+    // the procedure returned, with its return value on top of the frame's stack (nil if it is
+    // empty)
+    KOKOS_JIT_RETURN,
+    // the procedure was replaced in its frame by `vm->registers.tail_callee`, which has to run next
+    KOKOS_JIT_TAIL_CALL,
+    // only returned by `kokos_vm_jit_tail_call`: the callee was native, carry on with the return
+    KOKOS_JIT_CONTINUE,
+} kokos_jit_status_e;
+
+/// Runs compiled code for the procedure that was just entered in `frame`
+typedef kokos_jit_status_e (*kokos_jit_entry_t)(kokos_vm_t* vm, kokos_frame_t* frame);
+
+typedef struct kokos_jit_code {
+    kokos_jit_entry_t entry;
+    // size of the executable mapping that starts at `entry`, 0 for code compiled ahead of time
+    size_t size;
+} kokos_jit_code_t;
+
+/// Translates the code of `proc` into machine code. Returns NULL if the jit is not supported or the
+/// code can't be compiled, in which case the procedure stays interpreted
+kokos_jit_code_t* kokos_jit_compile(const kokos_proc_t* proc);
+
+/// Wraps `entry`, code compiled ahead of time, so it can be attached to a procedure like jit code
+kokos_jit_code_t* kokos_jit_code_from(kokos_jit_entry_t entry);
+void kokos_jit_free(kokos_jit_code_t* code);
+
+#endif // JIT_H_
@@ -9,6 +9,7 @@ typedef struct {
     kokos_runtime_string_t* name;
     kokos_params_t params;
     kokos_code_t instructions;
+    size_t locals_count;
 } kokos_macro_t;
 
 static inline void kokos_macro_destroy(kokos_macro_t* macro)
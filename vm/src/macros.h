@@ -20,6 +20,10 @@
 #define KOKOS_CALLOC calloc
 #endif // KOKOS_CALLOC
 
+#ifndef KOKOS_ALIGNED_ALLOC
+#define KOKOS_ALIGNED_ALLOC aligned_alloc
+#endif // KOKOS_ALIGNED_ALLOC
+
 #define KOKOS_ZALLOC(size) (KOKOS_CALLOC((size), 1))
 
 #define __ESC_RED "\e[31m"
@@ -1,4 +1,6 @@
+#include "aot.h"
 #include "ast.h"
+#include "bytecode-cache.h"
 #include "compile.h"
 #include "instruction.h"
 #include "lexer.h"
@@ -35,40 +37,108 @@ uint64_t get_time_stamp(void)
     return val.tv_usec + val.tv_sec * 1000000;
 }
 
-static int run_file(const char* filename)
+static bool compile_file(const char* filename, const char* data, kokos_module_t* module,
+    kokos_scope_t* global_scope, kokos_compiled_module_t* compiled_module)
 {
-    char* data = read_file(filename);
-    KOKOS_VERIFY(data);
-
     kokos_lexer_t lexer = kokos_lex_named_buf(data, strlen(data), filename);
     kokos_parser_t parser = kokos_parser_init(&lexer);
 
     uint64_t parser_start = get_time_stamp();
-    kokos_module_t module = kokos_parser_parse_module(&parser);
+    *module = kokos_parser_parse_module(&parser);
     uint64_t parser_end = get_time_stamp();
 
     if (!kokos_parser_ok(&parser)) {
         const char* error_msg = kokos_parser_get_err(&parser);
         fprintf(stderr, "Error while parsing the module: %s\n", error_msg);
-        return 1;
+        return false;
     }
 
     printf("module ast:\n");
     printf("--------------------------------------------------\n");
-    kokos_module_dump(module);
+    kokos_module_dump(*module);
     printf("--------------------------------------------------\n\n");
 
-    kokos_scope_t* global_scope = kokos_scope_root();
-    kokos_compiled_module_t compiled_module;
-
     uint64_t compile_start = get_time_stamp();
-    bool ok = kokos_compile_module(module, global_scope, &compiled_module);
+    bool ok = kokos_compile_module(*module, global_scope, compiled_module);
     uint64_t compile_end = get_time_stamp();
 
     if (!ok) {
         const char* error_msg = kokos_compile_get_err();
         fprintf(stderr, "Error while compiling the module: %s\n", error_msg);
-        return 1;
+        return false;
+    }
+
+    printf("parsing took %ld us\n", parser_end - parser_start);
+    printf("compiling took %ld us\n\n", compile_end - compile_start);
+
+    return true;
+}
+
+/// Writes the module as a C program to `path`, see `kokos_aot_emit_c`
+static bool emit_c(const char* path, const char* filename, const kokos_compiled_module_t* module,
+    uint64_t source_hash)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "ERROR: could not open %s\n", path);
+        return false;
+    }
+
+    bool ok = kokos_aot_emit_c(out, filename, module, source_hash);
+    ok = fclose(out) == 0 && ok;
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not write the C program to %s\n", path);
+        remove(path);
+        return false;
+    }
+
+    printf("wrote the C program to %s\n", path);
+    return true;
+}
+
+static int run_file(const char* filename, bool use_cache, bool use_jit, const char* emit_c_path,
+    kokos_opt_level_e opt_level, uint64_t gc_pause_us, size_t gc_min_heap, size_t gc_max_heap)
+{
+    char* data = read_file(filename);
+    KOKOS_VERIFY(data);
+
+    // the cached code depends on the optimization level as much as on the source
+    uint64_t source_hash = kokos_bytecode_cache_hash(data, strlen(data)) ^ opt_level;
+    kokos_compile_set_opt_level(opt_level);
+
+    char cache_path[4096];
+    snprintf(cache_path, sizeof(cache_path), "%s" KOKOS_BYTECODE_CACHE_EXT, filename);
+
+    kokos_scope_t* global_scope = kokos_scope_root();
+    kokos_compiled_module_t compiled_module;
+    kokos_module_t module = { 0 };
+
+    uint64_t load_start = get_time_stamp();
+    bool cached = use_cache
+        && kokos_bytecode_cache_load(cache_path, source_hash, global_scope, &compiled_module);
+    uint64_t load_end = get_time_stamp();
+
+    if (cached) {
+        printf("loaded the module from %s in %ld us\n\n", cache_path, load_end - load_start);
+    } else {
+        if (!compile_file(filename, data, &module, global_scope, &compiled_module)) {
+            return 1;
+        }
+
+        if (use_cache && !kokos_bytecode_cache_write(cache_path, &compiled_module, source_hash)) {
+            fprintf(stderr, "WARNING: could not write the bytecode cache to %s\n", cache_path);
+        }
+    }
+
+    if (emit_c_path) {
+        bool ok = emit_c(emit_c_path, filename, &compiled_module, source_hash);
+
+        KOKOS_FREE(data);
+        kokos_module_destroy(module);
+        kokos_scope_destroy(global_scope);
+
+        return ok ? 0 : 1;
     }
 
     printf("module code:\n");
@@ -95,6 +165,10 @@ static int run_file(const char* filename)
     printf("--------------------------------------------------\n\n");
 
     kokos_vm_t* vm = kokos_vm_create(global_scope);
+    vm->jit_enabled = use_jit;
+    vm->gc.max_pause_us = gc_pause_us;
+    vm->gc.min_heap_size = gc_min_heap;
+    vm->gc.max_heap_size = gc_max_heap;
 
     uint64_t runtime_start = get_time_stamp();
     kokos_vm_load_module(vm, &compiled_module); // loading the module also runs it's code
@@ -105,8 +179,6 @@ static int run_file(const char* filename)
     kokos_vm_dump(vm);
     printf("--------------------------------------------------\n\n");
 
-    printf("parsing took %ld us\n", parser_end - parser_start);
-    printf("compiling took %ld us\n", compile_end - compile_start);
     printf("runtime took %ld us\n", runtime_end - runtime_start);
 
     KOKOS_FREE(data);
@@ -119,10 +191,50 @@ static int run_file(const char* filename)
 
 int main(int argc, char* argv[])
 {
+    bool use_cache = true;
+    bool use_jit = true;
+    const char* emit_c_path = NULL;
+    uint64_t gc_pause_us = GC_MAX_PAUSE_US;
+    size_t gc_min_heap = GC_MIN_HEAP_SIZE;
+    size_t gc_max_heap = GC_MAX_HEAP_SIZE;
+    kokos_opt_level_e opt_level = KOKOS_OPT_DEFAULT;
+    for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+        if (kokos_opt_level_parse(argv[1], &opt_level)) {
+            continue;
+        }
+
+        if (strcmp(argv[1], "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(argv[1], "--no-jit") == 0) {
+            use_jit = false;
+        } else if (strcmp(argv[1], "--emit-c") == 0 && argc > 2) {
+            emit_c_path = argv[2];
+            argc--, argv++;
+        } else if (strcmp(argv[1], "--gc-pause") == 0 && argc > 2) {
+            gc_pause_us = strtoull(argv[2], NULL, 10);
+            argc--, argv++;
+        } else if (strcmp(argv[1], "--gc-min-heap") == 0 && argc > 2) {
+            gc_min_heap = strtoull(argv[2], NULL, 10);
+            argc--, argv++;
+        } else if (strcmp(argv[1], "--gc-max-heap") == 0 && argc > 2) {
+            gc_max_heap = strtoull(argv[2], NULL, 10);
+            argc--, argv++;
+        } else {
+            fprintf(stderr, "ERROR: unknown option %s\n", argv[1]);
+            goto usage;
+        }
+    }
+
     if (argc > 1) {
-        return run_file(argv[1]);
+        return run_file(argv[1], use_cache, use_jit, emit_c_path, opt_level, gc_pause_us,
+            gc_min_heap, gc_max_heap);
     }
 
     fprintf(stderr, "ERROR: not enough arguments\n");
+
+usage:
+    fprintf(stderr,
+        "usage: kokosvm [-O0|-O1|-O2] [--no-cache] [--no-jit] [--emit-c <out.c>] [--gc-pause <us>] "
+        "[--gc-min-heap <bytes>] [--gc-max-heap <bytes>] <file>\n");
     return 1;
 }
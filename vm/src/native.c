@@ -9,17 +9,9 @@
 
 static bool native_print(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret)
 {
-    // do this so we don't peek an empty stack
-    if (nargs == 0) {
-        printf("\n");
-        return true;
-    }
-
-    kokos_frame_t* frame = STACK_PEEK(&vm->frames);
-
     for (uint16_t i = 0; i < nargs; i++) {
         kokos_value_t value;
-        STACK_POP(&frame->stack, &value);
+        STACK_POP(&vm->stack, &value);
 
         kokos_value_print(value);
         if (i != nargs - 1) {
@@ -33,13 +25,12 @@ static bool native_print(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret)
 
 static bool native_make_vec(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret)
 {
-    kokos_frame_t* frame = STACK_PEEK(&vm->frames);
-
     kokos_runtime_vector_t* vector = kokos_vm_gc_alloc(vm, VECTOR_TAG, nargs);
 
     for (size_t i = 0; i < nargs; i++) {
         kokos_value_t elem;
-        STACK_POP(&frame->stack, &elem);
+        STACK_POP(&vm->stack, &elem);
+        kokos_gc_check_store(&vm->gc, vector, elem);
         DA_ADD(vector, elem);
     }
 
@@ -52,15 +43,15 @@ static bool native_make_map(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret)
 {
     CHECK_CUSTOM(nargs % 2 == 0, "expected the number of arguments to be even");
 
-    kokos_frame_t* frame = STACK_PEEK(&vm->frames);
-
     kokos_runtime_map_t* map = kokos_vm_gc_alloc(vm, MAP_TAG, nargs);
 
     for (size_t i = 0; i < nargs / 2; i++) {
         kokos_value_t key;
-        STACK_POP(&frame->stack, &key);
+        STACK_POP(&vm->stack, &key);
         kokos_value_t value;
-        STACK_POP(&frame->stack, &value);
+        STACK_POP(&vm->stack, &value);
+        kokos_gc_check_store(&vm->gc, map, key);
+        kokos_gc_check_store(&vm->gc, map, value);
         kokos_runtime_map_add(map, key, value);
     }
 
@@ -74,9 +65,8 @@ static bool native_read_file(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret)
 {
     CHECK_ARITY(1, nargs);
 
-    kokos_frame_t* frame = STACK_PEEK(&vm->frames);
     kokos_value_t filename;
-    STACK_POP(&frame->stack, &filename);
+    STACK_POP(&vm->stack, &filename);
     CHECK_TYPE(filename, STRING_TAG);
 
     kokos_runtime_string_t* filename_string = (kokos_runtime_string_t*)GET_PTR(filename);
@@ -93,11 +83,8 @@ static bool native_read_file(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret)
     size_t fsize = ftell(f);
     rewind(f); // this never fails according to the documentation
 
-    char* buf = KOKOS_ALLOC(sizeof(char) * fsize);
-    fread(buf, sizeof(char), fsize, f);
-
     kokos_runtime_string_t* str = kokos_vm_gc_alloc(vm, STRING_TAG, fsize);
-    str->ptr = buf;
+    fread(str->ptr, sizeof(char), fsize, f);
     str->len = fsize;
 
     *ret = TO_STRING(str);
@@ -118,13 +105,12 @@ static bool native_write_file(kokos_vm_t* vm, uint16_t nargs, kokos_value_t* ret
 {
     CHECK_ARITY(2, nargs);
 
-    kokos_frame_t* frame = STACK_PEEK(&vm->frames);
     kokos_value_t filename;
-    STACK_POP(&frame->stack, &filename);
+    STACK_POP(&vm->stack, &filename);
     CHECK_TYPE(filename, STRING_TAG);
 
     kokos_value_t data;
-    STACK_POP(&frame->stack, &data);
+    STACK_POP(&vm->stack, &data);
     CHECK_TYPE(filename, STRING_TAG);
 
     kokos_runtime_string_t* filename_string = (kokos_runtime_string_t*)GET_PTR(filename);
@@ -0,0 +1,341 @@
+#include "optimize.h"
+#include "base.h"
+#include "cfg.h"
+#include "hash.h"
+#include "macros.h"
+
+#include <string.h>
+
+typedef struct {
+    bool (*run)(kokos_code_t* code);
+    kokos_opt_level_e level;
+} kokos_pass_t;
+
+static const kokos_pass_t passes[] = {
+#define X(name, level) { kokos_pass_##name, level },
+    ENUMERATE_PASSES
+#undef X
+};
+
+// every pass only ever shrinks or simplifies the code, this only guards against two of them undoing
+// each other's work forever
+#define MAX_ROUNDS 16
+
+void kokos_optimize(kokos_code_t* code, kokos_opt_level_e level)
+{
+    if (code->len == 0) {
+        return;
+    }
+
+    for (size_t round = 0; round < MAX_ROUNDS; round++) {
+        bool changed = false;
+        for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+            if (level >= passes[i].level) {
+                changed |= passes[i].run(code);
+            }
+        }
+
+        if (!changed || level < KOKOS_OPT_FULL) {
+            break;
+        }
+    }
+}
+
+bool kokos_opt_level_parse(const char* arg, kokos_opt_level_e* level)
+{
+    if (strcmp(arg, "-O0") == 0) {
+        *level = KOKOS_OPT_NONE;
+    } else if (strcmp(arg, "-O1") == 0) {
+        *level = KOKOS_OPT_BASIC;
+    } else if (strcmp(arg, "-O2") == 0) {
+        *level = KOKOS_OPT_FULL;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool* kokos_code_jump_targets(const kokos_code_t* code)
+{
+    bool* targets = KOKOS_CALLOC(code->len, sizeof(bool));
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if (kokos_instruction_is_jump(instr.type) && *(size_t*)instr.operand < code->len) {
+            targets[*(size_t*)instr.operand] = true;
+        }
+    }
+
+    return targets;
+}
+
+void kokos_code_remove_instructions(kokos_code_t* code, const bool* dead)
+{
+    KOKOS_ASSERT(code->len != 0 && !dead[code->len - 1]);
+
+    size_t* moved_to = KOKOS_CALLOC(code->len, sizeof(size_t));
+    size_t len = 0;
+    for (size_t i = 0; i < code->len; i++) {
+        moved_to[i] = len;
+        len += !dead[i];
+    }
+
+    // jumps to the same place can share their label, so every label is only moved once
+    hash_table moved_labels = ht_make(hash_sizet_func, hash_sizet_eq_func, 17);
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if (dead[i] || !kokos_instruction_is_jump(instr.type)) {
+            continue;
+        }
+
+        size_t* label = (size_t*)instr.operand;
+        if (!ht_find(&moved_labels, label)) {
+            *label = moved_to[*label];
+            ht_add(&moved_labels, label, label);
+        }
+    }
+    ht_destroy(&moved_labels);
+
+    len = 0;
+    for (size_t i = 0; i < code->len; i++) {
+        if (!dead[i]) {
+            code->items[len++] = code->items[i];
+        }
+    }
+    code->len = len;
+
+    KOKOS_FREE(moved_to);
+}
+
+/// Gets the jump that is taken when an `I_CMP` followed by `test` and `I_JZ` would jump, or
+/// `I_JZ` if there is none. The jump is taken when the comparison is false, so it is the negation
+static kokos_instruction_type_e fused_compare_jump(kokos_instruction_t test)
+{
+    // these are the sequences the comparison special forms compile to
+    if (test.type == I_EQ) {
+        switch ((int64_t)test.operand) {
+        case -1: return I_JGE;
+        case 1:  return I_JLE;
+        case 0:  return I_JNE;
+        }
+    } else if (test.type == I_NEQ) {
+        switch ((int64_t)test.operand) {
+        case 1:  return I_JGT;
+        case -1: return I_JLT;
+        case 0:  return I_JEQ;
+        }
+    }
+
+    return I_JZ;
+}
+
+/// Fuses every comparison that is only used by a conditional jump, `I_CMP`, `I_EQ`/`I_NEQ` and
+/// `I_JZ`, into a single compare-and-jump
+bool kokos_pass_fuse_compare_jumps(kokos_code_t* code)
+{
+    // nothing may jump into the middle of a sequence that is fused
+    bool* targets = kokos_code_jump_targets(code);
+    bool* dead = KOKOS_CALLOC(code->len, sizeof(bool));
+    bool changed = false;
+
+    for (size_t i = 0; i + 2 < code->len; i++) {
+        kokos_instruction_t* instr = &code->items[i];
+        if (instr->type != I_CMP || code->items[i + 2].type != I_JZ || targets[i + 1]
+            || targets[i + 2]) {
+            continue;
+        }
+
+        kokos_instruction_type_e jump = fused_compare_jump(code->items[i + 1]);
+        if (jump == I_JZ) {
+            continue;
+        }
+
+        // the fused jump takes over the label of the `I_JZ`
+        *instr = (kokos_instruction_t) { .type = jump, .operand = code->items[i + 2].operand };
+        dead[i + 1] = true;
+        dead[i + 2] = true;
+        changed = true;
+        i += 2;
+    }
+
+    if (changed) {
+        kokos_code_remove_instructions(code, dead);
+    }
+
+    KOKOS_FREE(dead);
+    KOKOS_FREE(targets);
+    return changed;
+}
+
+/// Makes every jump to an `I_BRANCH` go where the branch goes, e.g. the end of an inner `if` that
+/// jumps on to the end of the outer one
+bool kokos_pass_thread_jumps(kokos_code_t* code)
+{
+    bool changed = false;
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if (!kokos_instruction_is_jump(instr.type)) {
+            continue;
+        }
+
+        // a label shared with other jumps can be changed too, since they all go to the same place.
+        // Giving up after `code->len` hops stops at a cycle of branches
+        size_t* label = (size_t*)instr.operand;
+        size_t target = *label;
+        for (size_t hops = 0; hops < code->len && code->items[target].type == I_BRANCH; hops++) {
+            target = *(size_t*)code->items[target].operand;
+        }
+
+        if (target != *label) {
+            *label = target;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/// Replaces every branch to an `I_RET` with the return itself
+bool kokos_pass_return_from_branches(kokos_code_t* code)
+{
+    bool changed = false;
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t* instr = &code->items[i];
+        if (instr->type == I_BRANCH && code->items[*(size_t*)instr->operand].type == I_RET) {
+            *instr = INSTR_RET;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/// Removes the branches to the instruction right after them
+bool kokos_pass_remove_useless_branches(kokos_code_t* code)
+{
+    bool* dead = KOKOS_CALLOC(code->len, sizeof(bool));
+    bool changed = false;
+
+    for (size_t i = 0; i < code->len; i++) {
+        kokos_instruction_t instr = code->items[i];
+        if (instr.type == I_BRANCH && *(size_t*)instr.operand == i + 1) {
+            dead[i] = true;
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        kokos_code_remove_instructions(code, dead);
+    }
+
+    KOKOS_FREE(dead);
+    return changed;
+}
+
+/// Removes the pushes of values that are popped right away, the pushes that can't throw at least
+bool kokos_pass_remove_dropped_pushes(kokos_code_t* code)
+{
+    bool* targets = kokos_code_jump_targets(code);
+    bool* dead = KOKOS_CALLOC(code->len, sizeof(bool));
+    bool changed = false;
+
+    for (size_t i = 0; i + 1 < code->len; i++) {
+        kokos_instruction_type_e type = code->items[i].type;
+        bool pure = type == I_PUSH || type == I_PUSH_CONST || type == I_LOAD_SLOT;
+        if (!pure || code->items[i + 1].type != I_POP || targets[i + 1]) {
+            continue;
+        }
+
+        dead[i] = true;
+        dead[i + 1] = true;
+        changed = true;
+        i++;
+    }
+
+    if (changed) {
+        kokos_code_remove_instructions(code, dead);
+    }
+
+    KOKOS_FREE(dead);
+    KOKOS_FREE(targets);
+    return changed;
+}
+
+/// Removes the blocks that can't be reached from the entry, like the code after a branch that
+/// `return_from_branches` turned into a return
+bool kokos_pass_remove_unreachable_blocks(kokos_code_t* code)
+{
+    kokos_cfg_t cfg;
+    kokos_cfg_build(code, &cfg);
+
+    bool* dead = KOKOS_CALLOC(code->len, sizeof(bool));
+    for (size_t i = 0; i < code->len; i++) {
+        dead[i] = !cfg.items[cfg.block_of[i]].reachable;
+    }
+
+    // the code has to keep ending in its return, even if nothing reaches it
+    dead[code->len - 1] = false;
+
+    bool changed = false;
+    for (size_t i = 0; i < code->len; i++) {
+        changed |= dead[i];
+    }
+
+    if (changed) {
+        kokos_code_remove_instructions(code, dead);
+    }
+
+    KOKOS_FREE(dead);
+    kokos_cfg_free(&cfg);
+    return changed;
+}
+
+/// Turns the stores to slots that are never read afterwards into pops, e.g. of `let` bindings that
+/// are not used
+bool kokos_pass_remove_dead_stores(kokos_code_t* code)
+{
+    size_t slots_count = kokos_code_slots_count(code);
+    if (slots_count == 0) {
+        return false;
+    }
+
+    kokos_cfg_t cfg;
+    kokos_cfg_build(code, &cfg);
+
+    bool* live_in = kokos_cfg_live_slots(&cfg, code, slots_count);
+    bool* live = KOKOS_CALLOC(slots_count, sizeof(bool));
+    bool changed = false;
+
+    for (size_t i = 0; i < cfg.order_len; i++) {
+        const kokos_block_t* block = &cfg.items[cfg.order[i]];
+
+        memset(live, 0, slots_count * sizeof(bool));
+        for (size_t j = 0; j < block->succs_count; j++) {
+            const bool* succ_live = live_in + block->succs[j] * slots_count;
+            for (size_t s = 0; s < slots_count; s++) {
+                live[s] |= succ_live[s];
+            }
+        }
+
+        for (size_t at = block->end; at-- > block->start;) {
+            kokos_instruction_t* instr = &code->items[at];
+            if (instr->type == I_LOAD_SLOT) {
+                live[instr->operand] = true;
+            } else if (instr->type == I_STORE_SLOT) {
+                // the instruction may be replaced below
+                size_t slot = instr->operand;
+                if (!live[slot]) {
+                    *instr = INSTR_POP(1);
+                    changed = true;
+                }
+
+                live[slot] = false;
+            }
+        }
+    }
+
+    KOKOS_FREE(live);
+    KOKOS_FREE(live_in);
+    kokos_cfg_free(&cfg);
+    return changed;
+}
@@ -0,0 +1,50 @@
+#ifndef OPTIMIZE_H_
+#define OPTIMIZE_H_
+
+#include "instruction.h"
+
+#include <stdbool.h>
+
+/// How much work the compiler puts into the code it generates, `-O0`, `-O1` and `-O2` of kokosvm
+typedef enum {
+    // the code runs as it was generated
+    KOKOS_OPT_NONE,
+    // every pass runs once
+    KOKOS_OPT_BASIC,
+    // the passes run again for as long as one of them finds something to change
+    KOKOS_OPT_FULL,
+} kokos_opt_level_e;
+
+#define KOKOS_OPT_DEFAULT KOKOS_OPT_BASIC
+
+// The passes, in the order they run in, with the lowest level they run at. A pass rewrites the code
+// in place and returns whether it changed anything; adding a pass takes an entry here and a
+// definition of `kokos_pass_<name>` in any translation unit
+#define ENUMERATE_PASSES                                                                           \
+    X(fuse_compare_jumps, KOKOS_OPT_BASIC)                                                         \
+    X(thread_jumps, KOKOS_OPT_BASIC)                                                               \
+    X(return_from_branches, KOKOS_OPT_BASIC)                                                       \
+    X(remove_useless_branches, KOKOS_OPT_BASIC)                                                    \
+    X(remove_unreachable_blocks, KOKOS_OPT_BASIC)                                                  \
+    X(remove_dead_stores, KOKOS_OPT_BASIC)                                                         \
+    X(remove_dropped_pushes, KOKOS_OPT_BASIC)
+
+#define X(name, level) bool kokos_pass_##name(kokos_code_t* code);
+ENUMERATE_PASSES
+#undef X
+
+/// Runs the passes of `level` over the code of a procedure, macro or module once all of it is
+/// generated
+void kokos_optimize(kokos_code_t* code, kokos_opt_level_e level);
+
+/// Gets the level written as `-O<n>` on the command line
+bool kokos_opt_level_parse(const char* arg, kokos_opt_level_e* level);
+
+/// Finds the instructions some jump goes to, the caller frees the result
+bool* kokos_code_jump_targets(const kokos_code_t* code);
+
+/// Removes the instructions marked in `dead` from `code`. A jump to a removed instruction ends up
+/// at the next one that is kept, so the last instruction has to be kept
+void kokos_code_remove_instructions(kokos_code_t* code, const bool* dead);
+
+#endif // OPTIMIZE_H_
@@ -1,6 +1,8 @@
 #include "runtime.h"
 #include "base.h"
+#include "gc.h"
 #include "hash.h"
+#include "jit.h"
 #include "macros.h"
 #include "string.h"
 #include "value.h"
@@ -92,7 +94,8 @@ void kokos_runtime_map_add(kokos_runtime_map_t* map, kokos_value_t key, kokos_va
 
 kokos_runtime_string_t* kokos_runtime_string_new(const char* data, size_t len)
 {
-    kokos_runtime_string_t* string = KOKOS_ALLOC(sizeof(kokos_runtime_string_t));
+    kokos_runtime_string_t* string
+        = kokos_gc_alloc_static(STRING_TAG, sizeof(kokos_runtime_string_t));
     string->ptr = KOKOS_CALLOC(len + 1, sizeof(char));
     string->len = len;
     string->ptr[string->len] = '\0';
@@ -108,18 +111,32 @@ inline kokos_runtime_string_t* kokos_runtime_string_from_sv(string_view sv)
 void kokos_runtime_string_destroy(kokos_runtime_string_t* string)
 {
     KOKOS_FREE(string->ptr);
-    KOKOS_FREE(string);
+    kokos_gc_free_static(string);
 }
 
 size_t kokos_runtime_proc_locals_count(const kokos_runtime_proc_t* proc)
 {
     switch (proc->type) {
-    case PROC_NATIVE: return 0;
-    case PROC_KOKOS:  return proc->kokos.params.len;
-    default:          KOKOS_TODO();
+    case PROC_NATIVE:  return 0;
+    case PROC_KOKOS:   return proc->kokos.locals_count;
+    case PROC_CLOSURE: return proc->closure.proc->kokos.locals_count;
+    default:           KOKOS_TODO();
     }
 }
 
+kokos_runtime_proc_t* kokos_runtime_proc_new(kokos_runtime_proc_type_e type)
+{
+    kokos_runtime_proc_t* proc = kokos_gc_alloc_static(PROC_TAG, sizeof(kokos_runtime_proc_t));
+    proc->type = type;
+    return proc;
+}
+
+void kokos_runtime_proc_free(kokos_runtime_proc_t* proc)
+{
+    kokos_runtime_proc_destroy(proc);
+    kokos_gc_free_static(proc);
+}
+
 void kokos_runtime_proc_destroy(kokos_runtime_proc_t* proc)
 {
     if (proc->type != PROC_KOKOS) {
@@ -127,4 +144,82 @@ void kokos_runtime_proc_destroy(kokos_runtime_proc_t* proc)
     }
 
     KOKOS_FREE(proc->kokos.params.names);
+    kokos_jit_free(proc->kokos.jit);
+}
+
+kokos_value_t kokos_runtime_constant_new(uint64_t tag, size_t len)
+{
+    switch (tag) {
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vec
+            = kokos_gc_alloc_static(VECTOR_TAG, sizeof(kokos_runtime_vector_t));
+        DA_INIT(vec, 0, len);
+        return TO_VECTOR(vec);
+    }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = kokos_gc_alloc_static(MAP_TAG, sizeof(kokos_runtime_map_t));
+        map->table = ht_make(kokos_default_map_hash_func, kokos_default_map_eq_func, len + 1);
+        return TO_MAP(map);
+    }
+    case LIST_TAG: {
+        kokos_runtime_list_t* list = kokos_gc_alloc_static(LIST_TAG, sizeof(kokos_runtime_list_t));
+        list->len = len;
+        list->items = KOKOS_CALLOC(len + 1, sizeof(kokos_value_t));
+        for (size_t i = 0; i < len; i++) {
+            list->items[i] = KOKOS_NIL;
+        }
+
+        return TO_LIST(list);
+    }
+    default: KOKOS_TODO();
+    }
+}
+
+static void kokos_runtime_constant_free_child(kokos_value_t value)
+{
+    if (IS_DOUBLE(value)) {
+        return;
+    }
+
+    // strings and symbols are owned by the string store
+    if (IS_VECTOR(value) || IS_MAP(value) || IS_LIST(value)) {
+        kokos_runtime_constant_free(value);
+    }
+}
+
+void kokos_runtime_constant_free(kokos_value_t value)
+{
+    switch (VALUE_TAG(value)) {
+    case VECTOR_TAG: {
+        kokos_runtime_vector_t* vec = GET_VECTOR(value);
+        for (size_t i = 0; i < vec->len; i++) {
+            kokos_runtime_constant_free_child(vec->items[i]);
+        }
+
+        DA_FREE(vec);
+        break;
+    }
+    case MAP_TAG: {
+        kokos_runtime_map_t* map = GET_MAP(value);
+        HT_ITER(map->table, {
+            kokos_runtime_constant_free_child(FROM_PTR(kv.key));
+            kokos_runtime_constant_free_child(FROM_PTR(kv.value));
+        });
+
+        ht_destroy(&map->table);
+        break;
+    }
+    case LIST_TAG: {
+        kokos_runtime_list_t* list = GET_LIST(value);
+        for (size_t i = 0; i < list->len; i++) {
+            kokos_runtime_constant_free_child(list->items[i]);
+        }
+
+        KOKOS_FREE(list->items);
+        break;
+    }
+    default: KOKOS_TODO();
+    }
+
+    kokos_gc_free_static(GET_PTR(value));
 }
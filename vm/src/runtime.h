@@ -39,22 +39,61 @@ typedef struct {
 typedef enum {
     PROC_KOKOS,
     PROC_NATIVE,
+    PROC_CLOSURE,
 } kokos_runtime_proc_type_e;
 
 typedef struct {
     kokos_code_t code;
     kokos_params_t params;
+    // number of frame slots the procedure needs, including the ones for its parameters
+    size_t locals_count;
+    // number of variables of the enclosing procedures the procedure uses. They live in its last
+    // slots, which a closure of the procedure fills on every call
+    size_t captures_count;
+    // the most values the code has on the operand stack at once, a frame for the procedure has room
+    // for them above its slots
+    size_t max_depth;
+    // number of times the procedure was called while interpreted, it is compiled to machine code
+    // once this reaches JIT_CALL_THRESHOLD
+    uint32_t calls;
+    struct kokos_jit_code* jit;
 } kokos_proc_t;
 
+struct kokos_runtime_proc;
+
+/// A procedure together with the values of the variables it captured, which follow the struct
 typedef struct {
+    struct kokos_runtime_proc* proc;
+    size_t len;
+} kokos_closure_t;
+
+typedef struct kokos_runtime_proc {
     kokos_runtime_proc_type_e type;
 
     union {
         kokos_proc_t kokos;
         kokos_native_proc_t native;
+        kokos_closure_t closure;
     };
 } kokos_runtime_proc_t;
 
+/// Gets the values captured by `closure`, a `PROC_CLOSURE`
+static inline kokos_value_t* kokos_closure_values(const kokos_runtime_proc_t* closure)
+{
+    return (kokos_value_t*)(&closure->closure + 1);
+}
+
+/// Gets the size of a closure that captured `len` values
+static inline size_t kokos_closure_size(size_t len)
+{
+    return offsetof(kokos_runtime_proc_t, closure) + sizeof(kokos_closure_t)
+        + len * sizeof(kokos_value_t);
+}
+
+/// Procedures are created by the compiler and are never collected. Closures are created by
+/// `I_ALLOC` each time a procedure that captures variables is evaluated, and the gc collects them
+kokos_runtime_proc_t* kokos_runtime_proc_new(kokos_runtime_proc_type_e type);
+void kokos_runtime_proc_free(kokos_runtime_proc_t*);
 void kokos_runtime_proc_destroy(kokos_runtime_proc_t*);
 
 // symbols have the same runtime representation as strings just for conveneince
@@ -98,4 +137,17 @@ void kokos_runtime_string_destroy(kokos_runtime_string_t*);
 
 size_t kokos_runtime_proc_locals_count(const kokos_runtime_proc_t*);
 
+/// Allocates a collection with the heap tag `tag` and room for `len` elements that the gc never
+/// frees, used for literals built by the compiler. A list is created with all `len` elements nil
+kokos_value_t kokos_runtime_constant_new(uint64_t tag, size_t len);
+/// Frees a collection created by `kokos_runtime_constant_new` and every such collection in it
+void kokos_runtime_constant_free(kokos_value_t value);
+
+/// Values of the literal collections of a module, referenced by index from the code
+typedef struct {
+    kokos_value_t* items;
+    size_t len;
+    size_t cap;
+} kokos_constant_pool_t;
+
 #endif // RUNTIME_H_
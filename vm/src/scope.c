@@ -52,6 +52,65 @@ inline kokos_macro_t* kokos_scope_get_macro(kokos_scope_t* scope, string_view na
     return kokos_scope_get_macro_impl(scope, rt_name);
 }
 
+size_t* kokos_scope_add_label(kokos_scope_t* scope)
+{
+    size_t* label = KOKOS_ZALLOC(sizeof(size_t));
+    DA_ADD(scope->labels, label);
+    return label;
+}
+
+size_t kokos_scope_add_local(kokos_scope_t* scope, const kokos_runtime_string_t* name)
+{
+    size_t slot = scope->locals.len;
+    DA_ADD(&scope->locals, name);
+
+    if (scope->locals.len > scope->locals_count) {
+        scope->locals_count = scope->locals.len;
+    }
+
+    return slot;
+}
+
+bool kokos_scope_find_local(
+    const kokos_scope_t* scope, const kokos_runtime_string_t* name, size_t* slot)
+{
+    // names are interned, so comparing the pointers is enough. search backwards so the
+    // innermost binding shadows the outer ones
+    for (size_t i = scope->locals.len; i > 0; i--) {
+        if (scope->locals.items[i - 1] == name) {
+            *slot = i - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t kokos_scope_add_capture(kokos_scope_t* scope, const kokos_runtime_string_t* name)
+{
+    KOKOS_ASSERT(scope->can_capture);
+
+    for (size_t i = 0; i < scope->captures.len; i++) {
+        if (scope->captures.items[i] == name) {
+            return i;
+        }
+    }
+
+    DA_ADD(&scope->captures, name);
+    return scope->captures.len - 1;
+}
+
+void kokos_scope_truncate_locals(kokos_scope_t* scope, size_t len)
+{
+    KOKOS_ASSERT(len <= scope->locals.len);
+    scope->locals.len = len;
+}
+
+bool kokos_scope_is_global(const kokos_scope_t* scope)
+{
+    return scope->parent == NULL && scope->locals.len == 0;
+}
+
 kokos_vm_t* kokos_vm_create(kokos_scope_t* scope);
 
 kokos_scope_t* kokos_scope_derived(kokos_scope_t* parent)
@@ -62,12 +121,21 @@ kokos_scope_t* kokos_scope_derived(kokos_scope_t* parent)
     scope->parent = parent;
     scope->macro_vm = parent->macro_vm;
     scope->string_store = parent->string_store;
+    scope->constants = parent->constants;
+    scope->labels = parent->labels;
     scope->procs = ht_make(hash_runtime_string_func, hash_runtime_string_eq_func, 17);
     scope->macros = ht_make(hash_cstring_func, hash_cstring_eq_func, 5);
     scope->call_locations = ht_make(hash_sizet_func, hash_sizet_eq_func, 5);
+    scope->constant_globals = ht_make(hash_runtime_string_func, hash_runtime_string_eq_func, 5);
 
     DA_INIT(&scope->derived, 0, 3);
     DA_INIT(&scope->code, 0, 17);
+    DA_INIT(&scope->locals, 0, 5);
+    scope->locals_count = 0;
+    scope->rest_slot = SIZE_MAX;
+    DA_INIT(&scope->captures, 0, 1);
+    scope->can_capture = false;
+    scope->call_caches_count = 0;
 
     DA_ADD(&parent->derived, scope);
 
@@ -78,29 +146,40 @@ kokos_scope_t* kokos_scope_root(void)
 {
     kokos_scope_t* scope = KOKOS_ALLOC(sizeof(kokos_scope_t));
     scope->parent = NULL;
-    scope->macro_vm = kokos_vm_create(scope);
     scope->string_store = KOKOS_ALLOC(sizeof(*scope->string_store));
     kokos_string_store_init(scope->string_store, 89);
+    scope->constants = KOKOS_ALLOC(sizeof(*scope->constants));
+    DA_INIT(scope->constants, 0, 17);
+    scope->labels = KOKOS_ALLOC(sizeof(*scope->labels));
+    DA_INIT(scope->labels, 0, 53);
+    // the vm takes the string store and the constant pool from the scope
+    scope->macro_vm = kokos_vm_create(scope);
     scope->procs = ht_make(hash_runtime_string_func, hash_runtime_string_eq_func, 53);
     scope->macros = ht_make(hash_cstring_func, hash_cstring_eq_func, 53);
     scope->call_locations = ht_make(hash_sizet_func, hash_sizet_eq_func, 53);
+    scope->constant_globals = ht_make(hash_runtime_string_func, hash_runtime_string_eq_func, 17);
 
     DA_INIT(&scope->derived, 0, 53);
+    DA_INIT(&scope->locals, 0, 5);
+    scope->locals_count = 0;
+    scope->rest_slot = SIZE_MAX;
+    DA_INIT(&scope->captures, 0, 1);
+    scope->can_capture = false;
+    scope->call_caches_count = 1;
 
     kokos_native_proc_list_t natives = kokos_natives_get();
     DA_INIT(&scope->code, 0, natives.count);
 
     // setup native functions
     for (size_t i = 0; i < natives.count; i++) {
-        kokos_runtime_proc_t* proc = KOKOS_ALLOC(sizeof(kokos_runtime_proc_t));
+        kokos_runtime_proc_t* proc = kokos_runtime_proc_new(PROC_NATIVE);
         proc->native = natives.procs[i];
-        proc->type = PROC_NATIVE;
 
         DA_ADD(&scope->code, INSTR_PUSH(TO_PROC(proc)));
 
         kokos_runtime_string_t* name = (kokos_runtime_string_t*)kokos_string_store_add_sv(
             scope->string_store, natives.names[i]);
-        DA_ADD(&scope->code, INSTR_ADD_LOCAL(TO_STRING(name).as_int));
+        DA_ADD(&scope->code, INSTR_ADD_GLOBAL(TO_STRING(name).as_int));
 
         kokos_scope_add_proc(scope, name, proc);
     }
@@ -118,17 +197,30 @@ void kokos_scope_destroy(kokos_scope_t* scope)
         kokos_vm_destroy(scope->macro_vm);
         kokos_string_store_destroy(scope->string_store);
         KOKOS_FREE(scope->string_store);
+
+        for (size_t i = 0; i < scope->constants->len; i++) {
+            kokos_runtime_constant_free(scope->constants->items[i]);
+        }
+
+        DA_FREE(scope->constants);
+        KOKOS_FREE(scope->constants);
+
+        for (size_t i = 0; i < scope->labels->len; i++) {
+            KOKOS_FREE(scope->labels->items[i]);
+        }
+
+        DA_FREE(scope->labels);
+        KOKOS_FREE(scope->labels);
     }
 
     // WARN: don't free the names, because the string store owns them
-    HT_ITER(scope->procs, {
-        kokos_runtime_proc_destroy(GET_PROC_PTR(kv.value));
-        KOKOS_FREE(kv.value);
-    });
+    HT_ITER(scope->procs, { kokos_runtime_proc_free(GET_PROC_PTR(kv.value)); });
 
     // WARN: don't free the names, because the string store owns them
     HT_ITER(scope->macros, { kokos_macro_destroy(kv.value); });
 
+    HT_ITER(scope->constant_globals, { KOKOS_FREE(kv.value); });
+
     for (size_t i = 0; i < scope->derived.len; i++) {
         kokos_scope_destroy(scope->derived.items[i]);
     }
@@ -137,8 +229,11 @@ void kokos_scope_destroy(kokos_scope_t* scope)
 
     ht_destroy(&scope->procs);
     ht_destroy(&scope->macros);
+    ht_destroy(&scope->constant_globals);
 
     DA_FREE(&scope->code);
+    DA_FREE(&scope->locals);
+    DA_FREE(&scope->captures);
     ht_destroy(&scope->call_locations);
 
     KOKOS_FREE(scope);
@@ -6,12 +6,20 @@
 #include "macro.h"
 #include "string-store.h"
 
+/// Names of the variables living in the slots of a frame, the index of a name is its slot
 typedef struct {
-    string_view* items;
+    const kokos_runtime_string_t** items;
     size_t len;
     size_t cap;
 } kokos_variable_list_t;
 
+/// Jump targets, each one is the absolute index of an instruction in the code it belongs to
+typedef struct {
+    size_t** items;
+    size_t len;
+    size_t cap;
+} kokos_label_list_t;
+
 struct scope;
 
 typedef struct {
@@ -22,13 +30,38 @@ typedef struct {
 
 typedef struct scope {
     kokos_string_store_t* string_store;
+    // owned by the root scope, like the string store
+    kokos_constant_pool_t* constants;
+    // the labels the jumps of the scope's code and of its derived scopes' code refer to, owned by
+    // the root scope too
+    kokos_label_list_t* labels;
     kokos_code_t code;
     hash_table call_locations;
     hash_table procs;
     hash_table macros;
+    // the globals bound to a constant by the top level, to a `kokos_value_t` the scope owns. The
+    // compiler only uses the ones of the root scope
+    hash_table constant_globals;
     kokos_vm_t* macro_vm;
     kokos_scope_list_t derived;
 
+    kokos_variable_list_t locals;
+    // the most slots that were in use at once, which is how many the frame has to allocate
+    size_t locals_count;
+    // the slot of the rest parameter of the scope's procedure, SIZE_MAX if it has none. It is
+    // loaded with `I_LOAD_REST`
+    size_t rest_slot;
+    // the local variables of the enclosing scopes the scope's procedure uses, in the order it first
+    // used them. A closure of the procedure puts their values in its last slots
+    kokos_variable_list_t captures;
+    // whether the code can use the local variables of the enclosing scopes, which is only the case
+    // for the code of a procedure
+    bool can_capture;
+    // the number of instructions that were given an inline cache, plus the unused entry 0. Only
+    // the one of the root scope is used, every vm running its code numbers the caches with it, so
+    // an instruction has the same index in all of them
+    size_t call_caches_count;
+
     struct scope* parent;
 } kokos_scope_t;
 
@@ -38,6 +71,22 @@ void kokos_scope_destroy(kokos_scope_t*);
 
 kokos_macro_t* kokos_scope_get_macro(kokos_scope_t* scope, string_view name);
 
+/// Allocates a label for a jump of the scope's code, it is freed with the root scope
+size_t* kokos_scope_add_label(kokos_scope_t* scope);
+
+/// Binds `name` to the next free slot of the scope's frame and returns that slot
+size_t kokos_scope_add_local(kokos_scope_t* scope, const kokos_runtime_string_t* name);
+/// Finds the slot of the innermost binding of `name` in the scope's frame
+bool kokos_scope_find_local(const kokos_scope_t* scope, const kokos_runtime_string_t* name,
+    size_t* slot);
+/// Returns the index of `name` among the variables captured by the scope, capturing it if it is not
+/// yet
+size_t kokos_scope_add_capture(kokos_scope_t* scope, const kokos_runtime_string_t* name);
+/// Unbinds every local bound after the first `len` ones, e.g. when leaving a `let`
+void kokos_scope_truncate_locals(kokos_scope_t* scope, size_t len);
+/// Whether variables defined in this scope are globals rather than frame slots
+bool kokos_scope_is_global(const kokos_scope_t* scope);
+
 void kokos_scope_dump(const kokos_scope_t* scope);
 
 #endif // SCOPE_H_
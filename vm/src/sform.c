@@ -12,24 +12,33 @@
 KOKOS_DEFINE_SFORM(lambda, {
     VERIFY_ARGS_COUNT(lambda, 2);
     kokos_scope_t* lambda_scope = kokos_scope_derived(scope);
+    lambda_scope->can_capture = true;
 
-    kokos_runtime_proc_t* proc = KOKOS_ZALLOC(sizeof(kokos_runtime_proc_t));
-    proc->type = PROC_KOKOS;
+    kokos_runtime_proc_t* proc = kokos_runtime_proc_new(PROC_KOKOS);
 
     TRY(kokos_expr_to_params(&args.items[0], &proc->kokos.params, scope));
+    bind_params(lambda_scope, &proc->kokos.params);
 
     TRY(kokos_expr_compile(&args.items[1], lambda_scope));
 
-    proc->kokos.code = lambda_scope->code;
+    place_captures(lambda_scope);
 
     SET_SCOPE(lambda_scope);
 
     RET();
 
+    mark_tail_calls(&lambda_scope->code);
+    kokos_optimize(&lambda_scope->code, opt_level);
+
+    proc->kokos.code = lambda_scope->code;
+    proc->kokos.locals_count = lambda_scope->locals_count;
+    proc->kokos.captures_count = lambda_scope->captures.len;
+    proc->kokos.max_depth = kokos_code_max_depth(&proc->kokos.code);
+
     SET_SCOPE(scope);
 
     /* DA_ADD(&proc->kokos.code, INSTR_PUSH(TO_PROC(proc).as_int)); */
-    PUSH(TO_PROC(proc));
+    push_proc(scope, lambda_scope, proc);
 })
 
 KOKOS_DEFINE_SFORM(var, {
@@ -41,7 +50,7 @@ KOKOS_DEFINE_SFORM(var, {
 
     kokos_runtime_string_t* name
         = (void*)kokos_string_store_add_sv(scope->string_store, args.items[0].token.value);
-    ADD_LOCAL(name);
+    bind_variable(scope, name);
 })
 
 KOKOS_DEFINE_SFORM(proc, {
@@ -52,30 +61,39 @@ KOKOS_DEFINE_SFORM(proc, {
     VERIFY_TYPE(&args.items[0], EXPR_IDENT);
 
     kokos_scope_t* lambda_scope = kokos_scope_derived(scope);
+    lambda_scope->can_capture = true;
 
-    kokos_runtime_proc_t* proc = KOKOS_ZALLOC(sizeof(kokos_runtime_proc_t));
-    proc->type = PROC_KOKOS;
+    kokos_runtime_proc_t* proc = kokos_runtime_proc_new(PROC_KOKOS);
 
     TRY(kokos_expr_to_params(&args.items[1], &proc->kokos.params, scope));
+    bind_params(lambda_scope, &proc->kokos.params);
 
     for (size_t i = 2; i < args.len; i++) {
         TRY(kokos_expr_compile(&args.items[i], lambda_scope));
     }
 
+    place_captures(lambda_scope);
+
     SET_SCOPE(lambda_scope);
 
     RET();
 
+    mark_tail_calls(&lambda_scope->code);
+    kokos_optimize(&lambda_scope->code, opt_level);
+
     proc->kokos.code = lambda_scope->code;
+    proc->kokos.locals_count = lambda_scope->locals_count;
+    proc->kokos.captures_count = lambda_scope->captures.len;
+    proc->kokos.max_depth = kokos_code_max_depth(&proc->kokos.code);
 
     SET_SCOPE(scope);
 
     /* DA_ADD(&proc->kokos.code, INSTR_PUSH(TO_PROC(proc).as_int)); */
-    PUSH(TO_PROC(proc));
+    push_proc(scope, lambda_scope, proc);
 
     kokos_runtime_string_t* name
         = (void*)kokos_string_store_add_sv(scope->string_store, args.items[0].token.value);
-    ADD_LOCAL(name);
+    bind_variable(scope, name);
 
     ht_add(&scope->procs, name, proc);
 })
@@ -99,6 +117,7 @@ KOKOS_DEFINE_SFORM(macro, {
     TRY(kokos_expr_to_params(params_expr, &params, scope));
 
     kokos_scope_t* macro_scope = kokos_scope_derived(scope);
+    bind_params(macro_scope, &params);
 
     // Add the macro before the body compilation to allow recursion
     kokos_macro_t* macro = KOKOS_ALLOC(sizeof(kokos_macro_t));
@@ -113,15 +132,19 @@ KOKOS_DEFINE_SFORM(macro, {
 
     SET_SCOPE(macro_scope);
     RET();
+    kokos_optimize(&macro_scope->code, opt_level);
 
     macro->instructions = macro_scope->code;
+    macro->locals_count = macro_scope->locals_count;
 })
 
 KOKOS_DEFINE_SFORM(let, {
     VERIFY_TYPE(&args.items[0], EXPR_LIST);
     kokos_list_t vars = args.items[0].list;
 
-    PUSH_SCOPE(vars.len / 2);
+    // the bindings are resolved to slots of the enclosing frame at compile time, so leaving
+    // the `let` just makes the names invisible again
+    size_t outer_locals = scope->locals.len;
 
     for (size_t i = 0; i < vars.len; i += 2) {
         const kokos_expr_t* key = &vars.items[i];
@@ -132,7 +155,7 @@ KOKOS_DEFINE_SFORM(let, {
 
         kokos_runtime_string_t* var_name
             = (void*)kokos_string_store_add_sv(scope->string_store, key->token.value);
-        ADD_LOCAL(var_name);
+        STORE_SLOT(kokos_scope_add_local(scope, var_name));
     }
 
     // compile body with the new bindings
@@ -140,7 +163,7 @@ KOKOS_DEFINE_SFORM(let, {
         TRY(kokos_expr_compile(&args.items[i + 1], scope));
     }
 
-    POP_SCOPE();
+    kokos_scope_truncate_locals(scope, outer_locals);
 })
 
 KOKOS_DEFINE_SFORM(plus, {
@@ -165,6 +188,15 @@ KOKOS_DEFINE_SFORM(div, {
 
 KOKOS_DEFINE_SFORM(if, {
     VERIFY_ARGS_COUNT(if, 3);
+
+    // only the arm a constant test picks is compiled
+    kokos_value_t test;
+    if (args.len == 3 && fold_constant(&args.items[0], scope, &test)) {
+        bool truthy = !IS_FALSE(test) && !IS_NIL(test);
+        TRY(kokos_expr_compile(&args.items[truthy ? 1 : 2], scope));
+        return true;
+    }
+
     TRY(kokos_expr_compile(&args.items[0], scope));
 
     kokos_label_t alt_label = LABEL();
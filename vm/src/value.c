@@ -44,29 +44,15 @@ void kokos_value_print(kokos_value_t value)
 
         size_t printed_count = 0;
         printf("{");
-        for (size_t i = 0; i < table.cap; i++) {
-            ht_bucket* bucket = table.buckets[i];
-            if (!bucket) {
-                continue;
-            }
-
-            for (size_t j = 0; j < bucket->len; j++) {
-                ht_kv_pair kv = bucket->items[j];
-                kokos_value_t key = TO_VALUE((uint64_t)kv.key);
-                kokos_value_t value = TO_VALUE((uint64_t)kv.value);
-
-                kokos_value_print(key);
-                printf(" ");
-                kokos_value_print(value);
-                if (j != bucket->len - 1) {
-                    printf(" ");
-                }
-            }
+        HT_ITER(table, {
+            kokos_value_print(TO_VALUE((uint64_t)kv.key));
+            printf(" ");
+            kokos_value_print(TO_VALUE((uint64_t)kv.value));
 
             if (++printed_count != table.len) {
                 printf(" ");
             }
-        }
+        });
         printf("}");
         break;
     }
@@ -91,8 +77,9 @@ void kokos_value_print(kokos_value_t value)
     case PROC_TAG: {
         kokos_runtime_proc_t* proc = GET_PTR(value);
         switch (proc->type) {
-        case PROC_KOKOS:  printf("<kokos proc>"); break;
-        case PROC_NATIVE: printf("<native proc at address %p>", proc->native); break;
+        case PROC_KOKOS:   printf("<kokos proc>"); break;
+        case PROC_NATIVE:  printf("<native proc at address %p>", proc->native); break;
+        case PROC_CLOSURE: printf("<kokos closure>"); break;
         }
         break;
     }
@@ -108,7 +108,8 @@ ENUMERATE_TAGGED_TYPES
 
 #define TO_PTR(val) ((void*)(val).as_int)
 
-#define TO_INT(i) ((uint64_t)(i) | INT_BITS)
+// the 32 bit value is zero extended, sign extending a negative one would overwrite the tag
+#define TO_INT(i) ((uint64_t)(uint32_t)(i) | INT_BITS)
 #define GET_INT(val) ((int32_t)((val).as_int & ~INT_BITS))
 
 #define GET_PTR_INT(i) ((i) & 0x0000FFFFFFFFFFFF)
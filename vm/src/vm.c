@@ -13,30 +13,13 @@
 #include <stdio.h>
 #include <string.h>
 
-static bool kokos_vm_exec_cur(kokos_vm_t* vm);
-
-static kokos_frame_t* alloc_frame(
-    size_t ret_location, size_t locals_count, kokos_code_t instructions, kokos_env_t* parent_env)
-{
-    kokos_frame_t* frame = KOKOS_ZALLOC(sizeof(kokos_frame_t));
-    frame->ret_location = ret_location;
-    frame->env = kokos_env_create(parent_env, locals_count);
-    frame->instructions = instructions;
-    return frame;
-}
-
 static kokos_frame_t* current_frame(kokos_vm_t* vm)
 {
     if (vm->frames.sp == 0) {
         KOKOS_VERIFY(0);
     }
 
-    return STACK_PEEK(&vm->frames);
-}
-
-static kokos_instruction_t current_instruction(const kokos_vm_t* vm)
-{
-    return STACK_PEEK(&vm->frames)->instructions.items[vm->ip];
+    return &STACK_PEEK(&vm->frames);
 }
 
 static bool kokos_value_to_bool(kokos_value_t value)
@@ -54,43 +37,46 @@ static int cmp_ints(int32_t lhs, int32_t rhs)
     return lhs < rhs ? -1 : 1;
 }
 
-static bool kokos_cmp_values(kokos_vm_t* vm, kokos_value_t lhs, kokos_value_t rhs)
+// only for doubles that are not the same bits, which compare as equal
+static int cmp_doubles(kokos_value_t lhs, kokos_value_t rhs)
 {
-    kokos_frame_t* frame = current_frame(vm);
+    return lhs.as_double < rhs.as_double ? -1 : 1;
+}
 
+static bool kokos_cmp_values(kokos_vm_t* vm, kokos_value_t lhs, kokos_value_t rhs)
+{
     if (lhs.as_int == rhs.as_int) {
-        STACK_PUSH(&frame->stack, TO_VALUE(0));
+        STACK_PUSH(&vm->stack, TO_VALUE(0));
         return true;
     }
 
-    uint16_t ltag = VALUE_TAG(lhs);
-    uint16_t rtag = VALUE_TAG(rhs);
+    // the high bits of a double are part of the number, not a tag
+    uint16_t ltag = CHECKED_VALUE_TAG(lhs);
+    uint16_t rtag = CHECKED_VALUE_TAG(rhs);
 
     // is there a better way to do this?
     if (ltag != rtag) {
-        STACK_PUSH(&frame->stack, TO_VALUE(-1));
+        STACK_PUSH(&vm->stack, TO_VALUE(-1));
         return true;
     }
 
     if (ltag == INT_TAG) {
         int v = cmp_ints(GET_INT(lhs), GET_INT(rhs));
-        STACK_PUSH(&frame->stack, TO_VALUE(v));
+        STACK_PUSH(&vm->stack, TO_VALUE(v));
         return true;
     }
 
     CHECK_DOUBLE(lhs);
     CHECK_DOUBLE(rhs);
 
-    uint64_t res = lhs.as_double < rhs.as_double ? -1 : 1;
-    STACK_PUSH(&current_frame(vm)->stack, TO_VALUE(res));
+    uint64_t res = cmp_doubles(lhs, rhs);
+    STACK_PUSH(&vm->stack, TO_VALUE(res));
 
     return true;
 }
 
-kokos_value_t kokos_alloc_value(kokos_vm_t* vm, uint64_t params)
+static kokos_value_t kokos_alloc_value(kokos_vm_t* vm, uint64_t params)
 {
-    kokos_frame_t* frame = current_frame(vm);
-
     switch (GET_TAG(params)) {
     case VECTOR_TAG: {
         uint32_t count = params & INSTR_ALLOC_ARG_MASK;
@@ -99,7 +85,8 @@ kokos_value_t kokos_alloc_value(kokos_vm_t* vm, uint64_t params)
 
         for (size_t i = 0; i < count; i++) {
             kokos_value_t value;
-            STACK_POP(&frame->stack, &value);
+            STACK_POP(&vm->stack, &value);
+            kokos_gc_check_store(&vm->gc, vec, value);
             DA_ADD(vec, value);
         }
 
@@ -111,8 +98,10 @@ kokos_value_t kokos_alloc_value(kokos_vm_t* vm, uint64_t params)
 
         for (size_t i = 0; i < count; i++) {
             kokos_value_t value, key;
-            STACK_POP(&frame->stack, &value);
-            STACK_POP(&frame->stack, &key);
+            STACK_POP(&vm->stack, &value);
+            STACK_POP(&vm->stack, &key);
+            kokos_gc_check_store(&vm->gc, map, key);
+            kokos_gc_check_store(&vm->gc, map, value);
             kokos_runtime_map_add(map, key, value);
         }
 
@@ -124,12 +113,30 @@ kokos_value_t kokos_alloc_value(kokos_vm_t* vm, uint64_t params)
 
         for (size_t i = 0; i < count; i++) {
             kokos_value_t item;
-            STACK_POP(&frame->stack, &item);
+            STACK_POP(&vm->stack, &item);
+            kokos_gc_check_store(&vm->gc, list, item);
             list->items[i] = item;
         }
 
         return TO_LIST(list);
     }
+    case PROC_TAG: {
+        uint32_t count = params & INSTR_ALLOC_ARG_MASK;
+        kokos_runtime_proc_t* closure = kokos_vm_gc_alloc(vm, PROC_TAG, count);
+
+        // the procedure is on top of the values it captures, which were pushed last to first
+        kokos_value_t proc;
+        STACK_POP(&vm->stack, &proc);
+        closure->closure.proc = GET_PROC(proc);
+
+        kokos_value_t* values = kokos_closure_values(closure);
+        for (size_t i = 0; i < count; i++) {
+            STACK_POP(&vm->stack, &values[i]);
+            kokos_gc_check_store(&vm->gc, closure, values[i]);
+        }
+
+        return TO_PROC(closure);
+    }
     default: {
         char buf[128] = { 0 };
         sprintf(buf, "allocation of type with tag 0x%lx not implemented", GET_TAG(params));
@@ -138,38 +145,77 @@ kokos_value_t kokos_alloc_value(kokos_vm_t* vm, uint64_t params)
     }
 }
 
-static kokos_frame_t* kokos_make_frame(kokos_vm_t* vm, const kokos_runtime_proc_t* proc,
-    size_t ret_location, kokos_token_t where, kokos_env_t* parent_env)
+/// Makes room for `len` values on the value stack, which moves it if it has to grow
+static void kokos_vm_reserve_stack(kokos_vm_t* vm, size_t len)
 {
-    // if it native, we fucked up
-    KOKOS_ASSERT(proc->type == PROC_KOKOS);
+    if (len <= vm->stack.cap) {
+        return;
+    }
 
-    size_t locals_count = kokos_runtime_proc_locals_count(proc) || 1;
+    size_t cap = vm->stack.cap == 0 ? VALUE_STACK_INITIAL_CAP : vm->stack.cap;
+    while (cap < len) {
+        cap *= 2;
+    }
 
-    if (vm->frames.sp >= vm->frames.cap) {
-        kokos_frame_t* new_frame
-            = alloc_frame(ret_location, locals_count, proc->kokos.code, parent_env);
+    vm->stack.data = KOKOS_REALLOC(vm->stack.data, cap * sizeof(kokos_value_t));
+    vm->stack.cap = cap;
+}
 
-        new_frame->where = where;
-        STACK_PUSH(&vm->frames, new_frame);
-        vm->frames.cap++;
+/// Pushes a frame for `code` whose slots start at `base` of the value stack, with room for
+/// `max_depth` operands above them. The slots are left as they are, and the stack pointer at the
+/// base
+static kokos_frame_t* kokos_vm_push_frame(kokos_vm_t* vm, size_t base, size_t locals_count,
+    size_t max_depth, size_t ret_location, kokos_code_t code)
+{
+    if (UNLIKELY(vm->frames.sp == MAX_CALL_DEPTH)) {
+        kokos_vm_ex_custom_printf(vm, "call stack overflow");
+        return NULL;
+    }
 
-        return new_frame;
+    if (vm->frames.sp == vm->frames.cap) {
+        vm->frames.cap = vm->frames.cap == 0 ? FRAME_STACK_INITIAL_CAP : vm->frames.cap * 2;
+        vm->frames.data = KOKOS_REALLOC(vm->frames.data, vm->frames.cap * sizeof(kokos_frame_t));
     }
 
-    // reuse the old frame if we have enough capacity
-    kokos_frame_t* old_frame = vm->frames.data[vm->frames.sp];
-    old_frame->stack.sp = 0;
-    old_frame->where = where;
-    old_frame->ret_location = ret_location;
+    kokos_vm_reserve_stack(vm, base + locals_count + max_depth);
+
+    kokos_frame_t* frame = &vm->frames.data[vm->frames.sp++];
+    *frame = (kokos_frame_t) {
+        .base = base,
+        .locals_count = locals_count,
+        .ret_location = ret_location,
+        .instructions = code,
+    };
 
-    kokos_env_destroy(old_frame->env);
-    old_frame->env = kokos_env_create(parent_env, locals_count);
-    old_frame->instructions = proc->kokos.code;
+    return frame;
+}
 
-    STACK_PUSH(&vm->frames, old_frame);
+/// Pops the current frame and pushes what it returned, the top of its operands or nil if it has
+/// none, to the operands of the frame below
+static void kokos_vm_pop_frame(kokos_vm_t* vm)
+{
+    kokos_frame_t* frame = current_frame(vm);
+    bool returned = vm->stack.sp != frame->base + frame->locals_count;
+    kokos_value_t ret_value = returned ? STACK_PEEK(&vm->stack) : KOKOS_NIL;
 
-    return old_frame;
+    vm->stack.sp = frame->base - frame->rest_count;
+    vm->frames.sp--;
+    STACK_PUSH(&vm->stack, ret_value);
+}
+
+/// Sets up the bottom frame to run `code` on an empty stack, dropping any frames left by a throw
+static void kokos_vm_reset_frames(kokos_vm_t* vm, kokos_code_t code, size_t locals_count)
+{
+    vm->frames.sp = 0;
+    vm->stack.sp = 0;
+
+    size_t max_depth = kokos_code_max_depth(&code);
+    kokos_vm_push_frame(vm, 0, locals_count, max_depth, code.len, code);
+
+    // clear the slots so the gc never sees values left over from a previous run
+    for (size_t i = 0; i < locals_count; i++) {
+        STACK_PUSH(&vm->stack, KOKOS_NIL);
+    }
 }
 
 static kokos_value_t nan = TO_VALUE(NAN_BITS);
@@ -177,14 +223,12 @@ static kokos_value_t nan = TO_VALUE(NAN_BITS);
 // this looks sooo ugly
 static inline bool vm_exec_add(kokos_vm_t* vm, uint64_t count)
 {
-    kokos_frame_t* frame = current_frame(vm);
-
     int32_t acc = 0;
     double dacc = nan.as_double;
 
     for (size_t i = 0; i < count; i++) {
         kokos_value_t val;
-        STACK_POP(&frame->stack, &val);
+        STACK_POP(&vm->stack, &val);
 
         if (VALUE_TAG(val) == INT_TAG) {
             int32_t iv = GET_INT(val);
@@ -208,9 +252,9 @@ static inline bool vm_exec_add(kokos_vm_t* vm, uint64_t count)
     }
 
     if (IS_NAN_DOUBLE(dacc)) {
-        STACK_PUSH(&frame->stack, TO_VALUE(TO_INT(acc)));
+        STACK_PUSH(&vm->stack, TO_VALUE(TO_INT(acc)));
     } else {
-        STACK_PUSH(&frame->stack, TO_VALUE(dacc));
+        STACK_PUSH(&vm->stack, TO_VALUE(dacc));
     }
 
     return true;
@@ -218,14 +262,12 @@ static inline bool vm_exec_add(kokos_vm_t* vm, uint64_t count)
 
 static inline bool vm_exec_sub(kokos_vm_t* vm, uint64_t count)
 {
-    kokos_frame_t* frame = current_frame(vm);
-
     int32_t acc = 0;
     double dacc = nan.as_double;
 
     for (size_t i = 0; i < count - 1; i++) {
         kokos_value_t val;
-        STACK_POP(&frame->stack, &val);
+        STACK_POP(&vm->stack, &val);
 
         if (VALUE_TAG(val) == INT_TAG) {
             int32_t i = GET_INT(val);
@@ -249,16 +291,16 @@ static inline bool vm_exec_sub(kokos_vm_t* vm, uint64_t count)
     }
 
     kokos_value_t val;
-    STACK_POP(&frame->stack, &val);
+    STACK_POP(&vm->stack, &val);
     if (VALUE_TAG(val) == INT_TAG) {
         if (IS_NAN_DOUBLE(dacc)) {
             acc += GET_INT(val);
-            STACK_PUSH(&frame->stack, TO_VALUE(TO_INT(acc)));
+            STACK_PUSH(&vm->stack, TO_VALUE(TO_INT(acc)));
             goto success;
         }
 
         dacc += (double)GET_INT(val);
-        STACK_PUSH(&frame->stack, TO_VALUE(dacc));
+        STACK_PUSH(&vm->stack, TO_VALUE(dacc));
         goto success;
     }
 
@@ -266,11 +308,11 @@ static inline bool vm_exec_sub(kokos_vm_t* vm, uint64_t count)
 
     if (IS_NAN_DOUBLE(dacc)) {
         dacc = (double)acc + val.as_double;
-        STACK_PUSH(&frame->stack, TO_VALUE(dacc));
+        STACK_PUSH(&vm->stack, TO_VALUE(dacc));
         goto success;
     }
 
-    STACK_PUSH(&frame->stack, TO_VALUE(dacc + val.as_double));
+    STACK_PUSH(&vm->stack, TO_VALUE(dacc + val.as_double));
 
 success:
     return true;
@@ -278,14 +320,12 @@ success:
 
 static inline bool vm_exec_mul(kokos_vm_t* vm, uint64_t count)
 {
-    kokos_frame_t* frame = current_frame(vm);
-
     int32_t acc = 1;
     double dacc = nan.as_double;
 
     for (size_t i = 0; i < count; i++) {
         kokos_value_t val;
-        STACK_POP(&frame->stack, &val);
+        STACK_POP(&vm->stack, &val);
 
         if (VALUE_TAG(val) == INT_TAG) {
             int32_t i = GET_INT(val);
@@ -309,9 +349,9 @@ static inline bool vm_exec_mul(kokos_vm_t* vm, uint64_t count)
     }
 
     if (IS_NAN_DOUBLE(dacc)) {
-        STACK_PUSH(&frame->stack, TO_VALUE(TO_INT(acc)));
+        STACK_PUSH(&vm->stack, TO_VALUE(TO_INT(acc)));
     } else {
-        STACK_PUSH(&frame->stack, TO_VALUE(dacc));
+        STACK_PUSH(&vm->stack, TO_VALUE(dacc));
     }
 
     return true;
@@ -319,10 +359,8 @@ static inline bool vm_exec_mul(kokos_vm_t* vm, uint64_t count)
 
 static inline bool vm_exec_div(kokos_vm_t* vm, uint64_t count)
 {
-    kokos_frame_t* frame = current_frame(vm);
-
     if (count == 0) {
-        STACK_PUSH(&frame->stack, TO_VALUE(NAN_BITS));
+        STACK_PUSH(&vm->stack, TO_VALUE(NAN_BITS));
         return true;
     }
 
@@ -331,7 +369,7 @@ static inline bool vm_exec_div(kokos_vm_t* vm, uint64_t count)
 
     for (size_t i = 0; i < count - 1; i++) {
         kokos_value_t val;
-        STACK_POP(&frame->stack, &val);
+        STACK_POP(&vm->stack, &val);
 
         if (VALUE_TAG(val) == INT_TAG) {
             int32_t i = GET_INT(val);
@@ -354,16 +392,16 @@ static inline bool vm_exec_div(kokos_vm_t* vm, uint64_t count)
     }
 
     kokos_value_t divident;
-    STACK_POP(&frame->stack, &divident);
+    STACK_POP(&vm->stack, &divident);
     if (VALUE_TAG(divident) == INT_TAG) {
         if (IS_NAN_DOUBLE(d_divisor)) {
             int64_t res = TO_INT(GET_INT(divident) / divisor);
-            STACK_PUSH(&frame->stack, TO_VALUE(res));
+            STACK_PUSH(&vm->stack, TO_VALUE(res));
             goto success;
         }
 
         double res = (double)GET_INT(divident) / d_divisor;
-        STACK_PUSH(&frame->stack, TO_VALUE(res));
+        STACK_PUSH(&vm->stack, TO_VALUE(res));
         goto success;
     }
 
@@ -371,11 +409,11 @@ static inline bool vm_exec_div(kokos_vm_t* vm, uint64_t count)
 
     if (IS_NAN_DOUBLE(d_divisor)) {
         double res = divident.as_double / (double)divisor;
-        STACK_PUSH(&frame->stack, TO_VALUE(res));
+        STACK_PUSH(&vm->stack, TO_VALUE(res));
         goto success;
     }
 
-    STACK_PUSH(&frame->stack, TO_VALUE(divident.as_double / d_divisor));
+    STACK_PUSH(&vm->stack, TO_VALUE(divident.as_double / d_divisor));
 
 success:
     return true;
@@ -389,252 +427,928 @@ static kokos_token_t get_call_location(kokos_vm_t* vm, size_t ip)
     return *tok;
 }
 
-static kokos_frame_t* bottom_frame(kokos_vm_t* vm)
+/// Checks the number of arguments of a call to `proc`, and gets how many of them are rest
+/// arguments
+static inline bool kokos_vm_check_arity(
+    kokos_vm_t* vm, const kokos_runtime_proc_t* proc, uint16_t nargs, size_t* rest_count)
 {
-    KOKOS_VERIFY(vm->frames.sp != 0);
-    return vm->frames.data[0];
-}
+    const kokos_params_t* params = &proc->kokos.params;
 
-static bool kokos_vm_exec_cur(kokos_vm_t* vm)
-{
-    kokos_frame_t* frame = current_frame(vm);
-    kokos_instruction_t instruction = current_instruction(vm);
+    if (!params->variadic) {
+        CHECK_ARITY(params->len, nargs);
+        *rest_count = 0;
+        return true;
+    }
 
-    kokos_instruction_dump(instruction);
-    printf("\n");
+    size_t reg_count = params->len - 1;
 
-    switch (instruction.type) {
-    case I_PUSH: {
-        STACK_PUSH(&frame->stack, TO_VALUE(instruction.operand));
-        vm->ip++;
-        break;
+    if (nargs < reg_count) {
+        kokos_vm_ex_set_arity_mismatch(vm, reg_count, nargs);
+        return false;
     }
-    case I_POP: {
-        kokos_value_t foo;
-        STACK_POP(&frame->stack, &foo);
-        break;
+
+    *rest_count = nargs - reg_count;
+    return true;
+}
+
+/// Clears the slots of `frame` past the first `bound` ones, which hold the arguments, so the gc
+/// never sees values left over from a previous call. The rest parameter is left nil, which is how
+/// `I_LOAD_REST` knows it was not loaded yet
+static inline void kokos_vm_clear_slots(kokos_vm_t* vm, kokos_frame_t* frame, size_t bound)
+{
+    kokos_value_t* slots = vm->stack.data + frame->base;
+    for (size_t i = bound; i < frame->locals_count; i++) {
+        slots[i] = KOKOS_NIL;
     }
-    case I_ADD: {
-        TRY(vm_exec_add(vm, instruction.operand));
-        vm->ip++;
-        break;
+
+    vm->stack.sp = frame->base + frame->locals_count;
+}
+
+/// Gets the procedure whose code runs when `callee` is called
+static inline kokos_runtime_proc_t* kokos_vm_callee_proc(kokos_runtime_proc_t* callee)
+{
+    return callee->type == PROC_CLOSURE ? callee->closure.proc : callee;
+}
+
+/// Copies the values captured by `callee`, if it is a closure, to the last slots of `frame`, which
+/// is where its procedure loads them from
+static inline void kokos_vm_bind_captures(
+    kokos_vm_t* vm, const kokos_frame_t* frame, const kokos_runtime_proc_t* callee)
+{
+    if (callee->type != PROC_CLOSURE) {
+        return;
     }
-    case I_SUB: {
-        TRY(vm_exec_sub(vm, instruction.operand));
-        vm->ip++;
-        break;
+
+    size_t len = callee->closure.len;
+    kokos_value_t* slots = vm->stack.data + frame->base + frame->locals_count - len;
+    memcpy(slots, kokos_closure_values(callee), len * sizeof(kokos_value_t));
+}
+
+/// Pushes a new frame for `callee` whose first slots are the arguments on top of the caller's
+/// operands. The rest arguments were pushed first, so the frame starts right above them, see
+/// `bind_params` of the compiler. Returns the procedure that runs in the frame, or NULL if the call
+/// threw
+static inline kokos_runtime_proc_t* kokos_vm_enter_proc(
+    kokos_vm_t* vm, kokos_runtime_proc_t* callee, uint16_t nargs, size_t ret_location)
+{
+    kokos_runtime_proc_t* proc = kokos_vm_callee_proc(callee);
+    // if it native, we fucked up
+    KOKOS_ASSERT(proc->type == PROC_KOKOS);
+
+    size_t rest_count;
+    TRY(kokos_vm_check_arity(vm, proc, nargs, &rest_count));
+
+    const kokos_proc_t* kproc = &proc->kokos;
+    size_t bound = nargs - rest_count;
+    kokos_frame_t* frame = kokos_vm_push_frame(vm, vm->stack.sp - bound, kproc->locals_count,
+        kproc->max_depth, ret_location, kproc->code);
+    TRY(frame);
+
+    frame->rest_count = rest_count;
+    kokos_vm_clear_slots(vm, frame, bound);
+    kokos_vm_bind_captures(vm, frame, callee);
+    return proc;
+}
+
+/// Replaces the procedure running in the current frame with the one of `callee`, keeping the
+/// frame's return location. Returns that procedure, or NULL if the call threw
+static kokos_runtime_proc_t* kokos_vm_replace_proc(
+    kokos_vm_t* vm, kokos_runtime_proc_t* callee, uint16_t nargs)
+{
+    kokos_runtime_proc_t* proc = kokos_vm_callee_proc(callee);
+    size_t rest_count;
+    TRY(kokos_vm_check_arity(vm, proc, nargs, &rest_count));
+
+    // the arguments are above everything the old procedure left on the stack, they take the place
+    // of its rest arguments and its slots
+    kokos_frame_t* frame = current_frame(vm);
+    size_t start = frame->base - frame->rest_count;
+    kokos_value_t* args = vm->stack.data + vm->stack.sp - nargs;
+    memmove(vm->stack.data + start, args, nargs * sizeof(kokos_value_t));
+
+    const kokos_proc_t* kproc = &proc->kokos;
+    frame->base = start + rest_count;
+    frame->rest_count = rest_count;
+    frame->locals_count = kproc->locals_count;
+    frame->instructions = kproc->code;
+    kokos_vm_reserve_stack(vm, frame->base + kproc->locals_count + kproc->max_depth);
+
+    kokos_vm_clear_slots(vm, frame, nargs - rest_count);
+    kokos_vm_bind_captures(vm, frame, callee);
+    return proc;
+}
+
+/// Pushes the rest parameter in `slot` of the current frame. The first time it is loaded, it
+/// becomes a vector of the rest arguments below the frame
+static bool kokos_vm_push_rest(kokos_vm_t* vm, uint64_t slot)
+{
+    kokos_frame_t* frame = current_frame(vm);
+    kokos_value_t rest = vm->stack.data[frame->base + slot];
+    if (IS_NIL(rest)) {
+        kokos_runtime_vector_t* vec = kokos_vm_gc_alloc(vm, VECTOR_TAG, frame->rest_count);
+
+        // the arguments are read after the allocation, which can move what they point to. They
+        // were pushed last to first, so the first one is right below the frame
+        for (size_t i = 0; i < frame->rest_count; i++) {
+            kokos_value_t arg = vm->stack.data[frame->base - 1 - i];
+            kokos_gc_check_store(&vm->gc, vec, arg);
+            DA_ADD(vec, arg);
+        }
+
+        rest = TO_VECTOR(vec);
+        vm->stack.data[frame->base + slot] = rest;
     }
-    case I_MUL: {
-        TRY(vm_exec_mul(vm, instruction.operand));
-        vm->ip++;
-        break;
+
+    STACK_PUSH(&vm->stack, rest);
+    return true;
+}
+
+static bool kokos_vm_exec(kokos_vm_t* vm, size_t base_frame);
+
+/// Counts a call to the interpreted procedure `proc`, and compiles it to machine code once it gets
+/// hot
+static void kokos_vm_profile_call(kokos_vm_t* vm, kokos_runtime_proc_t* proc)
+{
+    kokos_proc_t* kproc = &proc->kokos;
+    // procedures compiled ahead of time are never counted
+    if (!vm->jit_enabled || kproc->calls > JIT_CALL_THRESHOLD || kproc->jit) {
+        return;
     }
-    case I_DIV: {
-        TRY(vm_exec_div(vm, instruction.operand));
-        vm->ip++;
-        break;
+
+    // the count stops right past the threshold, so the jit only ever gets one try
+    if (++kproc->calls == JIT_CALL_THRESHOLD) {
+        kproc->jit = kokos_jit_compile(kproc);
     }
-    case I_CALL: {
-        uint16_t nargs = instruction.operand >> 48;
-        kokos_runtime_string_t* pname = GET_STRING_INT(instruction.operand);
+}
 
-        kokos_value_t local;
-        if (!kokos_env_lookup(frame->env, pname, &local)) {
-            kokos_vm_ex_set_undefined_variable(vm, pname);
-            return false;
+/// Runs the compiled code `entry` in the current frame until the frame returns and leaves its
+/// return value on top of the frame's operands. Follows the tail calls of compiled code, and
+/// interprets whatever is not compiled
+static bool kokos_vm_run_compiled(kokos_vm_t* vm, kokos_jit_entry_t entry)
+{
+    vm->compiled_depth++;
+
+    // the frames move when calls make them grow, so the frame is looked up every time
+    kokos_jit_status_e status;
+    while ((status = entry(vm, current_frame(vm))) == KOKOS_JIT_TAIL_CALL) {
+        const kokos_runtime_proc_t* proc = vm->registers.tail_callee;
+        if (!proc->kokos.jit) {
+            break;
         }
 
-        CHECK_TYPE(local, PROC_TAG);
+        entry = proc->kokos.jit->entry;
+    }
 
-        kokos_runtime_proc_t* proc = GET_PROC(local);
+    vm->compiled_depth--;
 
-        if (proc->type == PROC_NATIVE) {
-            kokos_value_t ret = KOKOS_NIL;
-            proc->native(vm, nargs, &ret);
-            STACK_PUSH(&frame->stack, ret);
-            vm->ip++;
-            break;
-        }
+    if (status == KOKOS_JIT_TAIL_CALL) {
+        vm->ip = 0;
+        return kokos_vm_exec(vm, vm->frames.sp);
+    }
 
-        kokos_proc_t kokos = proc->kokos;
-        size_t ret_location = vm->ip + 1;
+    return status == KOKOS_JIT_RETURN;
+}
 
-        kokos_frame_t* bot_frame = bottom_frame(vm);
-        kokos_frame_t* new_frame
-            = kokos_make_frame(vm, proc, ret_location, (kokos_token_t) { 0 }, bot_frame->env);
+/// Whether a call runs `proc` as compiled code. Calls of compiled code nest on the C stack, so past
+/// MAX_COMPILED_DEPTH of them everything is interpreted, which only needs room on the value stack
+static bool kokos_vm_runs_compiled(kokos_vm_t* vm, const kokos_runtime_proc_t* proc)
+{
+    return proc->kokos.jit && vm->compiled_depth < MAX_COMPILED_DEPTH;
+}
 
-        if (!kokos.params.variadic) {
-            if (kokos.params.len != nargs) {
-                kokos_vm_ex_set_arity_mismatch(vm, kokos.params.len, nargs);
-                return false;
-            }
+/// Runs `proc`, which was just entered in the current frame, until it returns, see
+/// `kokos_vm_run_compiled`
+static bool kokos_vm_run_frame(kokos_vm_t* vm, const kokos_runtime_proc_t* proc)
+{
+    if (kokos_vm_runs_compiled(vm, proc)) {
+        return kokos_vm_run_compiled(vm, proc->kokos.jit->entry);
+    }
 
-            for (size_t i = 0; i < nargs; i++) {
-                kokos_value_t value;
-                STACK_POP(&frame->stack, &value);
-                kokos_env_add(new_frame->env, proc->kokos.params.names[i], value);
-            }
-        } else {
-            size_t reg_count = kokos.params.len - 1;
+    vm->ip = 0;
+    return kokos_vm_exec(vm, vm->frames.sp);
+}
 
-            if (nargs < reg_count) {
-                kokos_vm_ex_set_arity_mismatch(vm, reg_count, nargs);
-                return false;
-            }
+/// Caches `proc` as what the call by name or `I_IS_CALLEE` `instr` finds with the current globals
+static void kokos_vm_set_call_cache(
+    kokos_vm_t* vm, kokos_instruction_t* instr, kokos_runtime_proc_t* proc)
+{
+    // the gc moves closures, so only the procedures that live forever are cached
+    if (proc->type == PROC_CLOSURE) {
+        return;
+    }
 
-            // push all non-variadic args
-            for (size_t i = 0; i < reg_count; i++) {
-                kokos_value_t value;
-                STACK_POP(&frame->stack, &value);
-                kokos_env_add(new_frame->env, kokos.params.names[i], value);
-            }
+    if (instr->cache == 0) {
+        // the instructions past the last index a cache fits in are just never cached
+        if (vm->root_scope->call_caches_count > UINT32_MAX) {
+            return;
+        }
 
-            size_t var_count = nargs - reg_count;
+        instr->cache = vm->root_scope->call_caches_count++;
+    }
 
-            kokos_runtime_vector_t* variadics = kokos_vm_gc_alloc(vm, VECTOR_TAG, var_count);
+    // another vm running the same code may have given the instruction its index
+    while (vm->call_caches.len <= instr->cache) {
+        DA_ADD(&vm->call_caches, (kokos_call_cache_t) { 0 });
+    }
 
-            for (size_t i = 0; i < var_count; i++) {
-                kokos_value_t value;
-                STACK_POP(&frame->stack, &value);
-                DA_ADD(variadics, value);
-            }
+    vm->call_caches.items[instr->cache]
+        = (kokos_call_cache_t) { .version = vm->globals->version, .proc = proc };
+}
 
-            kokos_env_add(
-                new_frame->env, kokos.params.names[kokos.params.len - 1], TO_VECTOR(variadics));
-        }
+/// Looks up the procedure the call by name `call` calls, and caches it in the call
+static kokos_runtime_proc_t* kokos_vm_fill_call_cache(kokos_vm_t* vm, kokos_instruction_t* call)
+{
+    kokos_runtime_string_t* pname = GET_STRING_INT(call->operand);
+    kokos_value_t callee;
+    if (!kokos_env_lookup(vm->globals, pname, &callee)) {
+        kokos_vm_ex_set_undefined_variable(vm, pname);
+        return NULL;
+    }
 
-        // set this to 0 so it points to the first instruction of the called procedure
-        vm->ip = 0;
+    if (CHECKED_VALUE_TAG(callee) != PROC_TAG) {
+        kokos_vm_ex_set_type_mismatch(vm, PROC_TAG, CHECKED_VALUE_TAG(callee));
+        return NULL;
+    }
 
-        break;
+    kokos_vm_set_call_cache(vm, call, GET_PROC(callee));
+    return GET_PROC(callee);
+}
+
+/// Finds the procedure the call by name `call` calls. It takes a single comparison for as long as
+/// no global is bound after the call first ran, and a lookup of the name otherwise
+static inline kokos_runtime_proc_t* kokos_vm_resolve_global_callee(
+    kokos_vm_t* vm, kokos_instruction_t* call)
+{
+    // entry 0 has the version 0, which no globals ever have
+    kokos_call_cache_list_t* caches = &vm->call_caches;
+    if (call->cache < caches->len && caches->items[call->cache].version == vm->globals->version) {
+        return caches->items[call->cache].proc;
     }
-    case I_RET: {
-        // NOTE: use peek here so we can examine the top-level stack frame
-        // of the vm after it has ran
-        kokos_frame_t* proc_frame = current_frame(vm);
-        vm->ip = proc_frame->ret_location;
 
-        if (vm->frames.sp == 1) {
-            break;
-        }
+    return kokos_vm_fill_call_cache(vm, call);
+}
 
-        kokos_frame_t* _foo;
-        STACK_POP(&vm->frames, &_foo);
+/// Whether the global named by the `I_IS_CALLEE` `instr` is `proc`. Like a call, it takes a single
+/// comparison for as long as no global is bound after it last looked the name up
+static inline bool kokos_vm_is_callee(
+    kokos_vm_t* vm, kokos_instruction_t* instr, kokos_value_t proc)
+{
+    kokos_call_cache_list_t* caches = &vm->call_caches;
+    if (instr->cache < caches->len && caches->items[instr->cache].version == vm->globals->version) {
+        return TO_PROC(caches->items[instr->cache].proc).as_int == proc.as_int;
+    }
 
-        kokos_value_t ret_value
-            = proc_frame->stack.sp == 0 ? TO_VALUE(NIL_BITS) : STACK_PEEK(&proc_frame->stack);
+    kokos_value_t global;
+    if (!kokos_env_lookup(vm->globals, GET_STRING_INT(instr->operand), &global)
+        || CHECKED_VALUE_TAG(global) != PROC_TAG) {
+        return false;
+    }
 
-        STACK_PUSH(&current_frame(vm)->stack, ret_value);
+    kokos_vm_set_call_cache(vm, instr, GET_PROC(global));
+    return global.as_int == proc.as_int;
+}
 
-        break;
+/// Finds the procedure called by the `I_CALL` or `I_TAIL_CALL` `call`, popping it from the stack if
+/// it is not called by name
+static kokos_runtime_proc_t* kokos_vm_resolve_callee(kokos_vm_t* vm, kokos_instruction_t* call)
+{
+    if (GET_STRING_INT(call->operand)) {
+        return kokos_vm_resolve_global_callee(vm, call);
     }
-    case I_ADD_LOCAL: {
-        kokos_runtime_string_t* name = GET_STRING_INT(instruction.operand);
-        kokos_value_t value;
-        STACK_POP(&frame->stack, &value);
-        kokos_env_add(frame->env, name, value);
-        vm->ip++;
-        break;
+
+    kokos_value_t callee;
+    STACK_POP(&vm->stack, &callee);
+
+    if (CHECKED_VALUE_TAG(callee) != PROC_TAG) {
+        kokos_vm_ex_set_type_mismatch(vm, PROC_TAG, CHECKED_VALUE_TAG(callee));
+        return NULL;
     }
-    case I_GET_LOCAL: {
-        kokos_runtime_string_t* name = GET_STRING_INT(instruction.operand);
-        kokos_value_t local;
-        if (!kokos_env_lookup(frame->env, name, &local)) {
+
+    return GET_PROC(callee);
+}
+
+static bool kokos_vm_call_native(kokos_vm_t* vm, const kokos_runtime_proc_t* proc, uint16_t nargs)
+{
+    kokos_value_t ret = KOKOS_NIL;
+    TRY(proc->native(vm, nargs, &ret));
+    STACK_PUSH(&vm->stack, ret);
+    return true;
+}
+
+bool kokos_vm_jit_step(kokos_vm_t* vm, kokos_instruction_type_e type, uint64_t operand)
+{
+    switch (type) {
+    case I_ADD: return vm_exec_add(vm, operand);
+    case I_SUB: return vm_exec_sub(vm, operand);
+    case I_MUL: return vm_exec_mul(vm, operand);
+    case I_DIV: return vm_exec_div(vm, operand);
+    case I_CMP: {
+        kokos_value_t rhs, lhs;
+        STACK_POP(&vm->stack, &rhs);
+        STACK_POP(&vm->stack, &lhs);
+        return kokos_cmp_values(vm, lhs, rhs);
+    }
+    case I_GET_GLOBAL: {
+        kokos_runtime_string_t* name = GET_STRING_INT(operand);
+        kokos_value_t global;
+        if (!kokos_env_lookup(vm->globals, name, &global)) {
             kokos_vm_ex_set_undefined_variable(vm, name);
             return false;
         }
 
-        STACK_PUSH(&frame->stack, local);
-
-        vm->ip++;
-        break;
+        STACK_PUSH(&vm->stack, global);
+        return true;
     }
-    case I_BRANCH: {
-        vm->ip = *(size_t*)instruction.operand;
-        break;
+    case I_ADD_GLOBAL: {
+        kokos_value_t value;
+        STACK_POP(&vm->stack, &value);
+        kokos_env_add(vm->globals, GET_STRING_INT(operand), value);
+        return true;
     }
-    case I_JZ: {
-        kokos_value_t test;
-        STACK_POP(&frame->stack, &test);
-        if (!kokos_value_to_bool(test)) {
-            vm->ip = *(size_t*)instruction.operand;
-            break;
-        }
+    case I_ALLOC: {
+        kokos_value_t value = kokos_alloc_value(vm, operand);
+        STACK_PUSH(&vm->stack, value);
+        return true;
+    }
+    case I_LOAD_REST: return kokos_vm_push_rest(vm, operand);
+    default: {
+        char buf[128] = { 0 };
+        sprintf(buf, "stepping through instruction %s is not implemented",
+            kokos_instruction_type_str(type));
+        KOKOS_TODO(buf);
+    }
+    }
+}
 
-        vm->ip++;
-        break;
+bool kokos_vm_jit_is_callee(kokos_vm_t* vm, kokos_instruction_t* instr, kokos_value_t proc)
+{
+    return kokos_vm_is_callee(vm, instr, proc);
+}
+
+bool kokos_vm_jit_call(kokos_vm_t* vm, kokos_instruction_t* call)
+{
+    uint16_t nargs = call->operand >> 48;
+    kokos_runtime_proc_t* proc = kokos_vm_resolve_callee(vm, call);
+    TRY(proc);
+
+    if (proc->type == PROC_NATIVE) {
+        return kokos_vm_call_native(vm, proc, nargs);
     }
-    case I_JNZ: {
-        kokos_value_t test;
-        STACK_POP(&frame->stack, &test);
-        if (kokos_value_to_bool(test)) {
-            vm->ip += *(size_t*)instruction.operand;
-            break;
-        }
 
-        vm->ip++;
-        break;
+    proc = kokos_vm_enter_proc(vm, proc, nargs, 0);
+    TRY(proc);
+
+    kokos_vm_profile_call(vm, proc);
+    TRY(kokos_vm_run_frame(vm, proc));
+
+    kokos_vm_pop_frame(vm);
+    return true;
+}
+
+kokos_jit_status_e kokos_vm_jit_tail_call(kokos_vm_t* vm, kokos_instruction_t* call)
+{
+    uint16_t nargs = call->operand >> 48;
+    kokos_runtime_proc_t* proc = kokos_vm_resolve_callee(vm, call);
+    if (!proc) {
+        return KOKOS_JIT_THROW;
     }
-    case I_CMP: {
-        kokos_value_t rhs;
-        STACK_POP(&frame->stack, &rhs);
-        kokos_value_t lhs;
-        STACK_POP(&frame->stack, &lhs);
 
-        TRY(kokos_cmp_values(vm, lhs, rhs));
+    if (proc->type == PROC_NATIVE) {
+        return kokos_vm_call_native(vm, proc, nargs) ? KOKOS_JIT_CONTINUE : KOKOS_JIT_THROW;
+    }
 
-        vm->ip++;
-        break;
+    proc = kokos_vm_replace_proc(vm, proc, nargs);
+    if (!proc) {
+        return KOKOS_JIT_THROW;
     }
-    case I_EQ: {
-        kokos_value_t top;
-        STACK_POP(&frame->stack, &top);
-        STACK_PUSH(&frame->stack, TO_BOOL(top.as_int == instruction.operand));
 
-        vm->ip++;
-        break;
+    kokos_vm_profile_call(vm, proc);
+    vm->registers.tail_callee = proc;
+    return KOKOS_JIT_TAIL_CALL;
+}
+
+// The interpreter loop keeps the current frame, its slots, the instruction pointer and the stack
+// pointer in locals.
+// They must be written back with `VM_SYNC` before anything that looks at the vm state from the
+// outside (natives, the gc, exceptions) and re-read with `VM_RELOAD` after the frame changes. Calls
+// can grow the frames and the value stack, which moves them, so the pointers into them are re-read
+// after a call too.
+//
+// Compiled procedures run on the same frames, and return to the loop through the `I_RET` at the end
+// of their code.
+//
+// On GCC and Clang the dispatch is threaded through a table of label addresses, so every handler
+// ends with its own indirect jump. Define KOKOS_VM_NO_COMPUTED_GOTO to use a plain `switch`.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(KOKOS_VM_NO_COMPUTED_GOTO)
+#define KOKOS_VM_COMPUTED_GOTO
+#endif
+
+#ifdef KOKOS_VM_TRACE
+#define VM_TRACE()                                                                                 \
+    do {                                                                                           \
+        kokos_instruction_dump(*ip);                                                               \
+        printf("\n");                                                                              \
+    } while (0)
+#else
+#define VM_TRACE()
+#endif // KOKOS_VM_TRACE
+
+#ifdef KOKOS_VM_COMPUTED_GOTO
+#define VM_CASE(t) L_##t:
+#define VM_DISPATCH()                                                                              \
+    do {                                                                                           \
+        VM_TRACE();                                                                                \
+        goto* dispatch_table[ip->type];                                                            \
+    } while (0)
+#else
+#define VM_CASE(t) case t:
+#define VM_DISPATCH() goto dispatch
+#endif // KOKOS_VM_COMPUTED_GOTO
+
+#define VM_PUSH(v) (*sp++ = (v))
+#define VM_POP() (*--sp)
+#define VM_PEEK() (sp[-1])
+
+#define VM_SYNC()                                                                                  \
+    do {                                                                                           \
+        vm->stack.sp = sp - vm->stack.data;                                                        \
+        vm->ip = ip - frame->instructions.items;                                                   \
+    } while (0)
+
+#define VM_RELOAD_STACK()                                                                          \
+    do {                                                                                           \
+        frame = current_frame(vm);                                                                 \
+        locals = vm->stack.data + frame->base;                                                     \
+        sp = vm->stack.data + vm->stack.sp;                                                        \
+    } while (0)
+
+#define VM_RELOAD()                                                                                \
+    do {                                                                                           \
+        VM_RELOAD_STACK();                                                                         \
+        ip = frame->instructions.items + vm->ip;                                                   \
+    } while (0)
+
+#define VM_THROW()                                                                                 \
+    do {                                                                                           \
+        VM_SYNC();                                                                                 \
+        return false;                                                                              \
+    } while (0)
+
+// run a helper that works on `vm->stack` rather than on the cached stack pointer
+#define VM_SLOW(e)                                                                                 \
+    do {                                                                                           \
+        VM_SYNC();                                                                                 \
+        if (UNLIKELY(!(e))) {                                                                      \
+            return false;                                                                          \
+        }                                                                                          \
+        VM_RELOAD_STACK();                                                                         \
+    } while (0)
+
+#define VM_BOTH_INT(lhs, rhs) (VALUE_TAG((lhs)) == INT_TAG && VALUE_TAG((rhs)) == INT_TAG)
+
+// rewrites the current instruction to `t` and runs it again, see ENUMERATE_QUICKENED_INSTRUCTIONS
+#define VM_QUICKEN(t) (ip->type = (t))
+
+/// Executes instructions starting at `vm->ip` in the current frame, until the frame at depth
+/// `base_frame` returns. That frame is left on the stack with the return value on top
+static bool kokos_vm_exec(kokos_vm_t* vm, size_t base_frame)
+{
+#ifdef KOKOS_VM_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+#define X(t, s) [I_##t] = &&L_I_##t,
+        ENUMERATE_INSTRUCTIONS
+#undef X
+    };
+#endif // KOKOS_VM_COMPUTED_GOTO
+
+    kokos_frame_t* frame;
+    kokos_value_t* locals;
+    // not const, instructions are quickened in place
+    kokos_instruction_t* ip;
+    kokos_value_t* sp;
+
+    VM_RELOAD();
+
+    // there is no bounds check on `ip`, so the code must always end by returning
+    KOKOS_VERIFY(frame->instructions.len != 0
+        && frame->instructions.items[frame->instructions.len - 1].type == I_RET);
+
+#ifdef KOKOS_VM_COMPUTED_GOTO
+    VM_DISPATCH();
+#else
+dispatch:
+    VM_TRACE();
+    switch (ip->type) {
+#endif // KOKOS_VM_COMPUTED_GOTO
+
+    VM_CASE(I_PUSH)
+    {
+        VM_PUSH(TO_VALUE(ip->operand));
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_PUSH_CONST)
+    {
+        VM_PUSH(vm->store.constants->items[ip->operand]);
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_POP)
+    {
+        KOKOS_ASSERT(sp > locals + frame->locals_count);
+        sp--;
+        ip++;
+        VM_DISPATCH();
+    }
+// the generic arithmetic on two integers is quickened to `quickened`, which does the same with
+// wrapping 32-bit math
+#define VM_ARITH(t, exec, quickened, op)                                                           \
+    VM_CASE(t)                                                                                     \
+    {                                                                                              \
+        if (ip->operand == 2 && VM_BOTH_INT(sp[-2], sp[-1])) {                                     \
+            VM_QUICKEN(quickened);                                                                 \
+            VM_DISPATCH();                                                                         \
+        }                                                                                          \
+                                                                                                   \
+        VM_SLOW(exec(vm, ip->operand));                                                            \
+        ip++;                                                                                      \
+        VM_DISPATCH();                                                                             \
+    }                                                                                              \
+    VM_CASE(quickened)                                                                             \
+    {                                                                                              \
+        kokos_value_t rhs = sp[-1];                                                                \
+        kokos_value_t lhs = sp[-2];                                                                \
+        if (UNLIKELY(!VM_BOTH_INT(lhs, rhs))) {                                                    \
+            VM_QUICKEN(t);                                                                         \
+            VM_DISPATCH();                                                                         \
+        }                                                                                          \
+                                                                                                   \
+        int32_t res = (int32_t)((uint32_t)GET_INT(lhs) op (uint32_t)GET_INT(rhs));                 \
+        sp--;                                                                                      \
+        sp[-1] = TO_VALUE(TO_INT(res));                                                            \
+        ip++;                                                                                      \
+        VM_DISPATCH();                                                                             \
+    }
+
+    VM_ARITH(I_ADD, vm_exec_add, I_ADD_INT, +)
+    VM_ARITH(I_SUB, vm_exec_sub, I_SUB_INT, -)
+    VM_ARITH(I_MUL, vm_exec_mul, I_MUL_INT, *)
+
+#undef VM_ARITH
+    VM_CASE(I_DIV)
+    {
+        VM_SLOW(vm_exec_div(vm, ip->operand));
+        ip++;
+        VM_DISPATCH();
+    }
+#define VM_RESOLVE_CALLEE(proc)                                                                    \
+    do {                                                                                           \
+        if (GET_STRING_INT(ip->operand)) {                                                         \
+            (proc) = kokos_vm_resolve_global_callee(vm, ip);                                       \
+            if (!(proc)) {                                                                         \
+                VM_THROW();                                                                        \
+            }                                                                                      \
+        } else {                                                                                   \
+            kokos_value_t callee = VM_POP();                                                       \
+            if (CHECKED_VALUE_TAG(callee) != PROC_TAG) {                                           \
+                kokos_vm_ex_set_type_mismatch(vm, PROC_TAG, CHECKED_VALUE_TAG(callee));            \
+                VM_THROW();                                                                        \
+            }                                                                                      \
+                                                                                                   \
+            (proc) = GET_PROC(callee);                                                             \
+        }                                                                                          \
+    } while (0)
+
+// runs the procedure that was just entered in the current frame as machine code, then carries on
+// with the `I_RET` at the end of the code it finished in
+#define VM_RUN_COMPILED(proc)                                                                      \
+    do {                                                                                           \
+        VM_SLOW(kokos_vm_run_frame(vm, (proc)));                                                   \
+        ip = frame->instructions.items + frame->instructions.len - 1;                              \
+        KOKOS_ASSERT(ip->type == I_RET);                                                           \
+    } while (0)
+
+#define VM_CALL_NATIVE(proc, nargs)                                                                \
+    do {                                                                                           \
+        kokos_value_t ret = KOKOS_NIL;                                                             \
+        VM_SLOW((proc)->native(vm, (nargs), &ret));                                                \
+        VM_PUSH(ret);                                                                              \
+        ip++;                                                                                      \
+    } while (0)
+
+// calls the procedure on top of the operands, or the one bound to a name, with `nargs` arguments.
+// `vm->ip` is set to 0 so it points to the first instruction of the called procedure
+#define VM_CALL(nargs)                                                                             \
+    do {                                                                                           \
+        uint16_t call_nargs = (nargs);                                                             \
+        kokos_runtime_proc_t* proc;                                                                \
+        VM_RESOLVE_CALLEE(proc);                                                                   \
+                                                                                                   \
+        if (proc->type == PROC_NATIVE) {                                                           \
+            VM_CALL_NATIVE(proc, call_nargs);                                                      \
+            VM_DISPATCH();                                                                         \
+        }                                                                                          \
+                                                                                                   \
+        ip++;                                                                                      \
+        VM_SYNC();                                                                                 \
+        proc = kokos_vm_enter_proc(vm, proc, call_nargs, vm->ip);                                  \
+        if (!proc) {                                                                               \
+            return false;                                                                          \
+        }                                                                                          \
+                                                                                                   \
+        kokos_vm_profile_call(vm, proc);                                                           \
+        vm->ip = 0;                                                                                \
+        VM_RELOAD();                                                                               \
+                                                                                                   \
+        if (kokos_vm_runs_compiled(vm, proc)) {                                                    \
+            VM_RUN_COMPILED(proc);                                                                 \
+        }                                                                                          \
+                                                                                                   \
+        VM_DISPATCH();                                                                             \
+    } while (0)
+
+    VM_CASE(I_CALL)
+    {
+        VM_CALL(ip->operand >> 48);
+    }
+    // the argument count is a constant, which the arity check of a fixed-arity callee compares
+    // against
+    VM_CASE(I_CALL0)
+    {
+        VM_CALL(0);
+    }
+    VM_CASE(I_CALL1)
+    {
+        VM_CALL(1);
+    }
+    VM_CASE(I_CALL2)
+    {
+        VM_CALL(2);
+    }
+    VM_CASE(I_CALL3)
+    {
+        VM_CALL(3);
+    }
+    VM_CASE(I_TAIL_CALL)
+    {
+        uint16_t nargs = ip->operand >> 48;
+        kokos_runtime_proc_t* proc;
+        VM_RESOLVE_CALLEE(proc);
+
+        // natives don't need a frame, so there is nothing to reuse. carry on to the return
+        if (proc->type == PROC_NATIVE) {
+            VM_CALL_NATIVE(proc, nargs);
+            VM_DISPATCH();
+        }
+
+        VM_SYNC();
+        proc = kokos_vm_replace_proc(vm, proc, nargs);
+        if (!proc) {
+            return false;
+        }
+
+        kokos_vm_profile_call(vm, proc);
+        vm->ip = 0;
+        VM_RELOAD();
+
+        if (kokos_vm_runs_compiled(vm, proc)) {
+            VM_RUN_COMPILED(proc);
+        }
+
+        VM_DISPATCH();
     }
-    case I_NEQ: {
-        kokos_value_t top;
-        STACK_POP(&frame->stack, &top);
-        STACK_PUSH(&frame->stack, TO_BOOL(top.as_int != instruction.operand));
 
-        vm->ip++;
-        break;
+#undef VM_CALL
+#undef VM_CALL_NATIVE
+#undef VM_RUN_COMPILED
+#undef VM_RESOLVE_CALLEE
+
+    VM_CASE(I_RET)
+    {
+        // NOTE: leave the bottom frame on the stack so we can examine the top-level stack
+        // frame of the vm after it has ran
+        if (vm->frames.sp == base_frame) {
+            VM_SYNC();
+            vm->ip = frame->ret_location;
+            return true;
+        }
+
+        VM_SYNC();
+        vm->ip = frame->ret_location;
+        kokos_vm_pop_frame(vm);
+
+        VM_RELOAD();
+        VM_DISPATCH();
+    }
+    VM_CASE(I_ADD_GLOBAL)
+    {
+        kokos_runtime_string_t* name = GET_STRING_INT(ip->operand);
+        kokos_env_add(vm->globals, name, VM_POP());
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_GET_GLOBAL)
+    {
+        kokos_runtime_string_t* name = GET_STRING_INT(ip->operand);
+        kokos_value_t global;
+        if (!kokos_env_lookup(vm->globals, name, &global)) {
+            kokos_vm_ex_set_undefined_variable(vm, name);
+            VM_THROW();
+        }
+
+        VM_PUSH(global);
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_LOAD_SLOT)
+    {
+        KOKOS_ASSERT(ip->operand < frame->locals_count);
+        VM_PUSH(locals[ip->operand]);
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_LOAD_REST)
+    {
+        KOKOS_ASSERT(ip->operand < frame->locals_count);
+        kokos_value_t rest = locals[ip->operand];
+        if (IS_NIL(rest)) {
+            VM_SLOW(kokos_vm_push_rest(vm, ip->operand));
+        } else {
+            VM_PUSH(rest);
+        }
+
+        ip++;
+        VM_DISPATCH();
     }
-    case I_ALLOC: {
-        kokos_value_t value = kokos_alloc_value(vm, instruction.operand);
-        STACK_PUSH(&frame->stack, value);
-        vm->ip++;
-        break;
+    VM_CASE(I_STORE_SLOT)
+    {
+        KOKOS_ASSERT(ip->operand < frame->locals_count);
+        locals[ip->operand] = VM_POP();
+        ip++;
+        VM_DISPATCH();
     }
-    case I_PUSH_SCOPE: {
-        kokos_env_t* env = kokos_env_create(frame->env, instruction.operand);
-        frame->env = env;
-        vm->ip++;
-        break;
+    VM_CASE(I_BRANCH)
+    {
+        ip = frame->instructions.items + *(size_t*)ip->operand;
+        VM_DISPATCH();
     }
-    case I_POP_SCOPE: {
-        KOKOS_ASSERT(frame->env->parent != NULL);
+    VM_CASE(I_JZ)
+    {
+        kokos_value_t test = VM_POP();
+        if (!kokos_value_to_bool(test)) {
+            ip = frame->instructions.items + *(size_t*)ip->operand;
+            VM_DISPATCH();
+        }
 
-        kokos_env_t* env = frame->env;
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_JNZ)
+    {
+        kokos_value_t test = VM_POP();
+        if (kokos_value_to_bool(test)) {
+            ip = frame->instructions.items + *(size_t*)ip->operand;
+            VM_DISPATCH();
+        }
 
-        frame->env = frame->env->parent;
-        kokos_env_destroy(env);
-        vm->ip++;
-        break;
+        ip++;
+        VM_DISPATCH();
     }
+    VM_CASE(I_CMP)
+    {
+        if (VM_BOTH_INT(sp[-2], sp[-1])) {
+            kokos_instruction_type_e quickened = kokos_instruction_quicken_cmp(ip[1]);
+            if (quickened != I_CMP) {
+                VM_QUICKEN(quickened);
+                VM_DISPATCH();
+            }
+        }
+
+        kokos_value_t rhs = VM_POP();
+        kokos_value_t lhs = VM_POP();
+
+        VM_SLOW(kokos_cmp_values(vm, lhs, rhs));
+        ip++;
+        VM_DISPATCH();
+    }
+// a comparison of two integers quickened together with the `I_EQ`/`I_NEQ` after it, which it
+// skips
+#define VM_INT_CMP(t, op)                                                                          \
+    VM_CASE(t)                                                                                     \
+    {                                                                                              \
+        kokos_value_t rhs = sp[-1];                                                                \
+        kokos_value_t lhs = sp[-2];                                                                \
+        if (UNLIKELY(!VM_BOTH_INT(lhs, rhs))) {                                                    \
+            VM_QUICKEN(I_CMP);                                                                     \
+            VM_DISPATCH();                                                                         \
+        }                                                                                          \
+                                                                                                   \
+        sp--;                                                                                      \
+        sp[-1] = TO_BOOL(GET_INT(lhs) op GET_INT(rhs));                                            \
+        ip += 2;                                                                                   \
+        VM_DISPATCH();                                                                             \
+    }
+
+    VM_INT_CMP(I_LT_INT, <)
+    VM_INT_CMP(I_GT_INT, >)
+    VM_INT_CMP(I_LTE_INT, <=)
+    VM_INT_CMP(I_GTE_INT, >=)
+    VM_INT_CMP(I_EQ_INT, ==)
+    VM_INT_CMP(I_NEQ_INT, !=)
+
+#undef VM_INT_CMP
+
+// a comparison fused with the conditional jump that uses it, with the comparisons of two integers
+// and two doubles done inline
+#define VM_CMP_JUMP(t, op)                                                                         \
+    VM_CASE(t)                                                                                     \
+    {                                                                                              \
+        kokos_value_t rhs = VM_POP();                                                              \
+        kokos_value_t lhs = VM_POP();                                                              \
+        int cmp;                                                                                   \
+        if (VM_BOTH_INT(lhs, rhs)) {                                                               \
+            cmp = cmp_ints(GET_INT(lhs), GET_INT(rhs));                                            \
+        } else if (IS_DOUBLE(lhs) && IS_DOUBLE(rhs)) {                                             \
+            cmp = lhs.as_int == rhs.as_int ? 0 : cmp_doubles(lhs, rhs);                            \
+        } else {                                                                                   \
+            VM_SLOW(kokos_cmp_values(vm, lhs, rhs));                                               \
+            cmp = (int64_t)VM_POP().as_int;                                                        \
+        }                                                                                          \
+                                                                                                   \
+        if (cmp op 0) {                                                                            \
+            ip = frame->instructions.items + *(size_t*)ip->operand;                                \
+            VM_DISPATCH();                                                                         \
+        }                                                                                          \
+                                                                                                   \
+        ip++;                                                                                      \
+        VM_DISPATCH();                                                                             \
+    }
+
+    VM_CMP_JUMP(I_JLT, <)
+    VM_CMP_JUMP(I_JGT, >)
+    VM_CMP_JUMP(I_JLE, <=)
+    VM_CMP_JUMP(I_JGE, >=)
+    VM_CMP_JUMP(I_JEQ, ==)
+    VM_CMP_JUMP(I_JNE, !=)
+
+#undef VM_CMP_JUMP
+
+    VM_CASE(I_IS_CALLEE)
+    {
+        kokos_value_t proc = VM_POP();
+        VM_PUSH(TO_BOOL(kokos_vm_is_callee(vm, ip, proc)));
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_EQ)
+    {
+        kokos_value_t top = VM_POP();
+        VM_PUSH(TO_BOOL(top.as_int == ip->operand));
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_NEQ)
+    {
+        kokos_value_t top = VM_POP();
+        VM_PUSH(TO_BOOL(top.as_int != ip->operand));
+        ip++;
+        VM_DISPATCH();
+    }
+    VM_CASE(I_ALLOC)
+    {
+        VM_SYNC();
+        kokos_value_t value = kokos_alloc_value(vm, ip->operand);
+        sp = vm->stack.data + vm->stack.sp;
+
+        VM_PUSH(value);
+        ip++;
+        VM_DISPATCH();
+    }
+#ifndef KOKOS_VM_COMPUTED_GOTO
     default: {
         char buf[128] = { 0 };
         sprintf(buf, "execution of instruction %s is not implemented",
-            kokos_instruction_type_str(instruction.type));
+            kokos_instruction_type_str(ip->type));
         KOKOS_TODO(buf);
     }
     }
-
-    return true;
+#endif // KOKOS_VM_COMPUTED_GOTO
 }
 
+#undef VM_QUICKEN
+#undef VM_BOTH_INT
+#undef VM_SLOW
+#undef VM_THROW
+#undef VM_RELOAD
+#undef VM_RELOAD_STACK
+#undef VM_SYNC
+#undef VM_PEEK
+#undef VM_POP
+#undef VM_PUSH
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef VM_TRACE
+
 static const char* kokos_tag_str(uint16_t tag)
 {
     switch (tag) {
@@ -653,10 +1367,17 @@ static const char* kokos_tag_str(uint16_t tag)
 
 static void kokos_vm_dump_stack_trace(kokos_vm_t* vm)
 {
+    size_t printed = 0;
     while (vm->frames.sp != 1) {
-        kokos_frame_t* frame;
+        kokos_frame_t frame;
         STACK_POP(&vm->frames, &frame);
-        kokos_location_t where = frame->where.location;
+        if (printed++ == STACK_TRACE_MAX_FRAMES) {
+            printf("... %zu more\n", vm->frames.sp);
+            vm->frames.sp = 1;
+            break;
+        }
+
+        kokos_location_t where = frame.where.location;
         printf("%s:%lu:%lu\n", where.filename, where.row, where.col);
     }
 }
@@ -699,25 +1420,24 @@ static void kokos_vm_report_exception(kokos_vm_t* vm)
     kokos_vm_dump_stack_trace(vm);
 }
 
-static void kokos_vm_run_until_completion(kokos_vm_t* vm, kokos_code_t instructions)
+static void kokos_vm_run_until_completion(
+    kokos_vm_t* vm, kokos_code_t instructions, size_t locals_count, kokos_jit_entry_t entry)
 {
     if (vm->frames.sp == 0) {
-        kokos_frame_t* frame = alloc_frame(instructions.len, 79, instructions, NULL);
-        vm->frames.cap++;
-        STACK_PUSH(&vm->frames, frame);
+        kokos_vm_reset_frames(vm, instructions, locals_count);
     }
 
-    while (vm->ip < current_frame(vm)->instructions.len) {
-        if (!kokos_vm_exec_cur(vm)) {
-            kokos_vm_dump(vm);
-            kokos_vm_report_exception(vm);
-            exit(1);
-        }
+    bool ok = entry ? kokos_vm_run_compiled(vm, entry) : kokos_vm_exec(vm, 1);
+    if (!ok) {
+        kokos_vm_dump(vm);
+        kokos_vm_report_exception(vm);
+        exit(1);
     }
 }
 
 // TODO: setup a new context for each loaded module
-void kokos_vm_load_module(kokos_vm_t* vm, const kokos_compiled_module_t* module)
+static void kokos_vm_load_module_with(
+    kokos_vm_t* vm, const kokos_compiled_module_t* module, kokos_jit_entry_t entry)
 {
     for (size_t i = 0; i < module->string_store.length; i++) {
         const kokos_runtime_string_t* cur = module->string_store.items[i];
@@ -728,45 +1448,56 @@ void kokos_vm_load_module(kokos_vm_t* vm, const kokos_compiled_module_t* module)
         kokos_string_store_add(vm->store.strings, cur);
     }
 
-    kokos_vm_run_until_completion(vm, module->instructions);
+    kokos_vm_run_until_completion(vm, module->instructions, module->locals_count, entry);
 }
 
-bool kokos_vm_run_code(kokos_vm_t* vm, kokos_code_t code)
+void kokos_vm_load_module(kokos_vm_t* vm, const kokos_compiled_module_t* module)
 {
-    if (vm->frames.sp == 0) {
-        kokos_frame_t* frame = alloc_frame(code.len, 79, code, NULL);
-        vm->frames.cap++;
-        STACK_PUSH(&vm->frames, frame);
-    } else {
-        kokos_frame_t* f = STACK_PEEK(&vm->frames);
+    kokos_vm_load_module_with(vm, module, NULL);
+}
+
+void kokos_vm_load_compiled_module(
+    kokos_vm_t* vm, const kokos_compiled_module_t* module, kokos_jit_entry_t entry)
+{
+    kokos_vm_load_module_with(vm, module, entry);
+}
 
-        kokos_env_destroy(f->env);
-        f->env = kokos_env_create(NULL, 79);
+bool kokos_vm_run_code(kokos_vm_t* vm, kokos_code_t code, size_t locals_count)
+{
+    // every piece of code starts with a clean global environment
+    kokos_env_destroy(vm->globals);
+    vm->globals = kokos_env_create(NULL, 79);
 
-        f->stack.sp = 0;
-        f->ret_location = code.len;
-        f->instructions = code;
-    }
+    kokos_vm_reset_frames(vm, code, locals_count);
 
-    while (vm->ip < current_frame(vm)->instructions.len) {
-        TRY(kokos_vm_exec_cur(vm));
-    }
+    bool ok = kokos_vm_exec(vm, 1);
 
-    // reset this so that the subsequent calls to this procedure don't immediately return
+    // reset this so that the subsequent calls to this procedure don't immediately return, even
+    // after this one has thrown
     vm->ip = 0;
 
-    return true;
+    return ok;
+}
+
+kokos_value_t* kokos_vm_results(kokos_vm_t* vm, size_t* count)
+{
+    kokos_frame_t* frame = &vm->frames.data[0];
+    size_t operands = frame->base + frame->locals_count;
+
+    *count = vm->stack.sp - operands;
+    return vm->stack.data + operands;
 }
 
 void kokos_vm_dump(kokos_vm_t* vm)
 {
     kokos_frame_t* frame = current_frame(vm);
+    size_t operands = frame->base + frame->locals_count;
 
     printf("stack:\n");
-    for (size_t i = 0; i < frame->stack.sp; i++) {
-        printf("\t[%lu] ", i);
+    for (size_t i = operands; i < vm->stack.sp; i++) {
+        printf("\t[%lu] ", i - operands);
 
-        kokos_value_t cur = frame->stack.data[i];
+        kokos_value_t cur = vm->stack.data[i];
         kokos_value_print(cur);
 
         printf("\n");
@@ -777,10 +1508,15 @@ kokos_vm_t* kokos_vm_create(kokos_scope_t* scope)
 {
     kokos_vm_t* vm = KOKOS_ZALLOC(sizeof(kokos_vm_t));
     vm->store = (kokos_runtime_store_t) { .strings = scope->string_store,
+        .constants = scope->constants,
         .call_locations = scope->call_locations };
 
     vm->root_scope = scope;
-    vm->gc = kokos_gc_new(GC_INITIAL_CAP);
+    vm->globals = kokos_env_create(NULL, 79);
+    vm->gc = kokos_gc_new(GC_NURSERY_SIZE, GC_MIN_HEAP_SIZE, GC_MAX_HEAP_SIZE);
+    vm->gc.max_pause_us = GC_MAX_PAUSE_US;
+    vm->jit_enabled = true;
+    DA_INIT(&vm->call_caches, 1, 64);
     return vm;
 }
 
@@ -788,99 +1524,97 @@ void kokos_vm_destroy(kokos_vm_t* vm)
 {
     kokos_gc_destroy(&vm->gc);
 
-    for (size_t i = 0; i < vm->frames.cap; i++) {
-        kokos_env_destroy(vm->frames.data[i]->env);
-        KOKOS_FREE(vm->frames.data[i]);
-    }
+    KOKOS_FREE(vm->frames.data);
+    KOKOS_FREE(vm->stack.data);
+
+    kokos_env_destroy(vm->globals);
+    DA_FREE(&vm->call_caches);
 
     KOKOS_FREE(vm);
 }
 
-static void kokos_gc_mark_obj(kokos_gc_t* gc, kokos_gc_obj_t* obj)
+static void kokos_gc_evacuate_globals(kokos_gc_t* gc, kokos_env_t* globals)
 {
-    obj->flags |= OBJ_FLAG_MARKED;
-
-    switch (GET_TAG(obj->value.as_int)) {
-    case VECTOR_TAG: {
-        kokos_runtime_vector_t* vec = (kokos_runtime_vector_t*)(GET_PTR(obj->value));
-        for (size_t i = 0; i < vec->len; i++) {
-            kokos_gc_obj_t* gobj = kokos_gc_find(gc, vec->items[i]);
-
-            if (!gobj) {
-                continue;
-            }
+    HT_ITER_PTR(globals->vars, {
+        kokos_value_t value = FROM_PTR(kv->value);
+        kokos_gc_evacuate(gc, &value);
+        kv->value = TO_PTR(value);
+    });
+}
 
-            kokos_gc_mark_obj(gc, gobj);
-        }
+/// Marks the objects the globals and the frames reference
+static void kokos_gc_mark_roots(kokos_vm_t* vm)
+{
+    kokos_gc_t* gc = &vm->gc;
 
-        break;
+    HT_ITER(vm->globals->vars, { kokos_gc_mark_value(gc, FROM_PTR(kv.value)); });
+    for (size_t i = 0; i < vm->stack.sp; i++) {
+        kokos_gc_mark_value(gc, vm->stack.data[i]);
     }
-    case MAP_TAG: {
-        kokos_runtime_map_t* map = (kokos_runtime_map_t*)(GET_PTR(obj->value));
-        HT_ITER(map->table, {
-            kokos_gc_obj_t* key = kokos_gc_find(gc, TO_VALUE((uint64_t)kv.key));
-            kokos_gc_obj_t* value = kokos_gc_find(gc, TO_VALUE((uint64_t)kv.value));
-
-            if (key) {
-                kokos_gc_mark_obj(gc, key);
-            }
+}
 
-            if (value) {
-                kokos_gc_mark_obj(gc, value);
-            }
-        });
+/// Promotes everything reachable in the nursery to the old space. Once the old space has grown too
+/// large, it is marked a slice after every minor collection. The pages that are not swept by the
+/// allocation by then are swept a slice after the following minor collections.
+/// The globals and the frames are the roots, so rebinding a variable or a slot does not need a
+/// write barrier
+static void kokos_gc_collect(kokos_vm_t* vm)
+{
+    kokos_gc_t* gc = &vm->gc;
 
-        break;
-    }
-    default: {
-        char buf[128];
-        sprintf(buf, "tag: %lx, value: %lx", GET_TAG(obj->value.as_int), obj->value.as_int);
-        KOKOS_TODO(buf);
-    }
+    // the slots and the operands of every frame are all on the value stack
+    kokos_gc_evacuate_globals(gc, vm->globals);
+    for (size_t i = 0; i < vm->stack.sp; i++) {
+        kokos_gc_evacuate(gc, &vm->stack.data[i]);
     }
-}
 
-static void kokos_gc_mark_frame(kokos_gc_t* gc, const kokos_frame_t* frame)
-{
-    HT_ITER(frame->env->vars, {
-        kokos_value_t local = FROM_PTR(kv.value);
-        kokos_gc_obj_t* obj = kokos_gc_find(gc, local);
+    kokos_gc_scavenge(gc);
 
-        if (obj) {
-            KOKOS_ASSERT(IS_OCCUPIED(*obj));
-            kokos_gc_mark_obj(gc, obj);
+    if (!gc->marking) {
+        if (!kokos_gc_should_mark(gc)) {
+            kokos_gc_sweep_slice(gc);
+            return;
         }
-    });
 
-    for (size_t i = 0; i < frame->stack.sp; i++) {
-        kokos_value_t value = frame->stack.data[i];
-        kokos_gc_obj_t* obj = kokos_gc_find(gc, value);
+        kokos_gc_finish_sweep(gc);
+        gc->marking = true;
+        kokos_gc_mark_roots(vm);
+    }
 
-        if (obj) {
-            KOKOS_ASSERT(IS_OCCUPIED(*obj));
-            kokos_gc_mark_obj(gc, obj);
-        }
+    if (!kokos_gc_trace_slice(gc)) {
+        return;
     }
+
+    // the roots changed since they were marked. The nursery is empty, so what they reference now is
+    // the last of what is reachable
+    kokos_gc_mark_roots(vm);
+    kokos_gc_trace(gc);
+    kokos_gc_start_sweep(gc);
 }
 
-static void kokos_gc_collect(kokos_vm_t* vm)
+/// Returns the size of the object the values with `tag` point to, `cap` is the number of values a
+/// closure captures
+static size_t kokos_gc_object_size(uint64_t tag, size_t cap)
 {
-    for (size_t i = 0; i < vm->frames.sp; i++) {
-        const kokos_frame_t* frame = vm->frames.data[i];
-        kokos_gc_mark_frame(&vm->gc, frame);
+    switch (tag) {
+    case VECTOR_TAG: return sizeof(kokos_runtime_vector_t);
+    case MAP_TAG:    return sizeof(kokos_runtime_map_t);
+    case STRING_TAG: return sizeof(kokos_runtime_string_t);
+    case LIST_TAG:   return sizeof(kokos_runtime_list_t);
+    case PROC_TAG:   return kokos_closure_size(cap);
+    default:         KOKOS_TODO();
     }
+}
 
-    for (size_t i = 0; i < vm->gc.objects.cap; i++) {
-        kokos_gc_obj_t* obj = &vm->gc.objects.values[i];
-        if (!IS_OCCUPIED(*obj) || IS_MARKED(*obj)) {
-            continue;
-        }
-
-        obj->flags = 0;
-
-        kokos_gc_obj_free(obj);
-
-        vm->gc.objects.len--;
+/// Returns the size of `cap` elements of the collections with `tag`, or 0 if they are not stored
+/// along with the collection
+static size_t kokos_gc_elements_size(uint64_t tag, size_t cap)
+{
+    switch (tag) {
+    case VECTOR_TAG:
+    case LIST_TAG:   return cap * sizeof(kokos_value_t);
+    case STRING_TAG: return cap;
+    default:         return 0;
     }
 }
 
@@ -890,46 +1624,74 @@ void* kokos_vm_gc_alloc(kokos_vm_t* vm, uint64_t tag, size_t cap)
 
     kokos_gc_t* gc = &vm->gc;
 
-    if (gc->objects.len >= gc->max_objs) {
+    size_t size = kokos_gc_object_size(tag, cap);
+    size_t elements_size = kokos_gc_elements_size(tag, cap);
+
+    // the elements of a collection that still fits in a slot of the old space are stored right
+    // after it, so it takes a single allocation and is freed with the slot
+    bool inline_elements = sizeof(kokos_gc_header_t) + size + elements_size <= GC_MAX_SLOT_SIZE;
+    if (inline_elements) {
+        size += elements_size;
+    }
+
+    void* obj = kokos_gc_alloc(gc, tag, size);
+    if (UNLIKELY(!obj)) {
         kokos_gc_collect(vm);
+        obj = kokos_gc_alloc(gc, tag, size);
+        KOKOS_VERIFY(obj);
     }
 
-    void* addr;
     switch (tag) {
     case VECTOR_TAG: {
-        kokos_runtime_vector_t* vec = KOKOS_ALLOC(sizeof(kokos_runtime_vector_t));
-        DA_INIT(vec, 0, cap);
-        addr = vec;
-        break;
+        kokos_runtime_vector_t* vec = obj;
+        if (inline_elements) {
+            vec->items = (kokos_value_t*)(vec + 1);
+            vec->len = 0;
+            vec->cap = cap;
+        } else {
+            DA_INIT(vec, 0, cap);
+        }
+
+        return vec;
     }
     case MAP_TAG: {
-        hash_table table
+        kokos_runtime_map_t* map = obj;
+        map->table
             = ht_make(kokos_default_map_hash_func, kokos_default_map_eq_func, cap || DEFAULT_CAP);
-        kokos_runtime_map_t* map = KOKOS_ALLOC(sizeof(kokos_runtime_map_t));
-        map->table = table;
-        addr = map;
-        break;
+        return map;
     }
     case STRING_TAG: {
-        addr = kokos_runtime_string_new(NULL, 0);
-        break;
+        kokos_runtime_string_t* string = obj;
+        string->ptr = inline_elements ? (char*)(string + 1) : KOKOS_ALLOC(cap);
+        string->len = 0;
+        return string;
     }
     case LIST_TAG: {
-        kokos_runtime_list_t* list = KOKOS_ALLOC(sizeof(kokos_runtime_list_t));
+        kokos_runtime_list_t* list = obj;
         list->len = cap;
-        list->items = KOKOS_CALLOC(cap, sizeof(list->items[0]));
-        addr = list;
-        break;
+        if (inline_elements) {
+            list->items = (kokos_value_t*)(list + 1);
+            memset(list->items, 0, elements_size);
+        } else {
+            list->items = KOKOS_CALLOC(cap, sizeof(list->items[0]));
+        }
+
+        return list;
+    }
+    case PROC_TAG: {
+        kokos_runtime_proc_t* closure = obj;
+        closure->type = PROC_CLOSURE;
+        closure->closure.proc = NULL;
+        closure->closure.len = cap;
+        return closure;
     }
     default: KOKOS_TODO();
     }
 
-    kokos_gc_add_obj(gc, TO_VALUE((uint64_t)addr | (tag << 48)));
-    return addr;
-
 #undef DEFAULT_CAP
 }
 
+
 void kokos_vm_ex_set_type_mismatch(kokos_vm_t* vm, uint16_t expected, uint16_t got)
 {
     vm->registers.exception = (kokos_exception_t) {
@@ -6,6 +6,7 @@
 #include "env.h"
 #include "gc.h"
 #include "instruction.h"
+#include "jit.h"
 #include "value.h"
 #include "vmconstants.h"
 
@@ -70,25 +71,38 @@
 typedef struct {
     hash_table call_locations;
     kokos_string_store_t* strings;
+    const kokos_constant_pool_t* constants;
 } kokos_runtime_store_t;
 
+/// The values of every frame, one frame after the other: the slots of a frame, then its operands.
+/// The arguments of a call are the top operands of the caller, and the callee's first slots are
+/// right where they are
 typedef struct {
-    kokos_value_t data[OP_STACK_SIZE];
-    size_t sp;
-} kokos_op_stack_t;
+    kokos_value_t* data;
+    size_t sp; // same as the length
+    size_t cap;
+} kokos_value_stack_t;
 
-typedef struct {
-    kokos_op_stack_t stack;
+typedef struct kokos_frame {
     kokos_token_t where;
-    kokos_env_t* env;
+    // the slots for the parameters and `let` bindings start at `base` of the value stack, the
+    // compiler resolves every local variable to an index into them. The operands start right after
+    // the slots. This is an index, since the value stack moves when it grows
+    size_t base;
+    size_t locals_count;
+    // the rest arguments of a variadic procedure stay right below `base`, on the operands of the
+    // caller, until the frame returns. They are only put in a vector once the rest parameter is
+    // loaded, see `I_LOAD_REST`
+    size_t rest_count;
     size_t ret_location;
     kokos_code_t instructions;
 } kokos_frame_t;
 
+/// The frames themselves are not allocated on their own, so they move when the stack grows too
 typedef struct {
-    kokos_frame_t* data[FRAME_STACK_SIZE];
+    kokos_frame_t* data;
     size_t sp; // same as the length
-    size_t cap; // store this so we can reuse `popped` frames
+    size_t cap;
 } kokos_frame_stack_t;
 
 typedef enum {
@@ -124,15 +138,40 @@ typedef struct kokos_exception {
 
 const char* kokos_exception_to_string(const kokos_exception_t*);
 
+/// What a call by name was last resolved to, valid while the globals have the same version
+typedef struct {
+    uint64_t version;
+    kokos_runtime_proc_t* proc;
+} kokos_call_cache_t;
+
+typedef struct {
+    kokos_call_cache_t* items;
+    size_t len;
+    size_t cap;
+} kokos_call_cache_list_t;
+
 typedef struct kokos_vm {
     kokos_gc_t gc;
     kokos_runtime_store_t store;
     size_t ip;
+    kokos_value_stack_t stack;
     kokos_frame_stack_t frames;
+    kokos_env_t* globals;
     kokos_scope_t* root_scope;
+    // the inline caches of the calls by name, which the calls refer to by index, see
+    // `call_caches_count` of the root scope. Entry 0 is never filled, it stands for the calls that
+    // have not run yet
+    kokos_call_cache_list_t call_caches;
+
+    // compile hot procedures to machine code
+    bool jit_enabled;
+    // the number of calls of compiled code running, see MAX_COMPILED_DEPTH
+    size_t compiled_depth;
 
     struct {
         kokos_exception_t exception;
+        // the procedure compiled code tail called, see KOKOS_JIT_TAIL_CALL
+        const kokos_runtime_proc_t* tail_callee;
     } registers;
 } kokos_vm_t;
 
@@ -142,13 +181,36 @@ void kokos_vm_destroy(kokos_vm_t* vm);
 /// Load the module, adding it's strings to the runtime store, and execute it's code
 void kokos_vm_load_module(kokos_vm_t* vm, const kokos_compiled_module_t* module);
 
-bool kokos_vm_run_code(kokos_vm_t* vm, kokos_code_t code);
+/// Like `kokos_vm_load_module`, but runs `entry`, the module's code compiled ahead of time, instead
+/// of interpreting it
+void kokos_vm_load_compiled_module(
+    kokos_vm_t* vm, const kokos_compiled_module_t* module, kokos_jit_entry_t entry);
+
+bool kokos_vm_run_code(kokos_vm_t* vm, kokos_code_t code, size_t locals_count);
+
+/// Gets the operands the code `kokos_vm_run_code` ran left on the stack of the bottom frame
+kokos_value_t* kokos_vm_results(kokos_vm_t* vm, size_t* count);
 
 void kokos_vm_dump(kokos_vm_t* vm);
 
-/// Allocates a new value of the provided tag on the heap and returns a pointer to it
+/// Allocates a new value of the provided tag on the heap and returns a pointer to it. A collection
+/// gets room for `cap` elements, or a string for `cap` bytes, which are stored right after it when
+/// it is small
 void* kokos_vm_gc_alloc(kokos_vm_t* vm, uint64_t tag, size_t cap);
 
+// The compiled code calls these for what it doesn't do inline. They work on the operands of the
+// current frame, so `vm->stack.sp` has to be in sync, and return false if an exception was thrown.
+// The calls can grow the value stack, which moves it
+
+/// Executes an instruction of `type` with `operand` that does not transfer control
+bool kokos_vm_jit_step(kokos_vm_t* vm, kokos_instruction_type_e type, uint64_t operand);
+/// Whether the `I_IS_CALLEE` `instr` finds `proc`, which leaves the stack alone and never throws
+bool kokos_vm_jit_is_callee(kokos_vm_t* vm, kokos_instruction_t* instr, kokos_value_t proc);
+/// Executes the `I_CALL` `call`, running the callee until it returns
+bool kokos_vm_jit_call(kokos_vm_t* vm, kokos_instruction_t* call);
+/// Executes the `I_TAIL_CALL` `call`
+kokos_jit_status_e kokos_vm_jit_tail_call(kokos_vm_t* vm, kokos_instruction_t* call);
+
 void kokos_vm_ex_set_type_mismatch(kokos_vm_t* vm, uint16_t expected, uint16_t got);
 void kokos_vm_ex_set_arity_mismatch(kokos_vm_t* vm, size_t expected, size_t got);
 void kokos_vm_ex_custom_printf(kokos_vm_t* vm, const char* fmt, ...)
@@ -1,10 +1,34 @@
 #ifndef VMCONSTANTS_H_
 #define VMCONSTANTS_H_
 
-#define OP_STACK_SIZE 64
-#define FRAME_STACK_SIZE 1024
+// number of values and of frames the stacks of a vm start with room for, they grow as needed
+#define VALUE_STACK_INITIAL_CAP 256
+#define FRAME_STACK_INITIAL_CAP 16
 
-// use a prime number for capacity so it better works with the current `hash set` gc implementation
-#define GC_INITIAL_CAP 1069
+// the deepest calls can nest before a call throws, which only stops a runaway recursion
+#define MAX_CALL_DEPTH (1024 * 1024)
+
+// the deepest calls of compiled code can nest, compiled code calls on the C stack. The calls any
+// deeper are interpreted
+#define MAX_COMPILED_DEPTH 4096
+
+// the innermost frames a stack trace prints, the rest are only counted
+#define STACK_TRACE_MAX_FRAMES 64
+
+// size in bytes of the region new objects are bump allocated in, along with the elements of the
+// small collections
+#define GC_NURSERY_SIZE (512 * 1024)
+
+// the bounds, in bytes, of how much the old space may grow to before it is collected, see
+// `kokos_gc_should_mark`
+#define GC_MIN_HEAP_SIZE (4 * 1024 * 1024)
+#define GC_MAX_HEAP_SIZE ((size_t)1024 * 1024 * 1024)
+
+// the longest, in microseconds, the marking done after a minor collection may take. A full
+// collection marks the old space over as many minor collections as it needs, 0 marks it all at once
+#define GC_MAX_PAUSE_US 1000
+
+// number of interpreted calls after which a procedure is compiled to machine code
+#define JIT_CALL_THRESHOLD 64
 
 #endif // VMCONSTANTS_H_